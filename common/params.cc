@@ -1,9 +1,14 @@
 #include "common/params.h"
 
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/file.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <algorithm>
+#include <condition_variable>
 #include <csignal>
 #include <unordered_map>
 
@@ -83,6 +88,212 @@ private:
   int fd_ = -1;
 };
 
+// Process-wide cache of param values. An inotify watch on every params directory
+// invalidates entries when any process writes or removes a key, so cache hits need
+// no syscalls. Writes from other processes become visible once the watcher thread
+// has handled the inotify event.
+class ParamsCache {
+public:
+  static ParamsCache &instance() {
+    // never destroyed, the watcher thread may still be running at exit
+    static ParamsCache *cache = [] {
+      pthread_atfork([] { ParamsCache::instance().lock.lock(); },
+                     [] { ParamsCache::instance().lock.unlock(); },
+                     [] { ParamsCache::instance().resetAfterFork(); });
+      return new ParamsCache();
+    }();
+    return *cache;
+  }
+
+  std::string get(const std::string &dir, const std::string &key) {
+    uint64_t generation = 0;
+    {
+      std::lock_guard lk(lock);
+      if (Dir *d = watch(dir)) {
+        if (auto it = d->values.find(key); it != d->values.end()) {
+          return it->second;
+        }
+        generation = d->generation;
+      }
+    }
+
+    std::string value = util::read_file(dir + "/" + key);
+    std::lock_guard lk(lock);
+    // don't cache the value if the directory changed while reading it
+    if (auto it = dirs.find(dir); it != dirs.end() && it->second.generation == generation) {
+      it->second.values[key] = value;
+    }
+    return value;
+  }
+
+  void update(const std::string &dir, const std::string &key, const std::string *value) {
+    std::lock_guard lk(lock);
+    if (auto it = dirs.find(dir); it != dirs.end()) {
+      Dir &d = it->second;
+      ++d.generation;
+      if (value) {
+        d.values[key] = *value;
+      } else if (key.empty()) {
+        d.values.clear();
+      } else {
+        d.values.erase(key);
+      }
+    }
+  }
+
+  // wait until anything in dir changes, returns false on timeout
+  bool waitForChange(const std::string &dir, uint64_t generation, int timeout_ms) {
+    std::unique_lock lk(lock);
+    if (dirs.find(dir) == dirs.end()) {
+      // not watched, fall back to polling
+      cv.wait_for(lk, std::chrono::milliseconds(timeout_ms));
+      return false;
+    }
+    return cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] {
+      auto it = dirs.find(dir);
+      return it == dirs.end() || it->second.generation != generation;
+    });
+  }
+
+  uint64_t generation(const std::string &dir) {
+    std::lock_guard lk(lock);
+    Dir *d = watch(dir);
+    return d ? d->generation : 0;
+  }
+
+  int addHandler(const std::string &dir, const std::string &key, Params::ParamChangedHandler handler) {
+    std::lock_guard lk(lock);
+    watch(dir);
+    handlers[++handler_id] = {dir, key, handler};
+    return handler_id;
+  }
+
+  void removeHandler(int id) {
+    std::lock_guard lk(lock);
+    handlers.erase(id);
+  }
+
+private:
+  struct Dir {
+    int wd = -1;
+    uint64_t generation = 0;
+    std::unordered_map<std::string, std::string> values;
+  };
+  struct Handler {
+    std::string dir, key;
+    Params::ParamChangedHandler handler;
+  };
+
+  // must be called with the lock held. returns nullptr if the directory can't be watched.
+  Dir *watch(const std::string &dir) {
+#ifdef __linux__
+    if (auto it = dirs.find(dir); it != dirs.end()) return &it->second;
+
+    if (inotify_fd < 0) {
+      inotify_fd = inotify_init1(IN_CLOEXEC);
+      if (inotify_fd < 0) return nullptr;
+      std::thread(&ParamsCache::watcherThread, this, inotify_fd).detach();
+    }
+    const uint32_t mask = IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+                          IN_DELETE_SELF | IN_MOVE_SELF;
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), mask);
+    if (wd < 0) return nullptr;
+
+    wd_dirs[wd] = dir;
+    Dir &d = dirs[dir];
+    d.wd = wd;
+    return &d;
+#else
+    return nullptr;
+#endif
+  }
+
+  void watcherThread(int fd) {
+#ifdef __linux__
+    util::set_thread_name("params_watcher");
+    alignas(struct inotify_event) char buf[16 * 1024];
+    while (true) {
+      ssize_t len = HANDLE_EINTR(read(fd, buf, sizeof(buf)));
+      if (len <= 0) break;
+
+      std::vector<std::pair<std::string, std::string>> changed;
+      {
+        std::lock_guard lk(lock);
+        if (fd != inotify_fd) break;
+
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+          auto ev = (const struct inotify_event *)p;
+          if (ev->mask & IN_Q_OVERFLOW) {
+            // events were lost, drop everything and tell every handler
+            for (auto &[path, d] : dirs) {
+              ++d.generation;
+              d.values.clear();
+              changed.push_back({path, ""});
+            }
+            continue;
+          }
+
+          auto wd_it = wd_dirs.find(ev->wd);
+          if (wd_it == wd_dirs.end()) continue;
+
+          const std::string path = wd_it->second;
+          auto dir_it = dirs.find(path);
+          if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+            // the directory is gone, it is watched again on the next read
+            if (dir_it != dirs.end()) dirs.erase(dir_it);
+            if (ev->mask & IN_IGNORED) wd_dirs.erase(wd_it);
+            changed.push_back({path, ""});
+          } else if (dir_it != dirs.end() && ev->len > 0) {
+            ++dir_it->second.generation;
+            dir_it->second.values.erase(ev->name);
+            changed.push_back({path, ev->name});
+          }
+        }
+      }
+      cv.notify_all();
+      notifyHandlers(changed);
+    }
+#endif
+  }
+
+  void notifyHandlers(const std::vector<std::pair<std::string, std::string>> &changed) {
+    if (changed.empty()) return;
+
+    std::vector<std::pair<std::string, Params::ParamChangedHandler>> callbacks;
+    {
+      std::lock_guard lk(lock);
+      for (const auto &[dir, key] : changed) {
+        for (const auto &[id, h] : handlers) {
+          if (h.dir == dir && (key.empty() || h.key == key)) {
+            callbacks.push_back({h.key, h.handler});
+          }
+        }
+      }
+    }
+    for (const auto &[key, handler] : callbacks) {
+      handler(key);
+    }
+  }
+
+  // the watcher thread does not exist in a forked child, start over.
+  void resetAfterFork() {
+    if (inotify_fd >= 0) close(inotify_fd);
+    inotify_fd = -1;
+    dirs.clear();
+    wd_dirs.clear();
+    handlers.clear();
+    lock.unlock();
+  }
+
+  std::mutex lock;
+  std::condition_variable cv;
+  int inotify_fd = -1;
+  std::unordered_map<std::string, Dir> dirs;
+  std::unordered_map<int, std::string> wd_dirs;
+  std::map<int, Handler> handlers;
+  int handler_id = 0;
+};
+
 std::unordered_map<std::string, uint32_t> keys = {
     {"AccessToken", CLEAR_ON_MANAGER_START | DONT_LOG},
     {"AssistNowToken", PERSISTENT},
@@ -229,45 +440,68 @@ ParamKeyType Params::getKeyType(const std::string &key) {
 }
 
 int Params::put(const char* key, const char* value, size_t value_size) {
+  return putMany({{key, std::string(value, value_size)}});
+}
+
+int Params::putMany(const std::map<std::string, std::string> &values) {
   // Information about safely and atomically writing a file: https://lwn.net/Articles/457667/
-  // 1) Create temp file
-  // 2) Write data to temp file
-  // 3) fsync() the temp file
-  // 4) rename the temp file to the real name
-  // 5) fsync() the containing directory
-  std::string tmp_path = params_path + "/.tmp_value_XXXXXX";
-  int tmp_fd = mkstemp((char*)tmp_path.c_str());
-  if (tmp_fd < 0) return -1;
+  // 1) Create temp files
+  // 2) Write data to temp files
+  // 3) fsync() the temp files
+  // 4) rename the temp files to the real names
+  // 5) fsync() the containing directory once for all keys
+  // each key is replaced atomically, a crash may leave only some of the keys updated.
+  std::vector<std::pair<std::string, int>> tmp_files;
+  tmp_files.reserve(values.size());
+
+  int result = 0;
+  for (const auto &[key, value] : values) {
+    std::string tmp_path = params_path + "/.tmp_value_XXXXXX";
+    int tmp_fd = mkstemp((char*)tmp_path.c_str());
+    if (tmp_fd < 0) {
+      result = -1;
+      break;
+    }
+    tmp_files.push_back({tmp_path, tmp_fd});
 
-  int result = -1;
-  do {
     // Write value to temp.
-    ssize_t bytes_written = HANDLE_EINTR(write(tmp_fd, value, value_size));
-    if (bytes_written < 0 || (size_t)bytes_written != value_size) {
+    ssize_t bytes_written = HANDLE_EINTR(write(tmp_fd, value.data(), value.size()));
+    if (bytes_written < 0 || (size_t)bytes_written != value.size()) {
       result = -20;
       break;
     }
 
     // fsync to force persist the changes.
     if ((result = fsync(tmp_fd)) < 0) break;
+  }
 
+  if (result == 0) {
     FileLock file_lock(params_path + "/.lock");
 
-    // Move temp into place.
-    if ((result = rename(tmp_path.c_str(), getParamPath(key).c_str())) < 0) break;
+    // Move temps into place.
+    auto tmp = tmp_files.begin();
+    for (auto it = values.begin(); it != values.end(); ++it, ++tmp) {
+      if ((result = rename(tmp->first.c_str(), getParamPath(it->first).c_str())) < 0) break;
+      ParamsCache::instance().update(getParamPath(), it->first, &it->second);
+    }
 
     // fsync parent directory
-    result = fsync_dir(getParamPath());
-  } while (false);
+    if (result == 0) {
+      result = fsync_dir(getParamPath());
+    }
+  }
 
-  close(tmp_fd);
-  ::unlink(tmp_path.c_str());
+  for (const auto &[tmp_path, tmp_fd] : tmp_files) {
+    close(tmp_fd);
+    ::unlink(tmp_path.c_str());
+  }
   return result;
 }
 
 int Params::remove(const std::string &key) {
   FileLock file_lock(params_path + "/.lock");
   int result = unlink(getParamPath(key).c_str());
+  ParamsCache::instance().update(getParamPath(), key, nullptr);
   if (result != 0) {
     return result;
   }
@@ -275,8 +509,9 @@ int Params::remove(const std::string &key) {
 }
 
 std::string Params::get(const std::string &key, bool block) {
+  ParamsCache &cache = ParamsCache::instance();
   if (!block) {
-    return util::read_file(getParamPath(key));
+    return cache.get(getParamPath(), key);
   } else {
     // blocking read until successful
     params_do_exit = 0;
@@ -285,10 +520,12 @@ std::string Params::get(const std::string &key, bool block) {
 
     std::string value;
     while (!params_do_exit) {
-      if (value = util::read_file(getParamPath(key)); !value.empty()) {
+      uint64_t generation = cache.generation(getParamPath());
+      if (value = cache.get(getParamPath(), key); !value.empty()) {
         break;
       }
-      util::sleep_for(100);  // 0.1 s
+      // woken up by the write, the timeout is only to check for signals
+      cache.waitForChange(getParamPath(), generation, 100);
     }
 
     std::signal(SIGINT, prev_handler_sigint);
@@ -320,5 +557,14 @@ void Params::clearAll(ParamKeyType key_type) {
     closedir(d);
   }
 
+  ParamsCache::instance().update(getParamPath(), {}, nullptr);
   fsync_dir(getParamPath());
 }
+
+int Params::watch(const std::string &key, ParamChangedHandler handler) {
+  return ParamsCache::instance().addHandler(getParamPath(), key, handler);
+}
+
+void Params::unwatch(int id) {
+  ParamsCache::instance().removeHandler(id);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
@@ -34,6 +35,11 @@ public:
   }
   std::map<std::string, std::string> readAll();
 
+  // the handler is called from a background thread after the key is written or removed by any process
+  typedef std::function<void(const std::string &key)> ParamChangedHandler;
+  int watch(const std::string &key, ParamChangedHandler handler);
+  void unwatch(int id);
+
   // helpers for writing values
   int put(const char *key, const char *val, size_t value_size);
   inline int put(const std::string &key, const std::string &val) {
@@ -42,6 +48,8 @@ public:
   inline int putBool(const std::string &key, bool val) {
     return put(key.c_str(), val ? "1" : "0", 1);
   }
+  // write several values with a single lock and a single directory fsync
+  int putMany(const std::map<std::string, std::string> &values);
 
 private:
   std::string params_path;
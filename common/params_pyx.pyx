@@ -1,6 +1,7 @@
 # distutils: language = c++
 # cython: language_level = 3
 from libcpp cimport bool
+from libcpp.map cimport map
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 import threading
@@ -20,6 +21,7 @@ cdef extern from "common/params.h":
     int remove(string) nogil
     int put(string, string) nogil
     int putBool(string, bool) nogil
+    int putMany(map[string, string]) nogil
     bool checkKey(string) nogil
     string getParamPath(string) nogil
     void clearAll(ParamKeyType)
@@ -87,6 +89,17 @@ cdef class Params:
     with nogil:
       self.p.put(k, dat_bytes)
 
+  def put_many(self, values):
+    """
+    Write several params with a single lock and directory fsync.
+    Each key is written atomically, but not the batch as a whole.
+    """
+    cdef map[string, string] m
+    for key, dat in values.items():
+      m[self.check_key(key)] = ensure_bytes(dat)
+    with nogil:
+      self.p.putMany(m)
+
   def put_bool(self, key, bool val):
     cdef string k = self.check_key(key)
     with nogil:
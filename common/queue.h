@@ -1,8 +1,22 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <queue>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime>
+#endif
 
 template <class T>
 class SafeQueue {
@@ -50,3 +64,238 @@ private:
   std::condition_variable cv;
   std::queue<T> q;
 };
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Wakes up threads blocked on a lock-free queue. Waiters only sleep in the kernel (futex on linux)
+// and notify only makes a syscall when somebody is actually waiting.
+class QueueSignal {
+public:
+  // call before re-checking the queue, then pass the result to wait()
+  inline uint32_t prepare_wait() {
+    waiters_.fetch_add(1);
+    return seq_.load();
+  }
+  inline void cancel_wait() { waiters_.fetch_sub(1); }
+
+  // returns false on timeout. timeout_ms < 0 waits forever.
+  bool wait(uint32_t seq, int timeout_ms) {
+    bool ret = true;
+#ifdef __linux__
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    if (syscall(SYS_futex, &seq_, FUTEX_WAIT_PRIVATE, seq, timeout_ms < 0 ? nullptr : &ts, nullptr, 0) == -1) {
+      ret = errno != ETIMEDOUT;
+    }
+#else
+    std::unique_lock lk(m_);
+    auto pred = [&] { return seq_.load() != seq; };
+    if (timeout_ms < 0) {
+      cv_.wait(lk, pred);
+    } else {
+      ret = cv_.wait_for(lk, std::chrono::milliseconds(timeout_ms), pred);
+    }
+#endif
+    waiters_.fetch_sub(1);
+    return ret;
+  }
+
+  inline void notify() {
+    // pairs with prepare_wait(): either the waiter sees the queue change, or we see the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load() > 0) {
+      seq_.fetch_add(1);
+#ifdef __linux__
+      syscall(SYS_futex, &seq_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+      { std::lock_guard lk(m_); }
+      cv_.notify_all();
+#endif
+    }
+  }
+
+  // retry op() until it succeeds, sleeping on the signal in between.
+  template <class F>
+  bool wait_for(F op, int timeout_ms = -1) {
+    // a short spin avoids the syscalls when the other side is only a few hundred ns behind
+    for (int i = 0; i < SPIN_COUNT; ++i) {
+      if (op()) return true;
+      std::this_thread::yield();
+    }
+    if (timeout_ms == 0) return false;
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+      uint32_t seq = prepare_wait();
+      if (op()) {
+        cancel_wait();
+        return true;
+      }
+      int remaining_ms = -1;
+      if (timeout_ms >= 0) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        remaining_ms = std::max<int>(0, remaining.count());
+      }
+      if (!wait(seq, remaining_ms) || remaining_ms == 0) {
+        return op();
+      }
+    }
+  }
+
+private:
+  static constexpr int SPIN_COUNT = 64;
+  std::atomic<uint32_t> seq_ = 0;
+  std::atomic<uint32_t> waiters_ = 0;
+#ifndef __linux__
+  std::mutex m_;
+  std::condition_variable cv_;
+#endif
+};
+
+// Bounded lock-free ring for exactly one producer thread and one consumer thread.
+// push() blocks while the ring is full, pop() blocks while it is empty.
+template <class T, size_t N>
+class SPSCQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+  SPSCQueue() = default;
+
+  bool try_push(const T& v) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == N) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == N) return false;
+    }
+    buf_[tail & (N - 1)] = v;
+    tail_.store(tail + 1, std::memory_order_release);
+    not_empty_.notify();
+    return true;
+  }
+
+  void push(const T& v) {
+    not_full_.wait_for([&] { return try_push(v); });
+  }
+
+  T pop() {
+    T v{};
+    not_empty_.wait_for([&] { return pop_one(v); });
+    return v;
+  }
+
+  bool try_pop(T& v, int timeout_ms = 0) {
+    return not_empty_.wait_for([&] { return pop_one(v); }, timeout_ms);
+  }
+
+  bool empty() const { return size() == 0; }
+  size_t size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+
+private:
+  bool pop_one(T& v) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) return false;
+    }
+    v = buf_[head & (N - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    not_full_.notify();
+    return true;
+  }
+
+  // consumer side
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_ = 0;
+  size_t tail_cache_ = 0;
+  // producer side
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_ = 0;
+  size_t head_cache_ = 0;
+
+  alignas(CACHE_LINE_SIZE) QueueSignal not_empty_;
+  alignas(CACHE_LINE_SIZE) QueueSignal not_full_;
+  alignas(CACHE_LINE_SIZE) T buf_[N] = {};
+};
+
+// Bounded lock-free ring for any number of producers and consumers (Vyukov's per-cell sequence scheme).
+template <class T, size_t N>
+class MPMCQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+  MPMCQueue() {
+    for (size_t i = 0; i < N; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool try_push(const T& v) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & (N - 1)];
+      const intptr_t diff = (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.data = v;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          not_empty_.notify();
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void push(const T& v) {
+    not_full_.wait_for([&] { return try_push(v); });
+  }
+
+  T pop() {
+    T v{};
+    not_empty_.wait_for([&] { return pop_one(v); });
+    return v;
+  }
+
+  bool try_pop(T& v, int timeout_ms = 0) {
+    return not_empty_.wait_for([&] { return pop_one(v); }, timeout_ms);
+  }
+
+  bool empty() const { return size() == 0; }
+  size_t size() const {
+    const size_t head = head_.load(std::memory_order_acquire);
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+private:
+  bool pop_one(T& v) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & (N - 1)];
+      const intptr_t diff = (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          v = cell.data;
+          cell.seq.store(pos + N, std::memory_order_release);
+          not_full_.notify();
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // empty
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  struct alignas(CACHE_LINE_SIZE) Cell {
+    std::atomic<size_t> seq;
+    T data = {};
+  };
+
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_ = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_ = 0;
+  alignas(CACHE_LINE_SIZE) QueueSignal not_empty_;
+  alignas(CACHE_LINE_SIZE) QueueSignal not_full_;
+  Cell cells_[N];
+};
@@ -5,18 +5,185 @@
 #include "common/statlog.h"
 #include "common/util.h"
 
+#include <pthread.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <map>
 #include <stdio.h>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <zmq.h>
 
+// Metrics are aggregated in a per-process table and sent as one binary batch every STATLOG_FLUSH_INTERVAL_MS:
+//   "STB1", then per metric: u8 type, u8 name length, name, and
+//     gauge, counter: f64 value
+//     sample: u32 count, f64 sum, f64 min, f64 max, u16 bucket count, (i32 bucket, u32 count) * bucket count
+// all little endian. Samples are kept as a log-scale histogram (see statlog_bucket), so selfdrive/statsd.py
+// can still compute percentiles. STATLOG_TEXT=1 sends every call as a "name:value|type" string instead.
+
+const int STATLOG_FLUSH_INTERVAL_MS = 1000;
+const char STATLOG_BATCH_MAGIC[] = "STB1";
+const int STATLOG_BUCKETS_PER_OCTAVE = 32;
+const int STATLOG_BUCKET_OFFSET = 32768;
+
+// bucket keys have a relative width of 2^(1/32) (~2%). keep in sync with selfdrive/statsd.py
+static int32_t statlog_bucket(double value) {
+  if (value == 0 || !std::isfinite(value)) return 0;
+  int32_t b = std::floor(std::log2(std::abs(value)) * STATLOG_BUCKETS_PER_OCTAVE);
+  b = std::clamp(b, 1 - STATLOG_BUCKET_OFFSET, STATLOG_BUCKET_OFFSET - 1) + STATLOG_BUCKET_OFFSET;
+  return value > 0 ? b : -b;
+}
+
+struct Metric {
+  char type;
+  bool updated = false;
+  double value = 0;
+  // samples
+  uint32_t count = 0;
+  double sum = 0, min = 0, max = 0;
+  std::map<int32_t, uint32_t> buckets;
+};
+
 class StatlogState : public LogState {
   public:
     StatlogState() : LogState("ipc:///tmp/stats") {}
+
+    const bool text = util::getenv("STATLOG_TEXT", 0) != 0;
+    std::map<std::string, Metric, std::less<>> metrics;
+    std::string batch;
+    std::thread flush_thread;
+    std::condition_variable cv;
+    bool exit = false;
 };
 
 static StatlogState s = {};
 
+template <class T>
+static void append(std::string &buf, T v) {
+  buf.append((const char *)&v, sizeof(v));
+}
+
+// s.lock must be held
+static void flush() {
+  if (!s.initialized) s.initialize();
+
+  std::string &buf = s.batch;
+  buf.assign(STATLOG_BATCH_MAGIC, 4);
+  for (auto &[name, m] : s.metrics) {
+    if (!m.updated) continue;
+
+    const uint8_t name_len = std::min<size_t>(name.size(), UINT8_MAX);
+    append<char>(buf, m.type);
+    append<uint8_t>(buf, name_len);
+    buf.append(name.data(), name_len);
+    if (m.type == 's') {
+      append<uint32_t>(buf, m.count);
+      append<double>(buf, m.sum);
+      append<double>(buf, m.min);
+      append<double>(buf, m.max);
+      const size_t n_pos = buf.size();
+      append<uint16_t>(buf, 0);
+      uint16_t n = 0;
+      for (auto it = m.buckets.begin(); it != m.buckets.end();) {
+        // keep the nodes of buckets that are in use, so steady state sampling doesn't allocate
+        if (it->second == 0) {
+          it = m.buckets.erase(it);
+          continue;
+        }
+        if (n < UINT16_MAX) {
+          append<int32_t>(buf, it->first);
+          append<uint32_t>(buf, it->second);
+          ++n;
+        }
+        (it++)->second = 0;
+      }
+      memcpy(&buf[n_pos], &n, sizeof(n));
+      m.count = 0;
+      m.sum = 0;
+    } else {
+      append<double>(buf, m.value);
+      if (m.type == 'c') m.value = 0;
+    }
+    m.updated = false;
+  }
+
+  if (buf.size() > 4) {
+    zmq_send(s.sock, buf.data(), buf.size(), ZMQ_NOBLOCK);
+  }
+}
+
+static void flush_thread() {
+  util::set_thread_name("statlog");
+  std::unique_lock lk(s.lock);
+  while (!s.exit) {
+    s.cv.wait_for(lk, std::chrono::milliseconds(STATLOG_FLUSH_INTERVAL_MS));
+    flush();
+  }
+}
+
+static void stop_flush_thread() {
+  {
+    std::lock_guard lk(s.lock);
+    s.exit = true;
+  }
+  s.cv.notify_all();
+  // a forked child only has a flush thread if it logged something itself
+  if (s.flush_thread.joinable()) s.flush_thread.join();
+}
+
+// s.lock must be held
+static void start_flush_thread() {
+  static bool registered = [] {
+    pthread_atfork([] { s.lock.lock(); },
+                   [] { s.lock.unlock(); },
+                   [] {
+                     // the flush thread doesn't exist in the child, and the parent sends what it aggregated so far
+                     s.lock.unlock();
+                     new (&s.flush_thread) std::thread();
+                     s.metrics.clear();
+                   });
+    // sends what's left at exit
+    std::atexit(stop_flush_thread);
+    return true;
+  }();
+  (void)registered;
+  if (!s.flush_thread.joinable()) {
+    s.flush_thread = std::thread(flush_thread);
+  }
+}
+
+static void aggregate(char type, const char* metric, double value) {
+  std::lock_guard lk(s.lock);
+  if (s.exit) return;
+  if (!s.flush_thread.joinable()) start_flush_thread();
+
+  auto it = s.metrics.find(std::string_view(metric));
+  if (it == s.metrics.end()) {
+    it = s.metrics.emplace(metric, Metric{}).first;
+    it->second.type = type;
+  }
+  Metric &m = it->second;
+  if (type == 'g') {
+    m.value = value;
+  } else if (type == 'c') {
+    m.value += value;
+  } else {
+    m.min = m.count == 0 ? value : std::min(m.min, value);
+    m.max = m.count == 0 ? value : std::max(m.max, value);
+    m.count += 1;
+    m.sum += value;
+    m.buckets[statlog_bucket(value)] += 1;
+  }
+  m.updated = true;
+}
+
 static void log(const char* metric_type, const char* metric, const char* fmt, ...) {
   std::lock_guard lk(s.lock);
   if (!s.initialized) s.initialize();
@@ -39,9 +206,17 @@ static void log(const char* metric_type, const char* metric, const char* fmt, ..
 }
 
 void statlog_log(const char* metric_type, const char* metric, int value) {
-  log(metric_type, metric, "%d", value);
+  if (s.text) {
+    log(metric_type, metric, "%d", value);
+  } else {
+    aggregate(metric_type[0], metric, value);
+  }
 }
 
 void statlog_log(const char* metric_type, const char* metric, float value) {
-  log(metric_type, metric, "%f", value);
+  if (s.text) {
+    log(metric_type, metric, "%f", value);
+  } else {
+    aggregate(metric_type[0], metric, value);
+  }
 }
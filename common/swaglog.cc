@@ -4,16 +4,26 @@
 
 #include "common/swaglog.h"
 
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <zmq.h>
 #include "json11.hpp"
 
+#include "common/queue.h"
 #include "common/util.h"
 #include "common/version.h"
 #include "system/hardware/hw.h"
@@ -68,34 +78,315 @@ static void log(int levelnum, const char* filename, int lineno, const char* func
   zmq_send(s.sock, (levelnum_c + log_s).c_str(), log_s.length() + 1, ZMQ_NOBLOCK);
 }
 
-static void cloudlog_common(int levelnum, const char* filename, int lineno, const char* func,
-                            char* msg_buf, const json11::Json::object &msg_j={}) {
-  std::lock_guard lk(s.lock);
-  if (!s.initialized) s.initialize();
-
+// s.lock must be held and s initialized
+static void encode_and_log(int levelnum, const char* filename, int lineno, const char* func, double created,
+                           const char* msg, const json11::Json::object &msg_j={}) {
   json11::Json::object log_j = json11::Json::object {
     {"ctx", s.ctx_j},
     {"levelnum", levelnum},
     {"filename", filename},
     {"lineno", lineno},
     {"funcname", func},
-    {"created", seconds_since_epoch()}
+    {"created", created}
   };
   if (msg_j.empty()) {
-    log_j["msg"] = msg_buf;
+    log_j["msg"] = msg;
   } else {
     log_j["msg"] = msg_j;
   }
 
   std::string log_s = ((json11::Json)log_j).dump();
-  log(levelnum, filename, lineno, func, msg_buf, log_s);
+  log(levelnum, filename, lineno, func, msg, log_s);
+}
+
+static json11::Json::object timestamp_json(const char* msg, uint64_t nanos, uint32_t frame_id) {
+  json11::Json::object tspt_j = json11::Json::object{
+    {"event", msg},
+    {"time", std::to_string(nanos)}
+  };
+  if (frame_id < NO_FRAME_ID) {
+    tspt_j["frame_id"] = std::to_string(frame_id);
+  }
+  return json11::Json::object{{"timestamp", tspt_j}};
+}
+
+static void cloudlog_common(int levelnum, const char* filename, int lineno, const char* func,
+                            char* msg_buf, const json11::Json::object &msg_j={}) {
+  std::lock_guard lk(s.lock);
+  if (!s.initialized) s.initialize();
+  encode_and_log(levelnum, filename, lineno, func, seconds_since_epoch(), msg_buf, msg_j);
   free(msg_buf);
 }
 
+// Async mode (SWAGLOG_ASYNC=1 or cloudlog_set_async(true)): the calling thread only formats the message
+// into a preallocated record of its own ring, a background thread does the JSON encoding and the zmq send.
+// Messages longer than the record are truncated, and records are dropped (and counted) while the ring is full.
+
+constexpr int ASYNC_RING_SIZE = 128;
+constexpr int ASYNC_MSG_SIZE = 1024 - 64;
+constexpr int FLUSH_INTERVAL_MS = 10;
+
+struct LogRecord {
+  int levelnum;
+  const char* filename;
+  int lineno;
+  const char* func;
+  double created;
+  uint64_t nanos;
+  uint32_t frame_id;
+  bool timestamp;
+  char msg[ASYNC_MSG_SIZE];
+};
+
+struct LogRing {
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head = 0;  // consumer
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail = 0;  // producer
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<bool> closed = false;
+  int tid = 0;
+  double last_drop_report = 0;  // worker only
+  LogRecord records[ASYNC_RING_SIZE];
+
+  bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+};
+
+class AsyncLogger {
+public:
+  ~AsyncLogger() { shutdown(); }
+
+  void shutdown() {
+    // late log calls from other threads go through the synchronous path
+    enabled = false;
+    stop();
+  }
+
+  LogRecord *claim() {
+    LogRing *ring = thread_ring.ring;
+    if (!ring) ring = thread_ring.ring = registerRing();
+    if (!running.load(std::memory_order_relaxed)) start();
+
+    const size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == ASYNC_RING_SIZE) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      total_dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &ring->records[tail % ASYNC_RING_SIZE];
+  }
+
+  void commit() {
+    LogRing *ring = thread_ring.ring;
+    const size_t tail = ring->tail.load(std::memory_order_relaxed) + 1;
+    ring->tail.store(tail, std::memory_order_release);
+    // the worker polls every FLUSH_INTERVAL_MS, only wake it early when the ring is filling up
+    if (tail - ring->head.load(std::memory_order_relaxed) >= ASYNC_RING_SIZE / 2) {
+      signal.notify();
+    }
+  }
+
+  void flush() {
+    while (running) {
+      {
+        std::lock_guard lk(rings_lock);
+        if (std::all_of(rings.begin(), rings.end(), [](auto r) { return r->empty(); })) break;
+      }
+      signal.notify();
+      util::sleep_for(1);
+    }
+  }
+
+  void stop() {
+    std::unique_lock lk(rings_lock);
+    if (running) {
+      exit = true;
+      lk.unlock();
+      signal.notify();
+      thread.join();
+      lk.lock();
+      running = false;
+      exit = false;
+    }
+  }
+
+  uint64_t totalDropped() const { return total_dropped; }
+
+  std::atomic<bool> enabled = util::getenv("SWAGLOG_ASYNC", 0) != 0;
+
+private:
+  // frees the ring once the worker has drained it
+  struct ThreadRing {
+    LogRing *ring = nullptr;
+    ~ThreadRing() { if (ring) ring->closed = true; }
+  };
+
+  LogRing *registerRing() {
+    LogRing *ring = new LogRing();
+    ring->tid = syscall(SYS_gettid);
+    std::lock_guard lk(rings_lock);
+    static bool atfork_registered = [] {
+      pthread_atfork([] { async_logger.rings_lock.lock(); },
+                     [] { async_logger.rings_lock.unlock(); },
+                     [] { async_logger.resetAfterFork(); });
+      return true;
+    }();
+    (void)atfork_registered;
+    rings.push_back(ring);
+    return ring;
+  }
+
+  void start() {
+    std::lock_guard lk(rings_lock);
+    static bool atexit_registered = [] {
+      // exit handlers run in reverse order of registration, interleaved with static destructors.
+      // json11 keeps function-local statics: create them first so they outlive the last flush.
+      json11::Json();
+      std::atexit([] { async_logger.shutdown(); });
+      return true;
+    }();
+    (void)atexit_registered;
+    if (!running) {
+      thread = std::thread(&AsyncLogger::logThread, this);
+      running = true;
+    }
+  }
+
+  void resetAfterFork() {
+    // the worker and all other threads are gone in the child: drop their records, keep only this thread's ring.
+    rings_lock.unlock();
+    for (LogRing *ring : rings) {
+      ring->head = ring->tail.load();
+      if (ring != thread_ring.ring) ring->closed = true;
+    }
+    // the worker doesn't exist in the child, forget its handle without joining
+    new (&thread) std::thread();
+    running = false;
+    exit = false;
+  }
+
+  // returns true if any record was sent
+  bool drain(LogRing *ring) {
+    const size_t tail = ring->tail.load(std::memory_order_acquire);
+    const size_t head = ring->head.load(std::memory_order_relaxed);
+    const double now = millis_since_boot();
+    // report drops at most once a second per thread
+    const bool report_drops = ring->dropped.load(std::memory_order_relaxed) > 0 &&
+                              (ring->closed || exit || now - ring->last_drop_report >= 1000);
+    if (head == tail && !report_drops) return false;
+
+    std::lock_guard lk(s.lock);
+    if (!s.initialized) s.initialize();
+    for (size_t i = head; i != tail; ++i) {
+      const LogRecord &r = ring->records[i % ASYNC_RING_SIZE];
+      if (r.timestamp) {
+        encode_and_log(r.levelnum, r.filename, r.lineno, r.func, r.created, r.msg, timestamp_json(r.msg, r.nanos, r.frame_id));
+      } else {
+        encode_and_log(r.levelnum, r.filename, r.lineno, r.func, r.created, r.msg);
+      }
+      ring->head.store(i + 1, std::memory_order_release);
+    }
+
+    if (report_drops) {
+      ring->last_drop_report = now;
+      std::string msg = util::string_format("swaglog: %llu messages dropped on thread %d, ring full",
+                                            (unsigned long long)ring->dropped.exchange(0, std::memory_order_relaxed), ring->tid);
+      encode_and_log(CLOUDLOG_WARNING, __FILE__, __LINE__, __func__, seconds_since_epoch(), msg.c_str());
+    }
+    return head != tail;
+  }
+
+  void logThread() {
+    util::set_thread_name("swaglog");
+    std::vector<LogRing *> pending;
+    while (true) {
+      {
+        std::lock_guard lk(rings_lock);
+        // a closed ring gets no more records, free it once it's empty
+        auto it = std::remove_if(rings.begin(), rings.end(), [](LogRing *r) {
+          if (r->closed && r->empty() && r->dropped == 0) {
+            delete r;
+            return true;
+          }
+          return false;
+        });
+        rings.erase(it, rings.end());
+        pending = rings;
+      }
+
+      uint32_t seq = signal.prepare_wait();
+      bool drained = false;
+      for (LogRing *ring : pending) {
+        drained |= drain(ring);
+      }
+      if (drained) {
+        signal.cancel_wait();
+      } else if (exit) {
+        signal.cancel_wait();
+        break;
+      } else {
+        signal.wait(seq, FLUSH_INTERVAL_MS);
+      }
+    }
+  }
+
+  static thread_local ThreadRing thread_ring;
+
+  QueueSignal signal;
+  std::mutex rings_lock;
+  std::vector<LogRing *> rings;
+  std::thread thread;
+  std::atomic<bool> running = false;
+  std::atomic<bool> exit = false;
+  std::atomic<uint64_t> total_dropped = 0;
+
+public:
+  static AsyncLogger async_logger;
+};
+
+thread_local AsyncLogger::ThreadRing AsyncLogger::thread_ring;
+// defined after s: destroyed first, so remaining records are sent before the socket closes
+AsyncLogger AsyncLogger::async_logger;
+static AsyncLogger &async_log = AsyncLogger::async_logger;
+
+void cloudlog_set_async(bool enable) {
+  if (!enable) async_log.flush();
+  async_log.enabled = enable;
+}
+
+void cloudlog_flush() {
+  async_log.flush();
+}
+
+uint64_t cloudlog_dropped() {
+  return async_log.totalDropped();
+}
+
+static void cloudlog_async(int levelnum, const char* filename, int lineno, const char* func,
+                           bool timestamp, uint32_t frame_id, const char* fmt, va_list args) {
+  LogRecord *r = async_log.claim();
+  if (!r) return;
+  r->levelnum = levelnum;
+  r->filename = filename;
+  r->lineno = lineno;
+  r->func = func;
+  r->created = seconds_since_epoch();
+  r->timestamp = timestamp;
+  if (timestamp) {
+    r->nanos = nanos_since_boot();
+    r->frame_id = frame_id;
+  }
+  vsnprintf(r->msg, sizeof(r->msg), fmt, args);
+  async_log.commit();
+}
+
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
                 const char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
+  if (async_log.enabled.load(std::memory_order_relaxed)) {
+    cloudlog_async(levelnum, filename, lineno, func, false, NO_FRAME_ID, fmt, args);
+    va_end(args);
+    return;
+  }
   char* msg_buf = nullptr;
   int ret = vasprintf(&msg_buf, fmt, args);
   va_end(args);
@@ -106,18 +397,14 @@ void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func
 void cloudlog_t_common(int levelnum, const char* filename, int lineno, const char* func,
                        uint32_t frame_id, const char* fmt, va_list args) {
   if (!LOG_TIMESTAMPS) return;
+  if (async_log.enabled.load(std::memory_order_relaxed)) {
+    cloudlog_async(levelnum, filename, lineno, func, true, frame_id, fmt, args);
+    return;
+  }
   char* msg_buf = nullptr;
   int ret = vasprintf(&msg_buf, fmt, args);
   if (ret <= 0 || !msg_buf) return;
-  json11::Json::object tspt_j = json11::Json::object{
-    {"event", msg_buf},
-    {"time", std::to_string(nanos_since_boot())}
-  };
-  if (frame_id < NO_FRAME_ID) {
-    tspt_j["frame_id"] = std::to_string(frame_id);
-  }
-  tspt_j = json11::Json::object{{"timestamp", tspt_j}};
-  cloudlog_common(levelnum, filename, lineno, func, msg_buf, tspt_j);
+  cloudlog_common(levelnum, filename, lineno, func, msg_buf, timestamp_json(msg_buf, nanos_since_boot(), frame_id));
 }
 
 
@@ -135,4 +422,3 @@ void cloudlog_te(int levelnum, const char* filename, int lineno, const char* fun
   cloudlog_t_common(levelnum, filename, lineno, func, frame_id, fmt, args);
   va_end(args);
 }
-
@@ -18,6 +18,14 @@ void cloudlog_te(int levelnum, const char* filename, int lineno, const char* fun
 void cloudlog_te(int levelnum, const char* filename, int lineno, const char* func,
                  uint32_t frame_id, const char* fmt, ...) /*__attribute__ ((format (printf, 6, 7)))*/;
 
+// In async mode (also enabled by SWAGLOG_ASYNC=1) log calls don't allocate or lock: the message is formatted
+// into a per-thread ring and a background thread encodes and sends it. Records are dropped while the ring is full.
+void cloudlog_set_async(bool enable);
+// blocks until every record logged so far has been sent
+void cloudlog_flush();
+// number of records dropped in async mode
+uint64_t cloudlog_dropped();
+
 
 #define cloudlog(lvl, fmt, ...) cloudlog_e(lvl, __FILE__, __LINE__, \
                                            __func__, \
@@ -0,0 +1,47 @@
+#include <cstdio>
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "common/params.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+// compares writing N keys with Params::putMany against N separate Params::put calls.
+// run it on the filesystem you care about: params_benchmark [params dir]
+
+const int RUNS = 5;
+
+int main(int argc, char *argv[]) {
+  std::string dir = argc > 1 ? argv[1] : "";
+  if (dir.empty()) {
+    char tmp[] = "/tmp/params_benchmark_XXXXXX";
+    dir = mkdtemp(tmp);
+  }
+  Params params(dir);
+  std::vector<std::string> keys = params.allKeys();
+  printf("params dir: %s\n", params.getParamPath().c_str());
+
+  for (int n : {1, 2, 5, 10, 20}) {
+    std::map<std::string, std::string> values;
+    for (int i = 0; i < std::min<int>(n, keys.size()); ++i) {
+      values[keys[i]] = util::random_string(256);
+    }
+
+    double put_ms = 0, put_many_ms = 0;
+    for (int i = 0; i < RUNS; ++i) {
+      double start = millis_since_boot();
+      for (const auto &[k, v] : values) params.put(k, v);
+      put_ms += millis_since_boot() - start;
+
+      start = millis_since_boot();
+      params.putMany(values);
+      put_many_ms += millis_since_boot() - start;
+    }
+    printf("%2d keys: put %8.2f ms, putMany %8.2f ms\n", n, put_ms / RUNS, put_many_ms / RUNS);
+  }
+
+  params.clearAll(ALL);
+  return 0;
+}
@@ -0,0 +1,25 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+
+#include "common/statlog.h"
+
+// Logs a fixed set of metrics, they are sent in a batch at exit. Used by selfdrive/test/test_statsd.py.
+int main() {
+  statlog_gauge("test_gauge", 1.5f);
+  statlog_count("test_counter", 2);
+  statlog_count("test_counter", 3);
+  for (int i = 1; i <= 100; ++i) {
+    statlog_sample("test_sample", (float)i);
+  }
+
+  // a forked child that never logs a metric has no flush thread, it must still exit cleanly
+  pid_t pid = fork();
+  if (pid == 0) {
+    exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <zmq.h>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+
+// measures the time spent in the calling thread per LOGD, in the synchronous and the async mode.
+// usage: swaglog_benchmark [messages per thread]
+
+// replaces the libzmq send, so the numbers don't depend on a log receiver or the ipc socket buffer
+extern "C" int zmq_send(void *socket, const void *buf, size_t len, int flags) {
+  return (int)len;
+}
+
+void log_thread(int cnt, double *ns) {
+  double start = nanos_since_boot();
+  for (int i = 0; i < cnt; ++i) {
+    LOGD("benchmark message %d, value %f", i, i * 0.5);
+    // don't outrun the background thread by too much in async mode, a real daemon doesn't log in a tight loop
+    if (i % 64 == 63) {
+      *ns += nanos_since_boot() - start;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      start = nanos_since_boot();
+    }
+  }
+  *ns += nanos_since_boot() - start;
+}
+
+double run(int thread_cnt, int cnt) {
+  std::vector<double> ns(thread_cnt);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thread_cnt; ++i) {
+    threads.emplace_back(log_thread, cnt, &ns[i]);
+  }
+  for (auto &t : threads) t.join();
+  cloudlog_flush();
+
+  double total = 0;
+  for (double n : ns) total += n;
+  return total / (thread_cnt * cnt);
+}
+
+int main(int argc, char *argv[]) {
+  const int cnt = argc > 1 ? atoi(argv[1]) : 20000;
+  for (int threads : {1, 4}) {
+    cloudlog_set_async(false);
+    double sync_ns = run(threads, cnt);
+    cloudlog_set_async(true);
+    uint64_t dropped = cloudlog_dropped();
+    double async_ns = run(threads, cnt);
+    printf("%d thread(s): sync %7.0f ns/LOGD, async %7.0f ns/LOGD, dropped %llu\n",
+           threads, sync_ns, async_ns, (unsigned long long)(cloudlog_dropped() - dropped));
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <cstdio>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+#include "common/params.h"
+#include "common/util.h"
+
+// writes from other processes only show up after the watcher thread handled the inotify event
+template <class F>
+bool wait_until(F cond, int timeout_ms = 1000) {
+  for (int i = 0; i < timeout_ms && !cond(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return cond();
+}
+
+// change a param behind the cache's back, like another process would
+void write_external(Params &params, const std::string &key, const std::string &value) {
+  std::string tmp = params.getParamPath() + "/../.tmp_test";
+  REQUIRE(util::write_file(tmp.c_str(), value.data(), value.size(), O_WRONLY | O_CREAT | O_TRUNC) == 0);
+  REQUIRE(rename(tmp.c_str(), params.getParamPath(key).c_str()) == 0);
+}
+
+TEST_CASE("params") {
+  char tmp_path[] = "/tmp/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path);
+  Params params(param_path);
+
+  SECTION("cache invalidation") {
+    REQUIRE(params.put("CarVin", "1") == 0);
+    REQUIRE(params.get("CarVin") == "1");
+
+    write_external(params, "CarVin", "2");
+    REQUIRE(wait_until([&] { return params.get("CarVin") == "2"; }));
+
+    REQUIRE(unlink(params.getParamPath("CarVin").c_str()) == 0);
+    REQUIRE(wait_until([&] { return params.get("CarVin").empty(); }));
+  }
+  SECTION("watch & unwatch") {
+    std::atomic<int> calls = 0;
+    int id = params.watch("CarVin", [&](const std::string &key) {
+      REQUIRE(key == "CarVin");
+      ++calls;
+    });
+    write_external(params, "DongleId", "1");
+    write_external(params, "CarVin", "1");
+    REQUIRE(wait_until([&] { return calls > 0; }));
+
+    params.unwatch(id);
+    const int prev_calls = calls;
+    write_external(params, "CarVin", "2");
+    REQUIRE(wait_until([&] { return params.get("CarVin") == "2"; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(calls == prev_calls);
+  }
+  SECTION("blocking get") {
+    std::thread writer([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      write_external(params, "CarVin", "1");
+    });
+    const auto start = std::chrono::steady_clock::now();
+    REQUIRE(params.get("CarVin", true) == "1");
+    // woken up by the write, not by the 100ms poll timeout
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(140));
+    writer.join();
+  }
+
+  system(("rm -rf " + param_path).c_str());
+}
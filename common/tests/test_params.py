@@ -47,6 +47,17 @@ class TestParams(unittest.TestCase):
     assert self.params.get("DongleId") == b"bob"
     assert self.params.get("AthenadPid") == b"123"
 
+  def test_params_put_many(self):
+    self.params.put("DongleId", "old")
+    self.params.put_many({"DongleId": "cb38263377b873ee", "AthenadPid": "123", "CarParams": b"\xe1\x90\xff"})
+    assert self.params.get("DongleId") == b"cb38263377b873ee"
+    assert self.params.get("AthenadPid") == b"123"
+    assert self.params.get("CarParams") == b"\xe1\x90\xff"
+    assert not any(f.startswith(".tmp_value_") for f in os.listdir(self.tmpdir))
+
+    with self.assertRaises(UnknownKeyName):
+      self.params.put_many({"DongleId": "abc", "swag": "abc"})
+
   def test_params_get_block(self):
     def _delayed_writer():
       time.sleep(0.1)
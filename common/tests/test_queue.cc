@@ -0,0 +1,96 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/queue.h"
+
+const int ITEMS = 100000;
+
+// one or more producers push ITEMS values each, consumers pop all of them.
+template <class Q>
+uint64_t produce_consume(Q &q, int producers, int consumers) {
+  std::atomic<uint64_t> sum = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < producers; ++i) {
+    threads.emplace_back([&]() {
+      for (int j = 1; j <= ITEMS; ++j) q.push(j);
+    });
+  }
+  const int total = ITEMS * producers;
+  for (int i = 0; i < consumers; ++i) {
+    threads.emplace_back([&, i]() {
+      uint64_t s = 0;
+      for (int j = i; j < total; j += consumers) s += q.pop();
+      sum += s;
+    });
+  }
+  for (auto &t : threads) t.join();
+  return sum;
+}
+
+const uint64_t EXPECTED_SUM = (uint64_t)ITEMS * (ITEMS + 1) / 2;
+
+TEST_CASE("SPSCQueue") {
+  SPSCQueue<int, 16> q;
+  int v = 0;
+  REQUIRE(q.empty());
+  REQUIRE(!q.try_pop(v));
+  for (int i = 0; i < 16; ++i) REQUIRE(q.try_push(i));
+  REQUIRE(!q.try_push(16));
+  REQUIRE(q.size() == 16);
+  for (int i = 0; i < 16; ++i) {
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == i);
+  }
+  REQUIRE(!q.try_pop(v, 10));
+  REQUIRE(produce_consume(q, 1, 1) == EXPECTED_SUM);
+}
+
+TEST_CASE("MPMCQueue") {
+  MPMCQueue<int, 16> q;
+  int v = 0;
+  REQUIRE(q.empty());
+  for (int i = 0; i < 16; ++i) REQUIRE(q.try_push(i));
+  REQUIRE(!q.try_push(16));
+  for (int i = 0; i < 16; ++i) {
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == i);
+  }
+  REQUIRE(!q.try_pop(v, 10));
+  REQUIRE(produce_consume(q, 1, 1) == EXPECTED_SUM);
+  REQUIRE(produce_consume(q, 4, 4) == EXPECTED_SUM * 4);
+}
+
+TEST_CASE("blocking pop wakes on push") {
+  SPSCQueue<int, 4> q;
+  std::thread t([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    q.push(42);
+  });
+  int v = 0;
+  REQUIRE(q.try_pop(v, 1000));
+  REQUIRE(v == 42);
+  t.join();
+}
+
+TEST_CASE("queue benchmark", "[.benchmark]") {
+  BENCHMARK("SafeQueue 1:1") {
+    SafeQueue<int> q;
+    return produce_consume(q, 1, 1);
+  };
+  BENCHMARK("SPSCQueue 1:1") {
+    SPSCQueue<int, 1024> q;
+    return produce_consume(q, 1, 1);
+  };
+  BENCHMARK("SafeQueue 4:4") {
+    SafeQueue<int> q;
+    return produce_consume(q, 4, 4);
+  };
+  BENCHMARK("MPMCQueue 4:4") {
+    MPMCQueue<int, 1024> q;
+    return produce_consume(q, 4, 4);
+  };
+}
@@ -72,7 +72,7 @@ void recv_log(int thread_cnt, int thread_msg_cnt) {
   zmq_ctx_destroy(zctx);
 }
 
-TEST_CASE("swaglog") {
+void test_swaglog() {
   setenv("MANAGER_DAEMON", daemon_name.c_str(), 1);
   setenv("DONGLE_ID", dongle_id.c_str(), 1);
   setenv("dirty", "1", 1);
@@ -84,6 +84,33 @@ TEST_CASE("swaglog") {
     log_threads.push_back(std::thread(log_thread, i, thread_msg_cnt));
   }
   for (auto &t : log_threads) t.join();
+  cloudlog_flush();
 
   recv_log(thread_cnt, thread_msg_cnt);
 }
+
+TEST_CASE("swaglog") {
+  test_swaglog();
+}
+
+TEST_CASE("swaglog async") {
+  cloudlog_set_async(true);
+  test_swaglog();
+  REQUIRE(cloudlog_dropped() == 0);
+  cloudlog_set_async(false);
+}
+
+TEST_CASE("swaglog async ring overrun") {
+  cloudlog_set_async(true);
+  const uint64_t dropped = cloudlog_dropped();
+  // a thread logging in a tight loop outruns the JSON encoding and sending of the background thread,
+  // its ring (128 records) fills up and the records that don't fit are dropped and counted
+  const int msg_cnt = 100 * 128;
+  for (int i = 0; i < msg_cnt; ++i) {
+    LOGD("%d", i);
+  }
+  cloudlog_flush();
+  REQUIRE(cloudlog_dropped() > dropped);
+  REQUIRE(cloudlog_dropped() - dropped < msg_cnt);
+  cloudlog_set_async(false);
+}
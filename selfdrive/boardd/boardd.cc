@@ -248,24 +248,23 @@ void can_recv_thread(std::vector<Panda *> pandas) {
   // run at 100hz
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
-  std::vector<can_frame> raw_can_data;
+  std::vector<can_receive_result> rx(pandas.size());
 
   while (!do_exit && check_all_connected(pandas)) {
     bool comms_healthy = true;
-    raw_can_data.clear();
-    for (const auto& panda : pandas) {
-      comms_healthy &= panda->can_receive(raw_can_data);
+    uint32_t total_frames = 0;
+    for (uint32_t i = 0; i < pandas.size(); ++i) {
+      comms_healthy &= pandas[i]->can_receive_count(rx[i]);
+      total_frames += rx[i].frame_count;
     }
 
+    // the frames are copied straight from the receive buffers into the message
     MessageBuilder msg;
     auto evt = msg.initEvent();
     evt.setValid(comms_healthy);
-    auto canData = evt.initCan(raw_can_data.size());
-    for (uint i = 0; i<raw_can_data.size(); i++) {
-      canData[i].setAddress(raw_can_data[i].address);
-      canData[i].setBusTime(raw_can_data[i].busTime);
-      canData[i].setDat(kj::arrayPtr((uint8_t*)raw_can_data[i].dat.data(), raw_can_data[i].dat.size()));
-      canData[i].setSrc(raw_can_data[i].src);
+    auto canData = evt.initCan(total_frames);
+    for (uint32_t i = 0, offset = 0; i < pandas.size(); offset += rx[i++].frame_count) {
+      pandas[i]->can_unpack(rx[i], canData, offset);
     }
     pm.send("can", msg);
 
@@ -3,10 +3,15 @@
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp cimport bool
+from libc.string cimport memcpy
 
+DEF CAN_MAX_DATA_LEN = 64
+
+# keep in sync with selfdrive/boardd/panda.h
 cdef struct can_frame:
   long address
-  string dat
+  unsigned char dat[CAN_MAX_DATA_LEN]
+  unsigned char dat_len
   long busTime
   long src
 
@@ -17,10 +22,16 @@ def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
   can_list.reserve(len(can_msgs))
 
   cdef can_frame f
+  cdef string dat
   for can_msg in can_msgs:
+    dat = can_msg[2]
+    # bounds the copy into the inline buffer, so it can't be an assert (stripped by python -O)
+    if dat.size() > CAN_MAX_DATA_LEN:
+      raise ValueError(f"CAN payload too long: {dat.size()} > {CAN_MAX_DATA_LEN} bytes")
     f.address = can_msg[0]
     f.busTime = can_msg[1]
-    f.dat = can_msg[2]
+    memcpy(f.dat, dat.data(), dat.size())
+    f.dat_len = dat.size()
     f.src = can_msg[3]
     can_list.push_back(f)
   cdef string out
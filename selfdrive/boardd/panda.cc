@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 
@@ -236,69 +237,139 @@ void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
   });
 }
 
-bool Panda::can_receive(std::vector<can_frame>& out_vec) {
+bool Panda::read_can_data(int &recv) {
   // Check if enough space left in buffer to store RECV_SIZE data
   assert(receive_buffer_size + RECV_SIZE <= sizeof(receive_buffer));
 
-  int recv = handle->bulk_read(0x81, &receive_buffer[receive_buffer_size], RECV_SIZE);
+  recv = handle->bulk_read(0x81, &receive_buffer[receive_buffer_size], RECV_SIZE);
   if (!comms_healthy()) {
     return false;
   }
   if (recv == RECV_SIZE) {
     LOGW("Panda receive buffer full");
   }
-  receive_buffer_size += recv;
+  receive_buffer_size += std::max(recv, 0);
+  return true;
+}
 
+bool Panda::can_receive(std::vector<can_frame>& out_vec) {
+  int recv = 0;
+  if (!read_can_data(recv)) {
+    return false;
+  }
   return (recv <= 0) ? true : unpack_can_buffer(receive_buffer, receive_buffer_size, out_vec);
 }
 
+bool Panda::can_receive_count(can_receive_result &rx) {
+  int recv = 0;
+  rx = {};
+  if (!read_can_data(recv)) {
+    return false;
+  }
+  return count_received_frames(rx);
+}
+
+bool Panda::count_received_frames(can_receive_result &rx) {
+  rx.checksum_ok = count_can_frames(receive_buffer, receive_buffer_size, rx.frame_count, rx.end);
+  return rx.checksum_ok;
+}
+
 void Panda::can_reset_communications() {
   handle->control_write(0xc0, 0, 0);
 }
 
-bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec) {
-  int pos = 0;
+long Panda::can_src(const can_header &header) const {
+  long src = header.bus + bus_offset;
+  if (header.rejected) {
+    src += CAN_REJECTED_BUS_OFFSET;
+  }
+  if (header.returned) {
+    src += CAN_RETURNED_BUS_OFFSET;
+  }
+  return src;
+}
 
-  while (pos <= size - sizeof(can_header)) {
+// counts the complete frames at the start of data, stops at the first one with a bad checksum
+bool Panda::count_can_frames(const uint8_t *data, uint32_t size, uint32_t &count, uint32_t &end) {
+  count = 0;
+  end = 0;
+  while (end + sizeof(can_header) <= size) {
     can_header header;
-    memcpy(&header, &data[pos], sizeof(can_header));
+    memcpy(&header, &data[end], sizeof(can_header));
 
-    const uint8_t data_len = dlc_to_len[header.data_len_code];
-    if (pos + sizeof(can_header) + data_len > size) {
+    const uint32_t frame_size = sizeof(can_header) + dlc_to_len[header.data_len_code];
+    if (end + frame_size > size) {
       // we don't have all the data for this message yet
       break;
     }
-
-    can_frame &canData = out_vec.emplace_back();
-    canData.busTime = 0;
-    canData.address = header.addr;
-    canData.src = header.bus + bus_offset;
-    if (header.rejected) {
-      canData.src += CAN_REJECTED_BUS_OFFSET;
-    }
-    if (header.returned) {
-      canData.src += CAN_RETURNED_BUS_OFFSET;
-    }
-
-    if (calculate_checksum(&data[pos], sizeof(can_header) + data_len) != 0) {
+    if (calculate_checksum(&data[end], frame_size) != 0) {
       LOGE("Panda CAN checksum failed");
-      size = 0;
       return false;
     }
+    end += frame_size;
+    ++count;
+  }
+  return true;
+}
 
-    canData.dat.assign((char *)&data[pos + sizeof(can_header)], data_len);
-
+// calls f(index, header, payload, payload length) for the first count frames of data
+template <class F>
+static void for_each_can_frame(const uint8_t *data, uint32_t count, F &&f) {
+  for (uint32_t i = 0, pos = 0; i < count; ++i) {
+    can_header header;
+    memcpy(&header, &data[pos], sizeof(can_header));
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    f(i, header, &data[pos + sizeof(can_header)], data_len);
     pos += sizeof(can_header) + data_len;
   }
+}
 
+// drops the unpacked frames, everything after a checksum error is dropped too
+static void consume_can_buffer(uint8_t *data, uint32_t &size, uint32_t end, bool checksum_ok) {
+  if (!checksum_ok) {
+    size = 0;
+    return;
+  }
   // move the overflowing data to the beginning of the buffer for the next round
-  memmove(data, &data[pos], size - pos);
-  size -= pos;
+  memmove(data, &data[end], size - end);
+  size -= end;
+}
 
-  return true;
+bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec) {
+  uint32_t count = 0, end = 0;
+  const bool checksum_ok = count_can_frames(data, size, count, end);
+
+  const size_t start = out_vec.size();
+  out_vec.resize(start + count);
+  for_each_can_frame(data, count, [&](uint32_t i, const can_header &header, const uint8_t *dat, uint8_t len) {
+    can_frame &canData = out_vec[start + i];
+    canData.busTime = 0;
+    canData.address = header.addr;
+    canData.src = can_src(header);
+    memcpy(canData.dat, dat, len);
+    canData.dat_len = len;
+  });
+
+  consume_can_buffer(data, size, end, checksum_ok);
+  return checksum_ok;
+}
+
+void Panda::can_unpack(const can_receive_result &rx, capnp::List<cereal::CanData>::Builder &out, uint32_t offset) {
+  // the frames are still at the start of the buffer, nothing was consumed since they were counted
+  assert(rx.end <= receive_buffer_size);
+  assert(offset + rx.frame_count <= out.size());
+  for_each_can_frame(receive_buffer, rx.frame_count, [&](uint32_t i, const can_header &header, const uint8_t *dat, uint8_t len) {
+    auto canData = out[offset + i];
+    canData.setAddress(header.addr);
+    canData.setBusTime(0);
+    canData.setDat(kj::arrayPtr(dat, len));
+    canData.setSrc(can_src(header));
+  });
+
+  consume_can_buffer(receive_buffer, receive_buffer_size, rx.end, rx.checksum_ok);
 }
 
-uint8_t Panda::calculate_checksum(uint8_t *data, uint32_t len) {
+uint8_t Panda::calculate_checksum(const uint8_t *data, uint32_t len) {
   uint8_t checksum = 0U;
   for (uint32_t i = 0U; i < len; i++) {
     checksum ^= data[i];
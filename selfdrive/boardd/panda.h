@@ -33,13 +33,24 @@ struct __attribute__((packed)) can_header {
   uint8_t checksum : 8;
 };
 
+#define CAN_MAX_DATA_LEN 64
+
+// the payload is stored inline, so a vector of frames can be cleared and refilled without allocating
 struct can_frame {
   long address;
-  std::string dat;
+  uint8_t dat[CAN_MAX_DATA_LEN];
+  uint8_t dat_len;
   long busTime;
   long src;
 };
 
+// the complete frames at the start of the receive buffer
+struct can_receive_result {
+  uint32_t frame_count = 0;
+  uint32_t end = 0;         // size of the frames in bytes
+  bool checksum_ok = true;  // everything after the frames is dropped otherwise
+};
+
 
 class Panda {
 private:
@@ -81,6 +92,12 @@ public:
   void set_canfd_non_iso(uint16_t bus, bool non_iso);
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
   bool can_receive(std::vector<can_frame>& out_vec);
+  // Receive without intermediate frames: can_receive_count() reads from the panda and counts the complete
+  // frames in the receive buffer, can_unpack() then copies them into out[offset, offset + rx.frame_count)
+  // and removes them from the buffer, after a checksum error together with the rest of the data.
+  // Frames that aren't unpacked stay in the buffer and are counted again by the next call.
+  bool can_receive_count(can_receive_result &rx);
+  void can_unpack(const can_receive_result &rx, capnp::List<cereal::CanData>::Builder &out, uint32_t offset);
   void can_reset_communications();
 
 protected:
@@ -92,5 +109,9 @@ protected:
   void pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list,
                          std::function<void(uint8_t *, size_t)> write_func);
   bool unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec);
-  uint8_t calculate_checksum(uint8_t *data, uint32_t len);
+  bool count_received_frames(can_receive_result &rx);
+  bool count_can_frames(const uint8_t *data, uint32_t size, uint32_t &count, uint32_t &end);
+  bool read_can_data(int &recv);
+  long can_src(const can_header &header) const;
+  uint8_t calculate_checksum(const uint8_t *data, uint32_t len);
 };
@@ -17,6 +17,8 @@ struct PandaTest : public Panda {
   PandaTest(uint32_t bus_offset, int can_list_size, cereal::PandaState::PandaType hw_type);
   void test_can_send();
   void test_can_recv(uint32_t chunk_size = 0);
+  void test_can_unpack(uint32_t chunk_size = 0);
+  void test_can_unpack_checksum_error();
   void test_chunked_can_recv();
 
   std::map<int, std::string> test_data;
@@ -103,12 +105,76 @@ void PandaTest::test_can_recv(uint32_t rx_chunk_size) {
   REQUIRE(frames.size() == can_list_size);
   for (int i = 0; i < frames.size(); ++i) {
     REQUIRE(frames[i].address == i);
-    REQUIRE(test_data.find(frames[i].dat.size()) != test_data.end());
-    const std::string &dat = test_data[frames[i].dat.size()];
-    REQUIRE(memcmp(dat.data(), frames[i].dat.data(), dat.size()) == 0);
+    REQUIRE(test_data.find(frames[i].dat_len) != test_data.end());
+    const std::string &dat = test_data[frames[i].dat_len];
+    REQUIRE(memcmp(dat.data(), frames[i].dat, dat.size()) == 0);
   }
 }
 
+void PandaTest::test_can_unpack(uint32_t rx_chunk_size) {
+  MessageBuilder out_msg;
+  auto out = out_msg.initEvent().initCan(can_list_size);
+  uint32_t offset = 0, chunks = 0;
+  this->pack_can_buffer(can_data_list, [&](uint8_t *data, uint32_t size) {
+    this->receive_buffer_size = 0;
+    uint32_t pos = 0;
+
+    while (pos < size) {
+      uint32_t chunk_size = rx_chunk_size == 0 ? size : std::min(rx_chunk_size, size - pos);
+      memcpy(&this->receive_buffer[this->receive_buffer_size], &data[pos], chunk_size);
+      this->receive_buffer_size += chunk_size;
+      pos += chunk_size;
+
+      can_receive_result rx;
+      REQUIRE(this->count_received_frames(rx));
+      REQUIRE(offset + rx.frame_count <= can_list_size);
+      // frames that aren't unpacked are counted again with the next chunk
+      if (pos < size && ++chunks % 2 == 1) continue;
+      this->can_unpack(rx, out, offset);
+      offset += rx.frame_count;
+    }
+    REQUIRE(this->receive_buffer_size == 0);
+  });
+
+  REQUIRE(offset == can_list_size);
+  for (int i = 0; i < can_list_size; ++i) {
+    REQUIRE(out[i].getAddress() == i);
+    REQUIRE(out[i].getSrc() == can_data_list[i].getSrc());
+    auto dat = out[i].getDat();
+    REQUIRE(test_data.find(dat.size()) != test_data.end());
+    REQUIRE(memcmp(test_data[dat.size()].data(), dat.begin(), dat.size()) == 0);
+  }
+}
+
+void PandaTest::test_can_unpack_checksum_error() {
+  std::vector<uint8_t> packed;
+  this->pack_can_buffer(can_data_list, [&](uint8_t *data, uint32_t size) {
+    packed.insert(packed.end(), data, data + size);
+  });
+
+  // corrupt the third frame
+  uint32_t pos = 0;
+  for (int i = 0; i < 2; ++i) {
+    can_header header;
+    memcpy(&header, &packed[pos], sizeof(can_header));
+    pos += sizeof(can_header) + dlc_to_len[header.data_len_code];
+  }
+  packed[pos + sizeof(can_header) - 1] ^= 0xff;
+
+  memcpy(this->receive_buffer, packed.data(), packed.size());
+  this->receive_buffer_size = packed.size();
+
+  // the frames before the bad one are still delivered, the rest of the buffer is dropped
+  can_receive_result rx;
+  REQUIRE_FALSE(this->count_received_frames(rx));
+  REQUIRE(rx.frame_count == 2);
+  MessageBuilder out_msg;
+  auto out = out_msg.initEvent().initCan(rx.frame_count);
+  this->can_unpack(rx, out, 0);
+  REQUIRE(out[1].getAddress() == 1);
+  REQUIRE(this->receive_buffer_size == 0);
+}
+
 TEST_CASE("send/recv CAN 2.0 packets") {
   auto bus_offset = GENERATE(0, 4);
   auto can_list_size = GENERATE(1, 3, 5, 10, 30, 60, 100, 200);
@@ -123,6 +189,12 @@ TEST_CASE("send/recv CAN 2.0 packets") {
   SECTION("chunked_can_receive") {
     test.test_can_recv(0x40);
   }
+  SECTION("can_unpack") {
+    test.test_can_unpack();
+  }
+  SECTION("chunked_can_unpack") {
+    test.test_can_unpack(0x40);
+  }
 }
 
 TEST_CASE("send/recv CAN FD packets") {
@@ -139,4 +211,15 @@ TEST_CASE("send/recv CAN FD packets") {
   SECTION("chunked_can_receive") {
     test.test_can_recv(0x40);
   }
+  SECTION("can_unpack") {
+    test.test_can_unpack();
+  }
+  SECTION("chunked_can_unpack") {
+    test.test_can_unpack(0x40);
+  }
+}
+
+TEST_CASE("unpack CAN packets with a bad checksum") {
+  PandaTest test(0, 10, cereal::PandaState::PandaType::DOS);
+  test.test_can_unpack_checksum_error();
 }
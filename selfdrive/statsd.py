@@ -2,10 +2,11 @@
 import os
 import zmq
 import time
+import struct
 from pathlib import Path
 from collections import defaultdict
 from datetime import datetime, timezone
-from typing import NoReturn, Union, List, Dict
+from typing import NoReturn, Union, List, Dict, Iterator, Tuple
 
 from common.params import Params
 from cereal.messaging import SubMaster
@@ -19,6 +20,76 @@ from system.loggerd.config import STATS_DIR, STATS_DIR_FILE_LIMIT, STATS_SOCKET,
 class METRIC_TYPE:
   GAUGE = 'g'
   SAMPLE = 'sa'
+  COUNTER = 'c'
+
+# binary batches sent by common/statlog.cc
+BATCH_MAGIC = b"STB1"
+BUCKETS_PER_OCTAVE = 32
+BUCKET_OFFSET = 32768
+
+
+def bucket_value(key: int) -> float:
+  # geometric middle of a histogram bucket, see statlog_bucket() in common/statlog.cc
+  if key == 0:
+    return 0.
+  value = 2 ** ((abs(key) - BUCKET_OFFSET + 0.5) / BUCKETS_PER_OCTAVE)
+  return value if key > 0 else -value
+
+
+class Samples:
+  def __init__(self):
+    self.count = 0
+    self.sum = 0.
+    self.min = float('inf')
+    self.max = float('-inf')
+    self.values: List[Tuple[float, int]] = []  # (value, weight)
+
+  def add(self, value: float) -> None:
+    self.add_histogram(1, value, value, value, [(value, 1)])
+
+  def add_histogram(self, count: int, total: float, min_value: float, max_value: float, values: List[Tuple[float, int]]) -> None:
+    self.count += count
+    self.sum += total
+    self.min = min(self.min, min_value)
+    self.max = max(self.max, max_value)
+    self.values += values
+
+  def stats(self) -> Dict[str, float]:
+    self.values.sort()
+    stats = {
+      'count': self.count,
+      'min': self.min,
+      'max': self.max,
+      'mean': self.sum / self.count,
+    }
+    for percentile in [0.05, 0.5, 0.95]:
+      rank = int(round(percentile * (self.count - 1)))
+      seen = 0
+      for value, weight in self.values:
+        seen += weight
+        if seen > rank:
+          break
+      stats[f"p{int(percentile * 100)}"] = min(max(value, self.min), self.max)
+    return stats
+
+
+def parse_batch(dat: bytes) -> Iterator[Tuple[str, str, Union[float, Tuple]]]:
+  pos = len(BATCH_MAGIC)
+  while pos < len(dat):
+    metric_type, name_len = struct.unpack_from("<cB", dat, pos)
+    pos += 2
+    name = dat[pos:pos + name_len].decode()
+    pos += name_len
+    if metric_type == b's':
+      count, total, min_value, max_value, n = struct.unpack_from("<IdddH", dat, pos)
+      pos += struct.calcsize("<IdddH")
+      values = [(bucket_value(key), weight) for key, weight in struct.iter_unpack("<iI", dat[pos:pos + 8 * n])]
+      pos += 8 * n
+      yield METRIC_TYPE.SAMPLE, name, (count, total, min_value, max_value, values)
+    else:
+      value, = struct.unpack_from("<d", dat, pos)
+      pos += 8
+      yield metric_type.decode(), name, value
 
 class StatLog:
   def __init__(self):
@@ -91,7 +162,8 @@ def main() -> NoReturn:
   idx = 0
   last_flush_time = time.monotonic()
   gauges = {}
-  samples: Dict[str, List[float]] = defaultdict(list)
+  counters: Dict[str, float] = defaultdict(float)
+  samples: Dict[str, Samples] = defaultdict(Samples)
   while True:
     started_prev = sm['deviceState'].started
     sm.update()
@@ -99,20 +171,31 @@ def main() -> NoReturn:
     # Update metrics
     while True:
       try:
-        metric = sock.recv_string(zmq.NOBLOCK)
+        dat = sock.recv(zmq.NOBLOCK)
         try:
-          metric_type = metric.split('|')[1]
-          metric_name = metric.split(':')[0]
-          metric_value = float(metric.split('|')[0].split(':')[1])
-
-          if metric_type == METRIC_TYPE.GAUGE:
-            gauges[metric_name] = metric_value
-          elif metric_type == METRIC_TYPE.SAMPLE:
-            samples[metric_name].append(metric_value)
+          if dat.startswith(BATCH_MAGIC):
+            metrics = list(parse_batch(dat))
           else:
-            cloudlog.event("unknown metric type", metric_type=metric_type)
+            metric = dat.decode()
+            metric_type = metric.split('|')[1]
+            metric_name = metric.split(':')[0]
+            metric_value = float(metric.split('|')[0].split(':')[1])
+            metrics = [(metric_type, metric_name, metric_value)]
+
+          for metric_type, metric_name, metric_value in metrics:
+            if metric_type == METRIC_TYPE.GAUGE:
+              gauges[metric_name] = metric_value
+            elif metric_type == METRIC_TYPE.COUNTER:
+              counters[metric_name] += metric_value
+            elif metric_type == METRIC_TYPE.SAMPLE:
+              if isinstance(metric_value, tuple):
+                samples[metric_name].add_histogram(*metric_value)
+              else:
+                samples[metric_name].add(metric_value)
+            else:
+              cloudlog.event("unknown metric type", metric_type=metric_type)
         except Exception:
-          cloudlog.event("malformed metric", metric=metric)
+          cloudlog.event("malformed metric", metric=dat.decode('utf-8', 'backslashreplace'))
       except zmq.error.Again:
         break
 
@@ -125,25 +208,15 @@ def main() -> NoReturn:
       for key, value in gauges.items():
         result += get_influxdb_line(f"gauge.{key}", value, current_time, tags)
 
-      for key, values in samples.items():
-        values.sort()
-        sample_count = len(values)
-        sample_sum = sum(values)
-
-        stats = {
-          'count': sample_count,
-          'min': values[0],
-          'max': values[-1],
-          'mean': sample_sum / sample_count,
-        }
-        for percentile in [0.05, 0.5, 0.95]:
-          value = values[int(round(percentile * (sample_count - 1)))]
-          stats[f"p{int(percentile * 100)}"] = value
+      for key, value in counters.items():
+        result += get_influxdb_line(f"counter.{key}", value, current_time, tags)
 
-        result += get_influxdb_line(f"sample.{key}", stats, current_time, tags)
+      for key, sample in samples.items():
+        result += get_influxdb_line(f"sample.{key}", sample.stats(), current_time, tags)
 
       # clear intermediate data
       gauges.clear()
+      counters.clear()
       samples.clear()
       last_flush_time = time.monotonic()
 
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+import os
+import subprocess
+import unittest
+
+import zmq
+
+from common.basedir import BASEDIR
+from selfdrive.statsd import METRIC_TYPE, Samples, parse_batch
+from system.loggerd.config import STATS_SOCKET
+
+
+class TestStatsd(unittest.TestCase):
+  def test_statlog_batch(self):
+    # common/tests/statlog_batch aggregates a few metrics in C++ and sends them as one batch at exit
+    sock = zmq.Context.instance().socket(zmq.PULL)
+    sock.bind(STATS_SOCKET)
+    try:
+      proc = subprocess.run(os.path.join(BASEDIR, "common/tests/statlog_batch"), check=False)
+      self.assertEqual(proc.returncode, 0)
+
+      metrics = []
+      while sock.poll(1000):
+        metrics += parse_batch(sock.recv())
+    finally:
+      sock.close()
+
+    gauges = {name: value for metric_type, name, value in metrics if metric_type == METRIC_TYPE.GAUGE}
+    self.assertEqual(gauges, {"test_gauge": 1.5})
+
+    counters = [value for metric_type, name, value in metrics if metric_type == METRIC_TYPE.COUNTER and name == "test_counter"]
+    self.assertEqual(sum(counters), 5)
+
+    samples = Samples()
+    for metric_type, name, value in metrics:
+      if metric_type == METRIC_TYPE.SAMPLE and name == "test_sample":
+        samples.add_histogram(*value)
+    stats = samples.stats()
+    self.assertEqual(stats['count'], 100)
+    self.assertEqual((stats['min'], stats['max'], stats['mean']), (1, 100, 50.5))
+    # percentiles come from histogram buckets that are ~2% wide
+    self.assertAlmostEqual(stats['p50'], 50, delta=50 * 0.03)
+    self.assertAlmostEqual(stats['p95'], 95, delta=95 * 0.03)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -40,8 +40,7 @@ void SshControl::getUserKeys(const QString &username) {
   QObject::connect(request, &HttpRequest::requestDone, [=](const QString &resp, bool success) {
     if (success) {
       if (!resp.isEmpty()) {
-        params.put("GithubUsername", username.toStdString());
-        params.put("GithubSshKeys", resp.toStdString());
+        params.putMany({{"GithubUsername", username.toStdString()}, {"GithubSshKeys", resp.toStdString()}});
       } else {
         ConfirmationDialog::alert(tr("Username '%1' has no keys on GitHub").arg(username), this);
       }
@@ -79,7 +79,7 @@ private:
   Debayer *debayer = nullptr;
   VisionStreamType yuv_type;
   int cur_buf_idx;
-  SafeQueue<int> safe_queue;
+  SPSCQueue<int, 16> safe_queue;
   int frame_buf_count;
 
 public:
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// A socket loggerd drains in a poll round.
+struct DrainSource {
+  int weight;       // messages per turn
+  int drained = 0;  // messages received in this round
+};
+
+// Drains the sockets ready in one poll. The sockets take turns of up to weight messages, and a socket
+// that filled its turn gets another one after every other socket had its turn, until max_drain. So a
+// busy socket can't starve the others. receive(i) handles one message of sources[i] and returns false
+// if there was none.
+template <class F>
+void drain_round(std::vector<DrainSource> &sources, int max_drain, F &&receive) {
+  for (auto &src : sources) src.drained = 0;
+
+  for (bool more = true; more;) {
+    more = false;
+    for (size_t i = 0; i < sources.size(); ++i) {
+      DrainSource &src = sources[i];
+      const int quota = std::min(src.weight, max_drain - src.drained);
+      int count = 0;
+      while (count < quota && receive(i)) {
+        ++count;
+        ++src.drained;
+      }
+      // the socket might have more, it's drained again next turn
+      if (count > 0 && count == quota && src.drained < max_drain) {
+        more = true;
+      }
+    }
+  }
+}
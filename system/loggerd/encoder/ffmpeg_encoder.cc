@@ -8,6 +8,9 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
 
 #define __STDC_CONSTANT_MACROS
 
@@ -19,11 +22,65 @@ extern "C" {
 #include <libavutil/imgutils.h>
 }
 
+#include "common/statlog.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/util.h"
 
 const int env_debug_encoder = (getenv("DEBUG_ENCODER") != NULL) ? atoi(getenv("DEBUG_ENCODER")) : 0;
 
+FrameConverter &FrameConverter::get(CameraType type, int width, int height) {
+  static std::mutex lock;
+  static std::map<CameraType, std::unique_ptr<FrameConverter>> converters;
+
+  std::lock_guard lk(lock);
+  auto &converter = converters[type];
+  if (!converter) {
+    converter = std::make_unique<FrameConverter>(width, height);
+  }
+  assert(converter->width == width && converter->height == height);
+  return *converter;
+}
+
+FrameConverter::FrameConverter(int width, int height) : width(width), height(height) {
+  for (int i = 0; i < FFMPEG_FRAME_COUNT; i++) {
+    frames[i].data.resize(width * height * 3 / 2);
+    free_frames.push(i);
+  }
+}
+
+// only called from the camera thread
+int FrameConverter::convert(VisionBuf *buf, uint32_t frame_id) {
+  if (last < 0 || buf != last_buf || frame_id != last_frame_id) {
+    if (last >= 0) release(last);
+
+    last = free_frames.pop();
+    last_buf = buf;
+    last_frame_id = frame_id;
+    Frame &f = frames[last];
+    f.refs = 1;
+    f.start_tms = millis_since_boot();
+    uint8_t *y = f.data.data();
+    uint8_t *u = y + width * height;
+    uint8_t *v = u + (width / 2) * (height / 2);
+    libyuv::NV12ToI420(buf->y, buf->stride,
+                       buf->uv, buf->stride,
+                       y, width,
+                       u, width/2,
+                       v, width/2,
+                       width, height);
+    f.convert_ms = millis_since_boot() - f.start_tms;
+  }
+  frames[last].refs++;
+  return last;
+}
+
+void FrameConverter::release(int idx) {
+  if (--frames[idx].refs == 0) {
+    free_frames.push(idx);
+  }
+}
+
 void FfmpegEncoder::encoder_init() {
   frame = av_frame_alloc();
   assert(frame);
@@ -34,12 +91,17 @@ void FfmpegEncoder::encoder_init() {
   frame->linesize[1] = out_width/2;
   frame->linesize[2] = out_width/2;
 
-  convert_buf.resize(in_width * in_height * 3 / 2);
-
+  converter = &FrameConverter::get(type, in_width, in_height);
   if (in_width != out_width || in_height != out_height) {
-    downscale_buf.resize(out_width * out_height * 3 / 2);
+    scaled_buf.resize(out_width * out_height * 3 / 2);
   }
 
+  const std::string prefix = std::string("encoderd_") + publish_name;
+  convert_metric = prefix + "_convert_ms";
+  encode_metric = prefix + "_encode_ms";
+  publish_metric = prefix + "_publish_ms";
+  latency_metric = prefix + "_latency_ms";
+
   publisher_init();
 }
 
@@ -63,11 +125,20 @@ void FfmpegEncoder::encoder_open(const char* path) {
   is_open = true;
   segment_num++;
   counter = 0;
+
+  encode_handler_thread = std::thread(FfmpegEncoder::encode_handler, this);
+  publish_handler_thread = std::thread(FfmpegEncoder::publish_handler, this);
 }
 
 void FfmpegEncoder::encoder_close() {
   if (!is_open) return;
 
+  // the frames already converted are still encoded and published
+  to_encode.push(EncodeJob{});
+  encode_handler_thread.join();
+  publish_handler_thread.join();
+  assert(to_encode.empty() && to_publish.empty());
+
   avcodec_free_context(&codec_ctx);
   is_open = false;
 }
@@ -76,76 +147,103 @@ int FfmpegEncoder::encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra) {
   assert(buf->width == this->in_width);
   assert(buf->height == this->in_height);
 
-  uint8_t *cy = convert_buf.data();
-  uint8_t *cu = cy + in_width * in_height;
-  uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
-  libyuv::NV12ToI420(buf->y, buf->stride,
-                     buf->uv, buf->stride,
-                     cy, in_width,
-                     cu, in_width/2,
-                     cv, in_width/2,
-                     in_width, in_height);
-
-  if (downscale_buf.size() > 0) {
-    uint8_t *out_y = downscale_buf.data();
-    uint8_t *out_u = out_y + frame->width * frame->height;
-    uint8_t *out_v = out_u + (frame->width / 2) * (frame->height / 2);
-    libyuv::I420Scale(cy, in_width,
-                      cu, in_width/2,
-                      cv, in_width/2,
-                      in_width, in_height,
-                      out_y, frame->width,
-                      out_u, frame->width/2,
-                      out_v, frame->width/2,
-                      frame->width, frame->height,
-                      libyuv::kFilterNone);
-    frame->data[0] = out_y;
-    frame->data[1] = out_u;
-    frame->data[2] = out_v;
-  } else {
-    frame->data[0] = cy;
-    frame->data[1] = cu;
-    frame->data[2] = cv;
-  }
-  frame->pts = counter*50*1000; // 50ms per frame
+  // converted once for all encoders of the camera
+  const int idx = converter->convert(buf, extra->frame_id);
+  const FrameConverter::Frame &f = converter->frame(idx);
+  to_encode.push({
+    .frame = idx,
+    .extra = *extra,
+    .times = {.start_tms = f.start_tms, .convert_ms = f.convert_ms},
+  });
+  return this->counter++;
+}
 
-  int ret = counter;
+void FfmpegEncoder::encode_handler(FfmpegEncoder *e) {
+  std::string encode_thread_name = "enc-"+std::string(e->filename);
+  util::set_thread_name(encode_thread_name.c_str());
+
+  uint32_t idx = 0;
+  int frame_cnt = 0;
+  while (true) {
+    EncodeJob job = e->to_encode.pop();
+    if (job.frame < 0) break;
+
+    double t1 = millis_since_boot();
+    uint8_t *data = (uint8_t *)e->converter->frame(job.frame).data.data();
+    if (!e->scaled_buf.empty()) {
+      const int w = e->in_width, h = e->in_height;
+      uint8_t *out = e->scaled_buf.data();
+      libyuv::I420Scale(data, w,
+                        data + w * h, w/2,
+                        data + w * h + (w / 2) * (h / 2), w/2,
+                        w, h,
+                        out, e->out_width,
+                        out + e->out_width * e->out_height, e->out_width/2,
+                        out + e->out_width * e->out_height + (e->out_width / 2) * (e->out_height / 2), e->out_width/2,
+                        e->out_width, e->out_height,
+                        libyuv::kFilterNone);
+      e->converter->release(job.frame);
+      data = out;
+    }
+    e->frame->data[0] = data;
+    e->frame->data[1] = data + e->out_width * e->out_height;
+    e->frame->data[2] = e->frame->data[1] + (e->out_width / 2) * (e->out_height / 2);
+    e->frame->pts = frame_cnt++*50*1000; // 50ms per frame
+
+    // the frame isn't refcounted, so the codec copies it and the converted frame can be reused
+    int err = avcodec_send_frame(e->codec_ctx, e->frame);
+    if (e->scaled_buf.empty()) {
+      e->converter->release(job.frame);
+    }
+    if (err < 0) {
+      LOGE("avcodec_send_frame error %d, frame_id: %d", err, job.extra.frame_id);
+      continue;
+    }
 
-  int err = avcodec_send_frame(this->codec_ctx, frame);
-  if (err < 0) {
-    LOGE("avcodec_send_frame error %d", err);
-    ret = -1;
+    while (true) {
+      AVPacket *pkt = av_packet_alloc();
+      err = avcodec_receive_packet(e->codec_ctx, pkt);
+      if (err < 0) {
+        // EAGAIN: encoder might need a few frames on startup to get started. Keep going
+        if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
+          LOGE("avcodec_receive_packet error %d, frame_id: %d", err, job.extra.frame_id);
+        }
+        av_packet_free(&pkt);
+        break;
+      }
+
+      job.times.encode_ms = millis_since_boot() - t1;
+      e->to_publish.push({.pkt = pkt, .idx = idx++, .extra = job.extra, .times = job.times});
+    }
   }
+  e->to_publish.push(PublishJob{});
+}
 
-  AVPacket pkt;
-  av_init_packet(&pkt);
-  pkt.data = NULL;
-  pkt.size = 0;
-  while (ret >= 0) {
-    err = avcodec_receive_packet(this->codec_ctx, &pkt);
-    if (err == AVERROR_EOF) {
-      break;
-    } else if (err == AVERROR(EAGAIN)) {
-      // Encoder might need a few frames on startup to get started. Keep going
-      ret = 0;
-      break;
-    } else if (err < 0) {
-      LOGE("avcodec_receive_packet error %d", err);
-      ret = -1;
-      break;
-    }
+void FfmpegEncoder::publish_handler(FfmpegEncoder *e) {
+  std::string publish_thread_name = "pub-"+std::string(e->filename);
+  util::set_thread_name(publish_thread_name.c_str());
 
-    if (env_debug_encoder) {
-      printf("%20s got %8d bytes flags %8x idx %4d id %8d\n", this->filename, pkt.size, pkt.flags, counter, extra->frame_id);
-    }
+  while (true) {
+    PublishJob job = e->to_publish.pop();
+    if (job.pkt == nullptr) break;
 
-    publisher_publish(this, segment_num, counter, *extra,
-      (pkt.flags & AV_PKT_FLAG_KEY) ? V4L2_BUF_FLAG_KEYFRAME : 0,
-      kj::arrayPtr<capnp::byte>(pkt.data, (size_t)0), // TODO: get the header
-      kj::arrayPtr<capnp::byte>(pkt.data, pkt.size));
+    double t1 = millis_since_boot();
+    e->publisher_publish(e, e->segment_num, job.idx, job.extra,
+      (job.pkt->flags & AV_PKT_FLAG_KEY) ? V4L2_BUF_FLAG_KEYFRAME : 0,
+      kj::arrayPtr<capnp::byte>(job.pkt->data, (size_t)0), // TODO: get the header
+      kj::arrayPtr<capnp::byte>(job.pkt->data, job.pkt->size));
+    double t2 = millis_since_boot();
 
-    counter++;
+    statlog_sample(e->convert_metric.c_str(), (float)job.times.convert_ms);
+    statlog_sample(e->encode_metric.c_str(), (float)job.times.encode_ms);
+    statlog_sample(e->publish_metric.c_str(), (float)(t2 - t1));
+    statlog_sample(e->latency_metric.c_str(), (float)(t2 - job.times.start_tms));
+
+    if (env_debug_encoder) {
+      printf("%20s got %8d bytes flags %8x idx %4d id %8d convert %.2f ms encode %.2f ms publish %.2f ms lat %.2f ms\n",
+             e->filename, job.pkt->size, job.pkt->flags, job.idx, job.extra.frame_id,
+             job.times.convert_ms, job.times.encode_ms, t2 - t1, t2 - job.times.start_tms);
+    }
+    av_packet_free(&job.pkt);
   }
-  av_packet_unref(&pkt);
-  return ret;
 }
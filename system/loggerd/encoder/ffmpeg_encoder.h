@@ -1,8 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -11,9 +13,48 @@ extern "C" {
 #include <libavutil/imgutils.h>
 }
 
+#include "common/queue.h"
 #include "system/loggerd/encoder/encoder.h"
 #include "system/loggerd/loggerd.h"
 
+// frames of a camera converted ahead of its encode threads
+#define FFMPEG_FRAME_COUNT 4
+
+// Converts the NV12 frames of a camera to I420 once for all the encoders of the camera. A frame is
+// referenced by every encoder it was handed to and is reused once they have all released it.
+class FrameConverter {
+ public:
+  struct Frame {
+    std::vector<uint8_t> data;
+    double start_tms = 0;
+    double convert_ms = 0;
+    std::atomic<int> refs = 0;
+  };
+
+  // the converter of a camera, shared by its encoders
+  static FrameConverter &get(CameraType type, int width, int height);
+  FrameConverter(int width, int height);
+  // returns a reference to the frame, converting it on the first call for this camera frame.
+  // waits if the encoders are FFMPEG_FRAME_COUNT - 1 frames behind.
+  int convert(VisionBuf *buf, uint32_t frame_id);
+  void release(int idx);
+  const Frame &frame(int idx) const { return frames[idx]; }
+
+  const int width, height;
+
+ private:
+  Frame frames[FFMPEG_FRAME_COUNT];
+  MPMCQueue<int, 8> free_frames;
+  // kept until the next camera frame, for the encoders that haven't been handed this one yet
+  int last = -1;
+  VisionBuf *last_buf = nullptr;
+  uint32_t last_frame_id = 0;
+};
+
+// The frame goes through three stages, connected by bounded queues:
+// encode_frame() gets it converted by the FrameConverter of the camera on the camera thread,
+// the encode thread scales it if needed and runs the codec, and the publish thread sends the packets.
+// Every encoder has its own encode and publish threads, so the encoders of a camera run in parallel.
 class FfmpegEncoder : public VideoEncoder {
  public:
   FfmpegEncoder(const char* filename, CameraType type, int in_width, int in_height, int fps,
@@ -28,12 +69,38 @@ class FfmpegEncoder : public VideoEncoder {
   void encoder_close();
 
 private:
+  struct StageTimes {
+    double start_tms = 0;
+    double convert_ms = 0;
+    double encode_ms = 0;
+  };
+  struct EncodeJob {
+    int frame = -1;  // in the FrameConverter, the default job stops the encode thread
+    VisionIpcBufExtra extra = {};
+    StageTimes times;
+  };
+  struct PublishJob {
+    AVPacket *pkt = nullptr;  // the default job stops the publish thread
+    uint32_t idx = 0;
+    VisionIpcBufExtra extra = {};
+    StageTimes times;
+  };
+
+  static void encode_handler(FfmpegEncoder *e);
+  static void publish_handler(FfmpegEncoder *e);
+  std::thread encode_handler_thread, publish_handler_thread;
+
   int segment_num = -1;
   int counter = 0;
   bool is_open = false;
 
   AVCodecContext *codec_ctx;
   AVFrame *frame = NULL;
-  std::vector<uint8_t> convert_buf;
-  std::vector<uint8_t> downscale_buf;
+  FrameConverter *converter = nullptr;
+  std::vector<uint8_t> scaled_buf;  // used by the encode thread
+  SPSCQueue<EncodeJob, 8> to_encode;
+  SPSCQueue<PublishJob, 8> to_publish;
+
+  // statlog metric names
+  std::string convert_metric, encode_metric, publish_metric, latency_metric;
 };
@@ -23,11 +23,11 @@ private:
   int segment_num = -1;
   int counter = 0;
 
-  SafeQueue<VisionIpcBufExtra> extras;
+  SPSCQueue<VisionIpcBufExtra, 8> extras;
 
   static void dequeue_handler(V4LEncoder *e);
   std::thread dequeue_handler_thread;
 
   VisionBuf buf_out[BUF_OUT_COUNT];
-  SafeQueue<unsigned int> free_buf_in;
+  MPMCQueue<unsigned int, 8> free_buf_in;
 };
@@ -102,13 +102,10 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
         ++cur_seg;
       }
 
-      // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf, &extra);
-
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d", extra.frame_id);
-        }
+      // hand the frame to every encoder, the encoders encode and publish it on their own threads.
+      // codec errors are logged there.
+      for (auto &e : encoders) {
+        e->encode_frame(buf, &extra);
       }
     }
   }
@@ -1,9 +1,11 @@
 #include "system/loggerd/logger.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ftw.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdint>
@@ -17,8 +19,165 @@
 
 #include "common/params.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/version.h"
 
+// ***** log writer *****
+
+LogBufferPool::~LogBufferPool() {
+  for (char* buf : free_buffers) {
+    free(buf);
+  }
+}
+
+char* LogBufferPool::acquire() {
+  {
+    std::lock_guard lk(lock);
+    if (!free_buffers.empty()) {
+      char* buf = free_buffers.back();
+      free_buffers.pop_back();
+      return buf;
+    }
+  }
+  char* buf = nullptr;
+  int err = posix_memalign((void**)&buf, 4096, LOG_BUFFER_SIZE);
+  assert(err == 0);
+  // touch the ring now, not on the first laps while logging
+  memset(buf, 0, LOG_BUFFER_SIZE);
+  return buf;
+}
+
+void LogBufferPool::release(char* buf) {
+  std::lock_guard lk(lock);
+  free_buffers.push_back(buf);
+}
+
+LogWriter::LogWriter(const char* path, int zstd_level, LoggerStats* logger_stats, LogBufferPool* pool)
+    : stats(logger_stats), pool(pool), block(zstd_level > 0 ? LOG_ZSTD_FRAME_SIZE : LOG_WRITE_BLOCK) {
+  static_assert((LOG_BUFFER_SIZE & (LOG_BUFFER_SIZE - 1)) == 0, "buffer size must be a power of two");
+  fd = HANDLE_EINTR(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664));
+  assert(fd >= 0);
+  buf = pool->acquire();
+  if (zstd_level > 0) {
+    cctx = ZSTD_createCCtx();
+    assert(cctx != nullptr);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zstd_level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  }
+  thread = std::thread(&LogWriter::writerThread, this);
+}
+
+LogWriter::~LogWriter() {
+  closing = true;
+  data_ready.notify();
+  thread.join();
+  if (cctx) ZSTD_freeCCtx(cctx);
+  pool->release(buf);
+  int err = close(fd);
+  assert(err == 0);
+}
+
+void LogWriter::write(const void* data, size_t size) {
+  assert(size <= LOG_BUFFER_SIZE);
+  const uint64_t start_ns = nanos_since_boot();
+
+  uint64_t pos = 0;
+  not_full.wait_for([&]() {
+    pos = reserved.load(std::memory_order_relaxed);
+    // pos may be behind written when other appends went through in between, don't subtract
+    while (pos + size <= written.load(std::memory_order_acquire) + LOG_BUFFER_SIZE) {
+      if (reserved.compare_exchange_weak(pos, pos + size, std::memory_order_relaxed)) return true;
+    }
+    return false;
+  });
+
+  const size_t offset = pos & (LOG_BUFFER_SIZE - 1);
+  const size_t n = std::min<size_t>(size, LOG_BUFFER_SIZE - offset);
+  memcpy(buf + offset, data, n);
+  memcpy(buf, (const char*)data + n, size - n);
+  // counted before the writer can see it
+  stats->bytes += size;
+  stats->queued += size;
+
+  // publish in reservation order, the appends before this one are only copying
+  while (committed.load(std::memory_order_acquire) != pos) {
+    std::this_thread::yield();
+  }
+  committed.store(pos + size, std::memory_order_release);
+  // only wake up the writer once per block
+  if ((pos + size) / block != pos / block) {
+    data_ready.notify();
+  }
+
+  const uint64_t elapsed = nanos_since_boot() - start_ns;
+  uint64_t max_ns = stats->max_append_ns.load(std::memory_order_relaxed);
+  while (elapsed > max_ns && !stats->max_append_ns.compare_exchange_weak(max_ns, elapsed)) {}
+}
+
+void LogWriter::writerThread() {
+  util::set_thread_name("loggerd_writer");
+
+  const int interval_ms = cctx ? LOG_ZSTD_INTERVAL_MS : LOG_WRITE_INTERVAL_MS;
+  while (true) {
+    const uint64_t begin = written.load(std::memory_order_relaxed);
+    data_ready.wait_for([&]() {
+      return closing || committed.load(std::memory_order_acquire) - begin >= block;
+    }, interval_ms);
+
+    // everything once closing, which is only set after the last append
+    const bool done = closing;
+    uint64_t end = committed.load(std::memory_order_acquire);
+    if (end == begin) {
+      if (done) break;
+      continue;
+    }
+    flush(begin, end);
+    written.store(end, std::memory_order_release);
+    stats->queued -= end - begin;
+    not_full.notify();
+  }
+}
+
+void LogWriter::flush(uint64_t begin, uint64_t end) {
+  auto ring_data = [this](uint64_t pos, size_t size, auto &&fn) {
+    const size_t offset = pos & (LOG_BUFFER_SIZE - 1);
+    const size_t n = std::min<size_t>(size, LOG_BUFFER_SIZE - offset);
+    fn(buf + offset, n);
+    if (n < size) fn(buf, size - n);
+  };
+
+  if (!cctx) {
+    ring_data(begin, end - begin, [this](const char* data, size_t size) { writeAll(data, size); });
+    return;
+  }
+
+  // one frame per LOG_ZSTD_FRAME_SIZE, each with its content size so the frames
+  // can be decompressed in parallel
+  for (uint64_t pos = begin; pos < end; pos += LOG_ZSTD_FRAME_SIZE) {
+    const size_t size = std::min<uint64_t>(end - pos, LOG_ZSTD_FRAME_SIZE);
+    const char* src = buf + (pos & (LOG_BUFFER_SIZE - 1));
+    if ((pos & (LOG_BUFFER_SIZE - 1)) + size > LOG_BUFFER_SIZE) {
+      // the frame wraps around the end of the ring
+      frame.clear();
+      ring_data(pos, size, [this](const char* data, size_t n) { frame.append(data, n); });
+      src = frame.data();
+    }
+    compressed.resize(ZSTD_compressBound(size));
+    size_t ret = ZSTD_compress2(cctx, compressed.data(), compressed.size(), src, size);
+    assert(!ZSTD_isError(ret));
+    writeAll(compressed.data(), ret);
+  }
+}
+
+void LogWriter::writeAll(const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = HANDLE_EINTR(::write(fd, data, size));
+    assert(ret > 0);
+    data += ret;
+    size -= ret;
+  }
+}
+
 // ***** log metadata *****
 kj::Array<capnp::word> logger_build_init_data() {
   MessageBuilder msg;
@@ -120,11 +279,12 @@ static void lh_log_sentinel(LoggerHandle *h, SentinelType type) {
 
 // ***** logging functions *****
 
-void logger_init(LoggerState *s, bool has_qlog) {
+void logger_init(LoggerState *s, bool has_qlog, bool compress) {
   pthread_mutex_init(&s->lock, NULL);
 
   s->part = -1;
   s->has_qlog = has_qlog;
+  s->compress = compress;
   s->route_name = logger_get_route_name();
   s->init_data = logger_build_init_data();
 }
@@ -142,9 +302,10 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/rlog", h->segment_path);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog", h->segment_path);
-  snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
+  const char *ext = s->compress ? ".zst" : "";
+  snprintf(h->log_path, sizeof(h->log_path), "%s/rlog%s", h->segment_path, ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog%s", h->segment_path, ext);
+  snprintf(h->lock_path, sizeof(h->lock_path), "%s/rlog.lock", h->segment_path);
   h->end_sentinel_type = SentinelType::END_OF_SEGMENT;
   h->exit_signal = 0;
 
@@ -154,9 +315,10 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log = std::make_unique<RawFile>(h->log_path);
+  const int zstd_level = s->compress ? LOG_ZSTD_LEVEL : 0;
+  h->log = std::make_unique<LogWriter>(h->log_path, zstd_level, &s->stats, &s->buffers);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<RawFile>(h->qlog_path);
+    h->q_log = std::make_unique<LogWriter>(h->qlog_path, zstd_level, &s->stats, &s->buffers);
   }
 
   pthread_mutex_init(&h->lock, NULL);
@@ -228,14 +390,19 @@ void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   pthread_mutex_unlock(&s->lock);
 }
 
+void logger_get_stats(LoggerState *s, uint64_t *bytes, uint64_t *queued, double *max_append_ms) {
+  *bytes = s->stats.bytes;
+  *queued = s->stats.queued;
+  *max_append_ms = s->stats.max_append_ns.exchange(0) / 1e6;
+}
+
+// lock-free, the handle is kept open by the caller's reference
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
   h->log->write(data, data_size);
   if (in_qlog && h->q_log) {
     h->q_log->write(data, data_size);
   }
-  pthread_mutex_unlock(&h->lock);
 }
 
 void lh_close(LoggerHandle* h) {
@@ -249,6 +416,7 @@ void lh_close(LoggerHandle* h) {
   }
   h->refcnt--;
   if (h->refcnt == 0) {
+    // writes what the writer threads haven't written yet, see LogWriter
     h->log.reset(nullptr);
     h->q_log.reset(nullptr);
     unlink(h->lock_path);
@@ -3,14 +3,21 @@
 #include <cassert>
 #include <pthread.h>
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <capnp/serialize.h>
 #include <kj/array.h>
+#include <zstd.h>
 
 #include "cereal/messaging/messaging.h"
+#include "common/queue.h"
 #include "common/util.h"
 #include "common/swaglog.h"
 #include "system/hardware/hw.h"
@@ -19,6 +26,17 @@ const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
 
+// each log file is appended to a preallocated ring, a writer thread per file drains it
+#define LOG_BUFFER_SIZE (8 * 1024 * 1024)
+// uncompressed logs are written in blocks of LOG_WRITE_BLOCK, or what is there after LOG_WRITE_INTERVAL_MS
+#define LOG_WRITE_BLOCK (256 * 1024)
+#define LOG_WRITE_INTERVAL_MS 100
+// compressed logs are a sequence of zstd frames, each frame holds at most
+// LOG_ZSTD_FRAME_SIZE bytes or LOG_ZSTD_INTERVAL_MS of log data
+#define LOG_ZSTD_LEVEL 3
+#define LOG_ZSTD_FRAME_SIZE (1024 * 1024)
+#define LOG_ZSTD_INTERVAL_MS 5000
+
 class RawFile {
  public:
   RawFile(const char* path) {
@@ -40,18 +58,72 @@ class RawFile {
   FILE* file = nullptr;
 };
 
+// shared by all writers of a LoggerState
+struct LoggerStats {
+  std::atomic<uint64_t> bytes = 0;          // appended to the logs
+  std::atomic<uint64_t> queued = 0;         // appended, but not written yet
+  std::atomic<uint64_t> max_append_ns = 0;  // slowest append since the last logger_get_stats()
+};
+
+// Rings of closed writers are kept for the next segment, allocating and touching LOG_BUFFER_SIZE per
+// file would stall the thread that rotates the logs.
+class LogBufferPool {
+ public:
+  ~LogBufferPool();
+  char* acquire();
+  void release(char* buf);
+
+ private:
+  std::mutex lock;
+  std::vector<char*> free_buffers;
+};
+
+// Any number of threads append without locking: space in the ring is reserved with a CAS and
+// the copies are published in reservation order, so messages are never interleaved. An append
+// only waits if the ring is full. The destructor writes what is left, for compressed logs
+// it closes the last zstd frame. That runs on the thread that closes the log. While the writer
+// thread keeps up with the appends, it is about one block: a write of LOG_WRITE_BLOCK, or
+// compressing LOG_ZSTD_FRAME_SIZE.
+class LogWriter {
+ public:
+  // zstd_level 0 writes the log as is
+  LogWriter(const char* path, int zstd_level, LoggerStats* logger_stats, LogBufferPool* pool);
+  ~LogWriter();
+  void write(const void* data, size_t size);
+
+ private:
+  void writerThread();
+  void flush(uint64_t begin, uint64_t end);
+  void writeAll(const char* data, size_t size);
+
+  int fd = -1;
+  ZSTD_CCtx* cctx = nullptr;
+  LoggerStats* stats;
+  LogBufferPool* pool;
+  const size_t block;
+  char* buf = nullptr;
+  std::string frame, compressed;
+  std::atomic<bool> closing = false;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> reserved = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> committed = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> written = 0;
+  alignas(CACHE_LINE_SIZE) QueueSignal not_full;
+  alignas(CACHE_LINE_SIZE) QueueSignal data_ready;
+  std::thread thread;
+};
+
 typedef cereal::Sentinel::SentinelType SentinelType;
 
 typedef struct LoggerHandle {
   pthread_mutex_t lock;
   SentinelType end_sentinel_type;
   int exit_signal;
-  int refcnt;
+  std::atomic<int> refcnt;
   char segment_path[4096];
   char log_path[4096];
   char qlog_path[4096];
   char lock_path[4096];
-  std::unique_ptr<RawFile> log, q_log;
+  std::unique_ptr<LogWriter> log, q_log;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -61,6 +133,9 @@ typedef struct LoggerState {
   std::string route_name;
   char log_name[64];
   bool has_qlog;
+  bool compress;
+  LoggerStats stats;
+  LogBufferPool buffers;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
@@ -68,13 +143,16 @@ typedef struct LoggerState {
 
 kj::Array<capnp::word> logger_build_init_data();
 std::string logger_get_route_name();
-void logger_init(LoggerState *s, bool has_qlog);
+// with compress, the logs are written as rlog.zst and qlog.zst
+void logger_init(LoggerState *s, bool has_qlog, bool compress=false);
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part);
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+// bytes, queue depth and the worst append latency since the last call
+void logger_get_stats(LoggerState *s, uint64_t *bytes, uint64_t *queued, double *max_append_ms);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
 void lh_close(LoggerHandle* h);
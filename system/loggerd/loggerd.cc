@@ -1,6 +1,12 @@
 #include "system/loggerd/loggerd.h"
+#include "system/loggerd/drain.h"
 #include "system/loggerd/video_writer.h"
 
+#include <algorithm>
+#include <vector>
+
+#include "common/statlog.h"
+
 ExitHandler do_exit;
 
 struct LoggerdState {
@@ -53,6 +59,7 @@ struct RemoteEncoder {
   int current_segment = -1;
   std::vector<Message *> q;
   int dropped_frames = 0;
+  int drops = 0;  // since the last stats publish
   bool recording = false;
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
@@ -120,6 +127,7 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
         // nothing we can do but drop the frame
         delete msg;
         ++re.dropped_frames;
+        ++re.drops;
         return bytes_count;
       }
     }
@@ -162,20 +170,44 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     // actually, this can happen if you restart encoderd
     re.encoderd_segment_offset = -s->rotate_segment.load();
     delete msg;
+    ++re.drops;
   }
 
   return bytes_count;
 }
 
+struct ServiceState {
+  std::string name;
+  int counter, freq;
+  bool encoder;
+  int weight;  // messages per round
+  // since the last stats publish
+  int max_backlog = 0;
+  double max_latency_ms = 0;
+};
+
+void publish_drain_stats(std::unordered_map<SubSocket*, ServiceState> &service_states,
+                         std::unordered_map<SubSocket*, struct RemoteEncoder> &remote_encoders) {
+  for (auto &[sock, ss] : service_states) {
+    int drops = 0;
+    if (auto it = remote_encoders.find(sock); it != remote_encoders.end()) {
+      std::swap(drops, it->second.drops);
+    }
+    if (ss.max_backlog == 0 && drops == 0) continue;
+
+    statlog_gauge(("loggerd_" + ss.name + "_backlog").c_str(), ss.max_backlog);
+    statlog_gauge(("loggerd_" + ss.name + "_drain_latency_ms").c_str(), (float)ss.max_latency_ms);
+    statlog_count(("loggerd_" + ss.name + "_drops").c_str(), drops);
+    ss.max_backlog = 0;
+    ss.max_latency_ms = 0;
+  }
+}
+
 void loggerd_thread() {
   // setup messaging
-  typedef struct QlogState {
-    std::string name;
-    int counter, freq;
-    bool encoder;
-  } QlogState;
-  std::unordered_map<SubSocket*, QlogState> qlog_states;
+  std::unordered_map<SubSocket*, ServiceState> service_states;
   std::unordered_map<SubSocket*, struct RemoteEncoder> remote_encoders;
+  std::vector<SubSocket*> encoder_socks;
 
   std::unique_ptr<Context> ctx(Context::create());
   std::unique_ptr<Poller> poller(Poller::create());
@@ -189,17 +221,19 @@ void loggerd_thread() {
     SubSocket * sock = SubSocket::create(ctx.get(), it.name);
     assert(sock != NULL);
     poller->registerSocket(sock);
-    qlog_states[sock] = {
+    service_states[sock] = {
       .name = it.name,
       .counter = 0,
       .freq = it.decimation,
       .encoder = encoder,
+      .weight = std::max(1, (int)(it.frequency * LOGGERD_ROUND_MS / 1000)),
     };
+    if (encoder) encoder_socks.push_back(sock);
   }
 
   LoggerdState s;
   // init logger
-  logger_init(&s.logger, true);
+  logger_init(&s.logger, true, LOGGERD_COMPRESS);
   logger_rotate(&s);
   Params().put("CurrentRoute", s.logger.route_name);
 
@@ -213,40 +247,71 @@ void loggerd_thread() {
 
   uint64_t msg_count = 0, bytes_count = 0;
   double start_ts = millis_since_boot();
+  double last_stats_tms = start_ts;
+  std::vector<SubSocket*> socks;
+  std::vector<DrainSource> sources;
   while (!do_exit) {
     // poll for new messages on all sockets
-    for (auto sock : poller->poll(1000)) {
-      if (do_exit) break;
-
-      // drain socket
-      int count = 0;
-      QlogState &qs = qlog_states[sock];
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-
-        if (qs.encoder) {
-          s.last_camera_seen_tms = millis_since_boot();
-          bytes_count += handle_encoder_msg(&s, msg, qs.name, remote_encoders[sock], encoder_infos_dict[qs.name]);
-        } else {
-          logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-          bytes_count += msg->getSize();
-          delete msg;
-        }
+    std::vector<SubSocket*> ready = poller->poll(1000);
+    const double poll_tms = millis_since_boot();
+
+    // the encoders are checked in every round, even if they weren't ready when poll returned
+    socks = encoder_socks;
+    for (auto sock : ready) {
+      if (!service_states[sock].encoder) socks.push_back(sock);
+    }
+    sources.clear();
+    for (auto sock : socks) {
+      const ServiceState &ss = service_states[sock];
+      sources.push_back({.weight = ss.encoder ? LOGGERD_MAX_DRAIN : ss.weight});
+    }
 
-        rotate_if_needed(&s);
+    drain_round(sources, LOGGERD_MAX_DRAIN, [&](size_t i) {
+      if (do_exit) return false;
+      SubSocket *sock = socks[i];
+      Message *msg = sock->receive(true);
+      if (!msg) return false;
 
-        if ((++msg_count % 1000) == 0) {
-          double seconds = (millis_since_boot() - start_ts) / 1000.0;
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
-        }
+      ServiceState &ss = service_states[sock];
+      if (sources[i].drained == 0) {
+        // how long the socket waited after poll returned, including the turns before it got its turn
+        ss.max_latency_ms = std::max(ss.max_latency_ms, millis_since_boot() - poll_tms);
+      }
+      const bool in_qlog = ss.freq != -1 && (ss.counter++ % ss.freq == 0);
 
-        count++;
-        if (count >= 200) {
-          LOGD("large volume of '%s' messages", qs.name.c_str());
-          break;
-        }
+      if (ss.encoder) {
+        s.last_camera_seen_tms = millis_since_boot();
+        bytes_count += handle_encoder_msg(&s, msg, ss.name, remote_encoders[sock], encoder_infos_dict[ss.name]);
+      } else {
+        logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+        bytes_count += msg->getSize();
+        delete msg;
       }
+
+      rotate_if_needed(&s);
+
+      if ((++msg_count % 1000) == 0) {
+        double seconds = (millis_since_boot() - start_ts) / 1000.0;
+        uint64_t written_bytes = 0, queued_bytes = 0;
+        double max_append_ms = 0;
+        logger_get_stats(&s.logger, &written_bytes, &queued_bytes, &max_append_ms);
+        LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec, log %.2f KB/sec, %.2f KB queued, max append %.3f ms",
+             msg_count, msg_count / seconds, bytes_count * 0.001 / seconds,
+             written_bytes * 0.001 / seconds, queued_bytes * 0.001, max_append_ms);
+      }
+      return true;
+    });
+
+    for (size_t i = 0; i < socks.size(); ++i) {
+      ServiceState &ss = service_states[socks[i]];
+      if (sources[i].drained >= LOGGERD_MAX_DRAIN) {
+        LOGD("large volume of '%s' messages", ss.name.c_str());
+      }
+      ss.max_backlog = std::max(ss.max_backlog, sources[i].drained);
+    }
+    if (poll_tms - last_stats_tms > LOGGERD_STATS_INTERVAL_MS) {
+      publish_drain_stats(service_states, remote_encoders);
+      last_stats_tms = poll_tms;
     }
   }
 
@@ -260,7 +325,7 @@ void loggerd_thread() {
   }
 
   // messaging cleanup
-  for (auto &[sock, qs] : qlog_states) delete sock;
+  for (auto &[sock, ss] : service_states) delete sock;
 }
 
 int main(int argc, char** argv) {
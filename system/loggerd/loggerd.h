@@ -38,8 +38,17 @@ const int MAIN_BITRATE = 10000000;
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
 
+// Sockets are drained in rounds. In each round the encoder sockets go first and are drained
+// completely, then every other ready socket gets its weight: the messages the service publishes
+// in LOGGERD_ROUND_MS. A burst on a busy service can't hold up the encode index packets.
+#define LOGGERD_ROUND_MS 50
+#define LOGGERD_MAX_DRAIN 200  // per socket and poll
+#define LOGGERD_STATS_INTERVAL_MS 5000
+
 const bool LOGGERD_TEST = getenv("LOGGERD_TEST");
 const int SEGMENT_LENGTH = LOGGERD_TEST ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
+// write rlog.zst and qlog.zst instead of compressing the logs before uploading
+const bool LOGGERD_COMPRESS = util::getenv("LOGGERD_COMPRESS", 0) != 0;
 
 class EncoderInfo {
 public:
@@ -0,0 +1,49 @@
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "system/loggerd/drain.h"
+
+TEST_CASE("drain_round") {
+  const int max_drain = 200;
+  // an encoder, a busy socket and a few quiet ones, with the messages queued on each
+  std::vector<DrainSource> sources = {{.weight = max_drain}, {.weight = 5}, {.weight = 1}, {.weight = 1}, {.weight = 2}};
+  std::vector<int> queued = {30, 1000, 3, 1, 4};
+
+  std::vector<size_t> order;
+  std::vector<int> first_messages(sources.size(), 0);
+  auto receive = [&](size_t i) {
+    if (queued[i] == 0) return false;
+    if (sources[i].drained == 0) ++first_messages[i];
+    --queued[i];
+    order.push_back(i);
+    return true;
+  };
+  drain_round(sources, max_drain, receive);
+
+  // the encoder is drained in its first turn
+  REQUIRE(sources[0].drained == 30);
+  REQUIRE(std::vector<size_t>(order.begin(), order.begin() + 30) == std::vector<size_t>(30, 0));
+
+  // the busy socket doesn't starve the others: each one gets a turn before the busy socket's second turn
+  std::vector<size_t> first_turns(order.begin() + 30, order.begin() + 30 + 5 + 1 + 1 + 2);
+  REQUIRE(first_turns == std::vector<size_t>{1, 1, 1, 1, 1, 2, 3, 4, 4});
+
+  // the quiet sockets are drained, and the busy socket stops at max_drain
+  REQUIRE(sources[1].drained == max_drain);
+  REQUIRE(queued[1] == 1000 - max_drain);
+  REQUIRE(sources[2].drained == 3);
+  REQUIRE(sources[3].drained == 1);
+  REQUIRE(sources[4].drained == 4);
+  REQUIRE(queued[2] + queued[3] + queued[4] == 0);
+  REQUIRE(order.size() == 30 + max_drain + 3 + 1 + 4);
+
+  // the first message of each socket is seen once, that's where its drain latency is measured
+  REQUIRE(first_messages == std::vector<int>(sources.size(), 1));
+
+  // the next round starts over
+  drain_round(sources, max_drain, receive);
+  REQUIRE(sources[0].drained == 0);
+  REQUIRE(sources[1].drained == max_drain);
+  REQUIRE(queued[1] == 1000 - 2 * max_drain);
+  REQUIRE(first_messages[1] == 2);
+}
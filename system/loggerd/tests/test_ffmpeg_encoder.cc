@@ -0,0 +1,122 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "system/loggerd/encoder/ffmpeg_encoder.h"
+
+// a camera frame with Y = x + y + frame_id, and interleaved U, V = frame_id, frame_id + 1
+struct TestFrame {
+  TestFrame(int width, int height) : width(width), height(height), data(width * height * 3 / 2) {
+    buf.width = width;
+    buf.height = height;
+    buf.stride = width;
+    buf.y = data.data();
+    buf.uv = data.data() + width * height;
+  }
+  VisionBuf *fill(uint32_t frame_id) {
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        buf.y[y * width + x] = x + y + frame_id;
+      }
+    }
+    for (int i = 0; i < width * height / 4; ++i) {
+      buf.uv[i * 2] = frame_id;
+      buf.uv[i * 2 + 1] = frame_id + 1;
+    }
+    return &buf;
+  }
+
+  const int width, height;
+  std::vector<uint8_t> data;
+  VisionBuf buf = {};
+};
+
+TEST_CASE("FrameConverter") {
+  const int width = 64, height = 32;
+  FrameConverter converter(width, height);
+  TestFrame camera(width, height);
+
+  // the full-res and the qcamera encoder are handed the same converted frame
+  VisionBuf *buf = camera.fill(0);
+  const int first = converter.convert(buf, 0);
+  REQUIRE(converter.convert(buf, 0) == first);
+  const FrameConverter::Frame &f = converter.frame(first);
+  REQUIRE(f.refs == 3);
+  REQUIRE(f.data[width + 1] == 2);
+  REQUIRE(f.data[width * height] == 0);
+  REQUIRE(f.data[width * height + width * height / 4] == 1);
+
+  // the slot stays in use until both encoders released it, in any order, and the next camera frame arrived
+  converter.release(first);
+  converter.release(first);
+  REQUIRE(f.refs == 1);
+  const int second = converter.convert(camera.fill(1), 1);
+  REQUIRE(second != first);
+  REQUIRE(f.refs == 0);
+  REQUIRE(converter.convert(&camera.buf, 1) == second);
+
+  // the encoders fall behind until they hold every slot
+  std::vector<int> held = {second, second};
+  for (uint32_t frame_id = 2; frame_id <= FFMPEG_FRAME_COUNT; ++frame_id) {
+    buf = camera.fill(frame_id);
+    held.push_back(converter.convert(buf, frame_id));
+    held.push_back(converter.convert(buf, frame_id));
+  }
+  // the camera thread waits until both encoders released the oldest frame, and gets its slot
+  std::atomic<int> next = -1;
+  std::thread camera_thread([&]() { next = converter.convert(camera.fill(10), 10); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(next == -1);
+  converter.release(held[1]);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(next == -1);
+  converter.release(held[0]);
+  camera_thread.join();
+  REQUIRE(next == second);
+  REQUIRE(converter.frame(next).data[0] == 10);
+}
+
+TEST_CASE("FfmpegEncoder shares the converted frames") {
+  const int width = 64, height = 32, frames = 50;
+  std::unique_ptr<Context> ctx(Context::create());
+  std::unique_ptr<SubSocket> road_sock(SubSocket::create(ctx.get(), "roadEncodeData"));
+  std::unique_ptr<SubSocket> qroad_sock(SubSocket::create(ctx.get(), "qRoadEncodeData"));
+
+  FfmpegEncoder road("fcamera.hevc", RoadCam, width, height, 20, 0, cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS,
+                     width, height, "roadEncodeData");
+  FfmpegEncoder qroad("qcamera.ts", RoadCam, width, height, 20, 0, cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS,
+                      width / 2, height / 2, "qRoadEncodeData");
+  TestFrame camera(width, height);
+  road.encoder_open(nullptr);
+  qroad.encoder_open(nullptr);
+  for (int i = 0; i < frames; ++i) {
+    VisionIpcBufExtra extra = {};
+    extra.frame_id = i;
+    VisionBuf *buf = camera.fill(i);
+    REQUIRE(road.encode_frame(buf, &extra) == i);
+    REQUIRE(qroad.encode_frame(buf, &extra) == i);
+  }
+  // the frames still queued are encoded and published on close, and give their slots back
+  road.encoder_close();
+  qroad.encoder_close();
+
+  const FrameConverter &converter = FrameConverter::get(RoadCam, width, height);
+  int refs = 0;
+  for (int i = 0; i < FFMPEG_FRAME_COUNT; ++i) {
+    refs += converter.frame(i).refs;
+  }
+  // only the last camera frame is kept
+  REQUIRE(refs == 1);
+
+  for (auto sock : {road_sock.get(), qroad_sock.get()}) {
+    int published = 0;
+    while (std::unique_ptr<Message>(sock->receive(true))) {
+      ++published;
+    }
+    REQUIRE(published == frames);
+  }
+}
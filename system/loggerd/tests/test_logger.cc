@@ -6,6 +6,8 @@
 #include <thread>
 #include <utility>
 
+#include <zstd.h>
+
 #include "catch2/catch.hpp"
 #include "cereal/messaging/messaging.h"
 #include "common/util.h"
@@ -14,15 +16,35 @@
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
-void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt) {
+std::string decompress_zst(const std::string &in) {
+  std::string out;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  ZSTD_inBuffer input = {in.data(), in.size(), 0};
+  char buf[64 * 1024];
+  size_t ret = 0;
+  while (input.pos < input.size) {
+    ZSTD_outBuffer output = {buf, sizeof(buf), 0};
+    ret = ZSTD_decompressStream(dctx, &output, &input);
+    REQUIRE(!ZSTD_isError(ret));
+    out.append(buf, output.pos);
+  }
+  ZSTD_freeDCtx(dctx);
+  // the last frame must be complete
+  REQUIRE(ret == 0);
+  return out;
+}
+
+void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt, bool compressed = false) {
   const std::string segment_path = route_path + "--" + std::to_string(segment);
   SentinelType begin_sentinel = segment == 0 ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT;
   SentinelType end_sentinel = segment == max_segment - 1 ? SentinelType::END_OF_ROUTE : SentinelType::END_OF_SEGMENT;
 
   REQUIRE(!util::file_exists(segment_path + "/rlog.lock"));
   for (const char *fn : {"/rlog", "/qlog"}) {
-    const std::string log_file = segment_path + fn;
+    const std::string log_file = segment_path + fn + (compressed ? ".zst" : "");
+    REQUIRE(!util::file_exists(segment_path + fn + (compressed ? "" : ".zst")));
     std::string log = util::read_file(log_file);
+    if (compressed) log = decompress_zst(log);
     REQUIRE(!log.empty());
     int event_cnt = 0, i = 0;
     kj::ArrayPtr<const capnp::word> words((capnp::word *)log.data(), log.size() / sizeof(capnp::word));
@@ -90,6 +112,25 @@ TEST_CASE("logger") {
       verify_segment(log_root + "/" + logger.route_name, i, segment_cnt, 1);
     }
   }
+  SECTION("compressed logging & rotation(10 segments, one thread)") {
+    LoggerState zlogger = {};
+    logger_init(&zlogger, true, true);
+    const int segment_cnt = 10, event_cnt = 50000;
+    for (int i = 0; i < segment_cnt; ++i) {
+      REQUIRE(logger_next(&zlogger, log_root.c_str(), segment_path, sizeof(segment_path), &segment) == 0);
+      REQUIRE(util::file_exists(std::string(segment_path) + "/rlog.lock"));
+      // more than one zstd frame per segment
+      for (int j = 0; j < event_cnt; ++j) {
+        write_msg(zlogger.cur_handle);
+      }
+    }
+    do_exit = true;
+    do_exit.signal = 1;
+    logger_close(&zlogger, &do_exit);
+    for (int i = 0; i < segment_cnt; ++i) {
+      verify_segment(log_root + "/" + zlogger.route_name, i, segment_cnt, event_cnt, true);
+    }
+  }
   SECTION("multiple threads logging & rotation(100 segments, 10 threads") {
     const int segment_cnt = 100, thread_cnt = 10;
     std::atomic<int> event_cnt[segment_cnt] = {};
@@ -140,6 +181,13 @@ TEST_CASE("logger") {
     logger_close(&logger, &do_exit);
     REQUIRE(logger.cur_handle->refcnt == 0);
 
+    // everything appended was written
+    uint64_t bytes = 0, queued = 0;
+    double max_append_ms = 0;
+    logger_get_stats(&logger, &bytes, &queued, &max_append_ms);
+    REQUIRE(bytes > 0);
+    REQUIRE(queued == 0);
+
     for (int i = 0; i < segment_cnt; ++i) {
       verify_segment(log_root + "/" + logger.route_name, i, segment_cnt, event_cnt[i]);
     }
@@ -86,6 +86,22 @@ class TestUploader(UploaderTestCase):
 
     self.assertTrue(log_handler.upload_order == exp_order, "Files uploaded in wrong order")
 
+  def test_upload_zst(self):
+    # logs written by loggerd with LOGGERD_COMPRESS are already compressed
+    for t in ["qcamera.ts", "rlog.zst", "qlog.zst", "dcamera.hevc", "fcamera.hevc"]:
+      self.make_file_with_data(self.seg_dir, t, 1)
+
+    self.start_thread()
+    # allow enough time that files could upload twice if there is a bug in the logic
+    time.sleep(5)
+    self.join_thread()
+
+    exp_order = [f"{self.seg_dir}/qlog.zst", f"{self.seg_dir}/qcamera.ts"]
+    self.assertTrue(len(log_handler.upload_ignored) == 0, "Some files were ignored")
+    self.assertEqual(log_handler.upload_order, exp_order, "Files uploaded in wrong order or with a .bz2 suffix")
+    for f_path in exp_order:
+      self.assertEqual(os.getxattr(os.path.join(self.root, f_path), UPLOAD_ATTR_NAME), UPLOAD_ATTR_VALUE, "All files not uploaded")
+
   def test_upload_with_wrong_xattr(self):
     self.gen_files(lock=False, xattr=b'0')
 
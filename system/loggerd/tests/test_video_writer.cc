@@ -0,0 +1,108 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "catch2/catch.hpp"
+#include "common/util.h"
+#include "system/loggerd/video_writer.h"
+
+// waits until the file is on disk and its lock file is removed
+static void wait_for_sync(const std::string &lock_path) {
+  for (int i = 0; i < 500 && util::file_exists(lock_path); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  REQUIRE_FALSE(util::file_exists(lock_path));
+}
+
+TEST_CASE("AsyncVideoFile") {
+  char tmp_path[] = "/tmp/video_writer_XXXXXX";
+  const std::string dir = mkdtemp(tmp_path);
+  const std::string path = dir + "/video", lock_path = path + ".lock";
+  close(HANDLE_EINTR(open(lock_path.c_str(), O_RDWR | O_CREAT, 0664)));
+
+  auto file = std::make_shared<AsyncVideoFile>(path, lock_path);
+  const int avio_buffer_size = 64 * 1024;
+  uint8_t *avio_buffer = (uint8_t *)av_malloc(avio_buffer_size);
+  AVIOContext *pb = avio_alloc_context(avio_buffer, avio_buffer_size, 1, file.get(), NULL,
+                                       AsyncVideoFile::avioWrite, AsyncVideoFile::avioSeek);
+  REQUIRE(pb != nullptr);
+
+  // the muxers write the header, the data, and then go back to fill in sizes
+  std::string expected;
+  std::mt19937 rng(1234);
+  auto write_at = [&](int64_t offset, size_t size) {
+    std::string data(size, '\0');
+    for (char &c : data) c = rng();
+    REQUIRE(avio_seek(pb, offset, SEEK_SET) == offset);
+    avio_write(pb, (const unsigned char *)data.data(), data.size());
+    if (expected.size() < offset + size) expected.resize(offset + size);
+    expected.replace(offset, size, data);
+  };
+  write_at(0, 4096 + 17);
+  write_at(4096 + 17, 5 * VIDEO_BUFFER_SIZE / 2 + 123);
+  write_at(1000, 4096);
+  write_at(4096 * 3, 10);
+  write_at(expected.size(), 777);
+  write_at(VIDEO_BUFFER_SIZE - 5, 10);
+  avio_flush(pb);
+  REQUIRE(avio_size(pb) == expected.size());
+  REQUIRE(avio_seek(pb, 0, SEEK_CUR) == VIDEO_BUFFER_SIZE + 5);
+
+  av_freep(&pb->buffer);
+  avio_context_free(&pb);
+  file->close();
+  file.reset();
+
+  // the lock file is only removed once the data is on disk
+  REQUIRE(util::file_exists(lock_path));
+  wait_for_sync(lock_path);
+  REQUIRE(util::read_file(path) == expected);
+
+  unlink(path.c_str());
+  rmdir(dir.c_str());
+}
+
+TEST_CASE("AsyncVideoFile buffer boundary") {
+  char tmp_path[] = "/tmp/video_writer_XXXXXX";
+  const std::string dir = mkdtemp(tmp_path);
+  const std::string path = dir + "/video", lock_path = path + ".lock";
+  close(HANDLE_EINTR(open(lock_path.c_str(), O_RDWR | O_CREAT, 0664)));
+
+  auto file = std::make_shared<AsyncVideoFile>(path, lock_path);
+  std::string expected;
+  std::mt19937 rng(1234);
+  auto write_at = [&](int64_t offset, size_t size) {
+    std::string data(size, '\0');
+    for (char &c : data) c = rng();
+    REQUIRE(file->seek(offset, SEEK_SET) == offset);
+    // in the chunks of the AVIOContext
+    for (size_t i = 0; i < size; i += 64 * 1024) {
+      file->write((const uint8_t *)data.data() + i, std::min<size_t>(64 * 1024, size - i));
+    }
+    if (expected.size() < offset + size) expected.resize(offset + size);
+    expected.replace(offset, size, data);
+  };
+
+  // a write that fills a buffer submits it, the other buffer can still be written then.
+  // seeking back to fix up a header must not submit the buffer in flight again
+  for (int i = 0; i < 10; ++i) {
+    write_at(expected.size(), 2 * VIDEO_BUFFER_SIZE - expected.size() % VIDEO_BUFFER_SIZE);
+    write_at(100 + i * 10, 50);
+  }
+  // and neither must closing
+  write_at(expected.size(), 2 * VIDEO_BUFFER_SIZE - expected.size() % VIDEO_BUFFER_SIZE);
+  REQUIRE(file->seek(0, AVSEEK_SIZE) == expected.size());
+  file->close();
+  file.reset();
+
+  wait_for_sync(lock_path);
+  REQUIRE(util::read_file(path) == expected);
+
+  unlink(path.c_str());
+  rmdir(dir.c_str());
+}
@@ -86,7 +86,7 @@ class Uploader:
     self.last_filename = ""
 
     self.immediate_folders = ["crash/", "boot/"]
-    self.immediate_priority = {"qlog": 0, "qlog.bz2": 0, "qcamera.ts": 1}
+    self.immediate_priority = {"qlog": 0, "qlog.bz2": 0, "qlog.zst": 0, "qcamera.ts": 1}
 
   def get_upload_sort(self, name: str) -> int:
     if name in self.immediate_priority:
@@ -277,7 +277,7 @@ def uploader_fn(exit_event: threading.Event) -> None:
 
     name, key, fn = d
 
-    # qlogs and bootlogs need to be compressed before uploading
+    # qlogs and bootlogs need to be compressed before uploading, .zst logs are already compressed by loggerd
     if key.endswith(('qlog', 'rlog')) or (key.startswith('boot/') and not key.endswith('.bz2')):
       key += ".bz2"
 
@@ -1,11 +1,217 @@
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "system/loggerd/video_writer.h"
+#include "common/queue.h"
 #include "common/swaglog.h"
 #include "common/util.h"
 
+// closes within this time of each other are synced together
+#define VIDEO_SYNC_BATCH_MS 200
+#define DIRECT_IO_ALIGNMENT 4096
+
+static bool pwrite_all(int fd, const uint8_t *data, size_t size, int64_t offset) {
+  while (size > 0) {
+    ssize_t ret = HANDLE_EINTR(pwrite(fd, data, size, offset));
+    if (ret <= 0) return false;
+    data += ret;
+    size -= ret;
+    offset += ret;
+  }
+  return true;
+}
+
+// the writer and sync threads shared by all video files
+class VideoFileWriter {
+public:
+  static VideoFileWriter &instance() {
+    static VideoFileWriter writer;
+    return writer;
+  }
+  void write(std::shared_ptr<AsyncVideoFile> file, int idx) { writes.push({file, idx}); }
+  void close(std::shared_ptr<AsyncVideoFile> file) { writes.push({file, -1}); }
+
+  // the pending writes and syncs are done before exit
+  ~VideoFileWriter() {
+    writes.push({nullptr, 0});
+    writer.join();
+    syncs.push(nullptr);
+    syncer.join();
+  }
+
+private:
+  VideoFileWriter() : writer(&VideoFileWriter::writeThread, this), syncer(&VideoFileWriter::syncThread, this) {}
+
+  void writeThread() {
+    util::set_thread_name("loggerd_video_writer");
+    while (true) {
+      auto [file, idx] = writes.pop();
+      if (!file) break;
+
+      if (idx >= 0) {
+        file->writeBuffer(idx);
+      } else {
+        // all buffers of the file are written, a close comes after them in the queue
+        syncs.push(file);
+      }
+    }
+  }
+
+  void syncThread() {
+    util::set_thread_name("loggerd_video_sync");
+    bool exit = false;
+    while (!exit) {
+      // the encoders close their files within a few frames of each other at a segment boundary
+      std::vector<std::shared_ptr<AsyncVideoFile>> batch = {syncs.pop()};
+      std::shared_ptr<AsyncVideoFile> file;
+      while (batch.back() && syncs.try_pop(file, VIDEO_SYNC_BATCH_MS)) {
+        batch.push_back(file);
+      }
+      for (auto &f : batch) {
+        if (f) {
+          f->sync();
+        } else {
+          exit = true;
+        }
+      }
+    }
+  }
+
+  SafeQueue<std::pair<std::shared_ptr<AsyncVideoFile>, int>> writes;
+  SafeQueue<std::shared_ptr<AsyncVideoFile>> syncs;
+  std::thread writer, syncer;
+};
+
+AsyncVideoFile::AsyncVideoFile(const std::string &file_path, const std::string &lock_file_path)
+  : path(file_path), lock_path(lock_file_path) {
+  fd = HANDLE_EINTR(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664));
+  assert(fd >= 0);
+#ifdef O_DIRECT
+  // not supported by every filesystem, everything goes through fd then
+  direct_fd = HANDLE_EINTR(open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC));
+#endif
+  for (auto &b : buffers) {
+    int err = posix_memalign((void **)&b.data, DIRECT_IO_ALIGNMENT, VIDEO_BUFFER_SIZE);
+    assert(err == 0);
+  }
+}
+
+AsyncVideoFile::~AsyncVideoFile() {
+  if (fd >= 0) sync();
+  for (auto &b : buffers) free(b.data);
+}
+
+void AsyncVideoFile::write(const uint8_t *data, size_t size) {
+  std::unique_lock lk(lock);
+  while (size > 0) {
+    // only waits if the writer is still busy with the other buffer
+    cv.wait(lk, [this]() { return !buffers[cur].busy; });
+    Buffer &b = buffers[cur];
+    if (b.size == 0) b.offset = pos;
+
+    const size_t n = std::min(size, VIDEO_BUFFER_SIZE - b.size);
+    memcpy(b.data + b.size, data, n);
+    b.size += n;
+    data += n;
+    size -= n;
+    pos += n;
+    file_size = std::max(file_size, pos);
+    if (b.size == VIDEO_BUFFER_SIZE) submit();
+  }
+}
+
+int64_t AsyncVideoFile::seek(int64_t offset, int whence) {
+  std::unique_lock lk(lock);
+  if (whence & AVSEEK_SIZE) return file_size;
+
+  int64_t target = -1;
+  switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: target = offset; break;
+    case SEEK_CUR: target = pos + offset; break;
+    case SEEK_END: target = file_size + offset; break;
+  }
+  if (target < 0) return AVERROR(EINVAL);
+
+  // the buffered data is contiguous, start a new buffer at the new position.
+  // a busy buffer is already submitted, the next write waits for it and starts at the new position
+  if (target != pos && !buffers[cur].busy && buffers[cur].size > 0) submit();
+  pos = target;
+  return pos;
+}
+
+void AsyncVideoFile::close() {
+  std::unique_lock lk(lock);
+  if (!buffers[cur].busy && buffers[cur].size > 0) submit();
+  VideoFileWriter::instance().close(shared_from_this());
+}
+
+// called with the lock held
+void AsyncVideoFile::submit() {
+  buffers[cur].busy = true;
+  VideoFileWriter::instance().write(shared_from_this(), cur);
+  cur ^= 1;
+}
+
+void AsyncVideoFile::writeBuffer(int idx) {
+  // the buffer belongs to the writer thread until busy is cleared
+  Buffer &b = buffers[idx];
+  size_t direct = 0;
+  if (direct_fd >= 0 && b.offset % DIRECT_IO_ALIGNMENT == 0) {
+    direct = b.size & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+  }
+  // O_DIRECT needs aligned offsets and sizes, the rest goes through the page cache
+  if (direct > 0 && !pwrite_all(direct_fd, b.data, direct, b.offset)) {
+    // e.g. a filesystem that rejects the alignment. the whole buffer and all later ones go through fd
+    LOGW("O_DIRECT write to %s failed, falling back to buffered writes. errno=%d", path.c_str(), errno);
+    ::close(direct_fd);
+    direct_fd = -1;
+    direct = 0;
+  }
+  if (!pwrite_all(fd, b.data + direct, b.size - direct, b.offset + direct)) {
+    LOGE("failed to write %s. errno=%d", path.c_str(), errno);
+  }
+
+  {
+    std::lock_guard lk(lock);
+    b.size = 0;
+    b.busy = false;
+  }
+  cv.notify_all();
+}
+
+void AsyncVideoFile::sync() {
+#ifdef __APPLE__
+  int err = fsync(fd);
+#else
+  int err = fdatasync(fd);
+#endif
+  if (err != 0) {
+    LOGE("fdatasync %s failed. errno=%d", path.c_str(), errno);
+  }
+  if (direct_fd >= 0) ::close(direct_fd);
+  ::close(fd);
+  fd = direct_fd = -1;
+  unlink(lock_path.c_str());
+}
+
+int AsyncVideoFile::avioWrite(void *opaque, uint8_t *buf, int buf_size) {
+  ((AsyncVideoFile *)opaque)->write(buf, buf_size);
+  return buf_size;
+}
+
+int64_t AsyncVideoFile::avioSeek(void *opaque, int64_t offset, int whence) {
+  return ((AsyncVideoFile *)opaque)->seek(offset, whence);
+}
+
 VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec)
   : remuxing(remuxing) {
   raw = codec == cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS;
@@ -15,6 +221,7 @@ VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing,
   int lock_fd = HANDLE_EINTR(open(lock_path.c_str(), O_RDWR | O_CREAT, 0664));
   assert(lock_fd >= 0);
   close(lock_fd);
+  file = std::make_shared<AsyncVideoFile>(vid_path, lock_path);
 
   LOGD("encoder_open %s remuxing:%d", this->vid_path.c_str(), this->remuxing);
   if (this->remuxing) {
@@ -42,21 +249,20 @@ VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing,
     this->out_stream = avformat_new_stream(this->ofmt_ctx, raw ? avcodec : NULL);
     assert(this->out_stream);
 
-    int err = avio_open(&this->ofmt_ctx->pb, this->vid_path.c_str(), AVIO_FLAG_WRITE);
-    assert(err >= 0);
-
-  } else {
-    this->of = util::safe_fopen(this->vid_path.c_str(), "wb");
-    assert(this->of);
+    // the muxer writes through the async file
+    const int avio_buffer_size = 64 * 1024;
+    uint8_t *avio_buffer = (uint8_t *)av_malloc(avio_buffer_size);
+    assert(avio_buffer);
+    this->ofmt_ctx->pb = avio_alloc_context(avio_buffer, avio_buffer_size, 1, this->file.get(), NULL,
+                                            AsyncVideoFile::avioWrite, AsyncVideoFile::avioSeek);
+    assert(this->ofmt_ctx->pb);
+    this->ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
   }
 }
 
 void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe) {
-  if (of && data) {
-    size_t written = util::safe_fwrite(data, 1, len, of);
-    if (written != len) {
-      LOGE("failed to write file.errno=%d", errno);
-    }
+  if (!remuxing && data) {
+    file->write(data, len);
   }
 
   if (remuxing) {
@@ -102,13 +308,11 @@ VideoWriter::~VideoWriter() {
     int err = av_write_trailer(this->ofmt_ctx);
     if (err != 0) LOGE("av_write_trailer failed %d", err);
     avcodec_free_context(&this->codec_ctx);
-    err = avio_closep(&this->ofmt_ctx->pb);
-    if (err != 0) LOGE("avio_closep failed %d", err);
+    avio_flush(this->ofmt_ctx->pb);
+    av_freep(&this->ofmt_ctx->pb->buffer);
+    avio_context_free(&this->ofmt_ctx->pb);
     avformat_free_context(this->ofmt_ctx);
-  } else {
-    util::safe_fflush(this->of);
-    fclose(this->of);
-    this->of = nullptr;
   }
-  unlink(this->lock_path.c_str());
+  // the lock file is removed once the file is synced
+  this->file->close();
 }
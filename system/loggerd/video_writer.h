@@ -1,5 +1,8 @@
 #pragma once
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
 
 extern "C" {
@@ -9,6 +12,49 @@ extern "C" {
 
 #include "cereal/messaging/messaging.h"
 
+// each file has two buffers, one is filled while the other one is written
+#define VIDEO_BUFFER_SIZE (2 * 1024 * 1024)
+
+// A video file written in the background. Data is collected in one of two aligned buffers, full
+// buffers are written with pwrite on a writer thread shared by all files, so write() only waits
+// on the flash if both buffers are full. Aligned blocks go through O_DIRECT and skip the page cache.
+// close() returns immediately: the files closed at a segment boundary are fdatasync'd together
+// on another thread, and the lock file is removed once the data is on disk.
+class AsyncVideoFile : public std::enable_shared_from_this<AsyncVideoFile> {
+public:
+  AsyncVideoFile(const std::string &file_path, const std::string &lock_file_path);
+  ~AsyncVideoFile();
+  void write(const uint8_t *data, size_t size);
+  // lseek semantics, plus AVSEEK_SIZE
+  int64_t seek(int64_t offset, int whence);
+  void close();
+
+  // write_packet and seek of an AVIOContext, opaque is the AsyncVideoFile
+  static int avioWrite(void *opaque, uint8_t *buf, int buf_size);
+  static int64_t avioSeek(void *opaque, int64_t offset, int whence);
+
+private:
+  struct Buffer {
+    uint8_t *data = nullptr;
+    size_t size = 0;
+    int64_t offset = 0;
+    bool busy = false;
+  };
+  void submit();
+  void writeBuffer(int idx);
+  void sync();
+
+  std::string path, lock_path;
+  int fd = -1, direct_fd = -1;
+  Buffer buffers[2];
+  int cur = 0;
+  int64_t pos = 0, file_size = 0;
+  std::mutex lock;
+  std::condition_variable cv;
+
+  friend class VideoFileWriter;
+};
+
 class VideoWriter {
 public:
   VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec);
@@ -17,10 +63,10 @@ public:
 private:
   std::string vid_path, lock_path;
 
-  FILE *of = nullptr;
+  std::shared_ptr<AsyncVideoFile> file;
 
   AVCodecContext *codec_ctx;
   AVFormatContext *ofmt_ctx;
   AVStream *out_stream;
   bool remuxing, raw;
-};
\ No newline at end of file
+};
@@ -51,8 +51,6 @@ bool PandaStream::connect() {
 }
 
 void PandaStream::streamThread() {
-  std::vector<can_frame> raw_can_data;
-
   while (!QThread::currentThread()->isInterruptionRequested()) {
     QThread::msleep(1);
 
@@ -64,21 +62,16 @@ void PandaStream::streamThread() {
       }
     }
 
-    raw_can_data.clear();
-    if (!panda->can_receive(raw_can_data)) {
-      qDebug() << "failed to receive";
-      continue;
-    }
+    can_receive_result rx;
+    bool received = panda->can_receive_count(rx);
 
     MessageBuilder msg;
     auto evt = msg.initEvent();
-    auto canData = evt.initCan(raw_can_data.size());
-
-    for (uint i = 0; i<raw_can_data.size(); i++) {
-      canData[i].setAddress(raw_can_data[i].address);
-      canData[i].setBusTime(raw_can_data[i].busTime);
-      canData[i].setDat(kj::arrayPtr((uint8_t*)raw_can_data[i].dat.data(), raw_can_data[i].dat.size()));
-      canData[i].setSrc(raw_can_data[i].src);
+    auto canData = evt.initCan(rx.frame_count);
+    panda->can_unpack(rx, canData, 0);
+    if (!received) {
+      qDebug() << "failed to receive";
+      continue;
     }
 
     auto bytes = msg.toBytes();
@@ -2,9 +2,11 @@
 import os
 import sys
 import bz2
+import io
 import urllib.parse
 import capnp
 import warnings
+import zstandard
 
 
 from cereal import log as capnp_log
@@ -81,7 +83,7 @@ class LogReader:
     ext = None
     if not dat:
       _, ext = os.path.splitext(urllib.parse.urlparse(fn).path)
-      if ext not in ('', '.bz2'):
+      if ext not in ('', '.bz2', '.zst'):
         # old rlogs weren't bz2 compressed
         raise Exception(f"unknown extension {ext}")
 
@@ -90,6 +92,9 @@ class LogReader:
 
     if ext == ".bz2" or dat.startswith(b'BZh9'):
       dat = bz2.decompress(dat)
+    elif ext == ".zst" or dat.startswith(b'\x28\xb5\x2f\xfd'):
+      # loggerd writes a zstd frame at a time, a truncated last frame is dropped
+      dat = zstandard.ZstdDecompressor().stream_reader(io.BytesIO(dat), read_across_frames=True).read()
 
     ents = capnp_log.Event.read_multiple_bytes(dat)
 
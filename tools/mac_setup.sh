@@ -49,6 +49,7 @@ brew "openssl@3.0"
 brew "pyenv"
 brew "qt@5"
 brew "zeromq"
+brew "zstd"
 brew "protobuf"
 brew "protobuf-c"
 brew "swig"
@@ -0,0 +1,217 @@
+#include "tools/replay/batch.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <regex>
+#include <thread>
+
+#include "tools/replay/mergedevents.h"
+#include "tools/replay/util.h"
+
+// segments loaded ahead of the ones being merged
+const size_t BATCH_LOAD_AHEAD = 2;
+
+static std::vector<std::string> listDir(const std::string &path, bool dirs) {
+  std::vector<std::string> ret;
+  DIR *d = opendir(path.c_str());
+  if (!d) return ret;
+
+  struct dirent *de = nullptr;
+  while ((de = readdir(d))) {
+    const std::string name = de->d_name;
+    if (name != "." && name != ".." && (de->d_type == DT_DIR) == dirs) {
+      ret.push_back(name);
+    }
+  }
+  closedir(d);
+  return ret;
+}
+
+bool findLocalRoute(const std::string &route, const std::string &data_dir, BatchRoute &out) {
+  static const std::regex rx(R"(^(?:([a-z0-9]{16})[|_/])?(\d{4}-\d{2}-\d{2}--\d{2}-\d{2}-\d{2})(?:(?:--|/)\d*)?$)");
+  std::smatch m;
+  if (!std::regex_match(route, m, rx)) {
+    rWarning("invalid route format %s", route.c_str());
+    return false;
+  }
+
+  const std::string timestamp = m[2];
+  std::map<int, BatchSegment> segments;
+  for (const auto &folder : listDir(data_dir, true)) {
+    const size_t pos = folder.rfind("--");
+    if (pos == std::string::npos || folder.compare(0, pos, timestamp) != 0) continue;
+
+    const int n = std::atoi(folder.c_str() + pos + 2);
+    const std::string dir = data_dir + "/" + folder;
+    auto &seg = segments[n];
+    seg.seg_num = n;
+    std::string qlog, qcamera;
+    for (const auto &file : listDir(dir, false)) {
+      const size_t p = file.rfind("--");
+      const std::string name = p != std::string::npos ? file.substr(p + 2) : file;
+      const std::string path = dir + "/" + file;
+      if (name == "rlog.bz2" || name == "rlog.zst" || name == "rlog") {
+        seg.log = path;
+      } else if (name == "qlog.bz2" || name == "qlog.zst" || name == "qlog") {
+        qlog = path;
+      } else if (name == "fcamera.hevc") {
+        seg.cameras[RoadCam] = path;
+      } else if (name == "dcamera.hevc") {
+        seg.cameras[DriverCam] = path;
+      } else if (name == "ecamera.hevc") {
+        seg.cameras[WideRoadCam] = path;
+      } else if (name == "qcamera.ts") {
+        qcamera = path;
+      }
+    }
+    // fallback to qlog/qcamera, like Segment does
+    if (seg.log.empty()) seg.log = qlog;
+    if (seg.cameras[RoadCam].empty()) seg.cameras[RoadCam] = qcamera;
+  }
+
+  out.name = m[1].str() + "|" + timestamp;
+  out.segments.clear();
+  for (auto &[n, seg] : segments) {
+    if (!seg.log.empty()) out.segments.push_back(std::move(seg));
+  }
+  return !out.segments.empty();
+}
+
+FrameReader *BatchContext::frames(CameraType cam, int seg_num) const {
+  auto it = segments_->find(seg_num);
+  return it != segments_->end() ? it->second->frames[cam].get() : nullptr;
+}
+
+BatchStats BatchReplay::run(const std::vector<BatchRoute> &routes, const EventHandler &on_event,
+                            const RouteFinishedHandler &on_finished) {
+  BatchStats stats;
+  std::atomic<size_t> next_route = 0;
+  auto worker = [&]() {
+    for (size_t i = next_route++; i < routes.size() && !abort_; i = next_route++) {
+      processRoute(i, routes[i], on_event, on_finished, stats);
+    }
+  };
+
+  int threads = opts_.threads > 0 ? opts_.threads : std::thread::hardware_concurrency();
+  threads = std::clamp<int>(threads, 1, std::max<size_t>(routes.size(), 1));
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : workers) t.join();
+  return stats;
+}
+
+std::unique_ptr<BatchSegmentData> BatchReplay::loadSegment(const BatchSegment &segment, LoadTimings &timings) {
+  auto seg = std::make_unique<BatchSegmentData>();
+  seg->seg_num = segment.seg_num;
+  seg->log = std::make_unique<LogReader>();
+  bool success = seg->log->load(segment.log, &abort_, opts_.allow, opts_.local_cache, 0, opts_.retries);
+  timings += seg->log->timings;
+  for (auto cam : opts_.cameras) {
+    if (!success || segment.cameras[cam].empty()) continue;
+
+    seg->frames[cam] = std::make_unique<FrameReader>(cam);
+    success = seg->frames[cam]->load(segment.cameras[cam], true, &abort_, opts_.local_cache, 20 * 1024 * 1024, opts_.retries);
+    timings += seg->frames[cam]->timings;
+  }
+
+  if (!success) {
+    if (!abort_) rWarning("failed to load segment %d of %s", segment.seg_num, segment.log.c_str());
+    return nullptr;
+  }
+  return seg;
+}
+
+bool BatchReplay::processRoute(size_t idx, const BatchRoute &route, const EventHandler &on_event,
+                               const RouteFinishedHandler &on_finished, BatchStats &stats) {
+  BatchStats route_stats = {.routes = 1};
+  std::map<int, std::unique_ptr<BatchSegmentData>> window;
+  std::deque<std::future<std::unique_ptr<BatchSegmentData>>> loading;
+  std::vector<LoadTimings> timings(route.segments.size());
+  MergedEvents merged;
+  BatchContext ctx(route, idx, &window);
+  size_t next_load = 0;
+
+  auto load_ahead = [&]() {
+    while (next_load < route.segments.size() && loading.size() < BATCH_LOAD_AHEAD) {
+      const size_t n = next_load++;
+      loading.push_back(std::async(std::launch::async, [this, &route, &timings, n]() {
+        return loadSegment(route.segments[n], timings[n]);
+      }));
+    }
+  };
+  // moves the next loaded segment into the merged view, segments that failed to load are skipped
+  auto take_next = [&]() {
+    while (!loading.empty()) {
+      auto seg = loading.front().get();
+      loading.pop_front();
+      load_ahead();
+      ++route_stats.segments;
+      if (seg) {
+        merged.add(seg->seg_num, &seg->log->events);
+        window[seg->seg_num] = std::move(seg);
+        return;
+      }
+      ++route_stats.failed_segments;
+    }
+  };
+
+  load_ahead();
+  take_next();
+  take_next();
+
+  // the events of the oldest segment are merged with the ones of the next segment, then the oldest
+  // segment is swapped for the next loaded one and merging resumes at the last delivered event.
+  Event last(cereal::Event::Which::INIT_DATA, 0);
+  bool started = false, stopped_at_oldest = false;
+  while (!window.empty() && !abort_) {
+    const auto &oldest = window.begin()->second->log->events;
+    const Event *oldest_back = oldest.empty() ? nullptr : oldest.back();
+    // ties go to the oldest segment, so after stopping at its last event the events of the
+    // other segments that compare equal to it haven't been delivered yet
+    auto it = !started ? merged.begin() : stopped_at_oldest ? merged.lower_bound(&last) : merged.upper_bound(&last);
+    stopped_at_oldest = false;
+    for (auto end = merged.end(); it != end && !abort_; ++it) {
+      const Event *e = *it;
+      // MergedEvents only skips the initData of segments that aren't first in the window
+      if (started && e->which == cereal::Event::Which::INIT_DATA) continue;
+
+      on_event(ctx, e);
+      ++route_stats.events;
+      last.mono_time = e->mono_time;
+      last.which = e->which;
+      started = true;
+      if (e == oldest_back) {
+        stopped_at_oldest = true;
+        break;
+      }
+    }
+
+    merged.remove(window.begin()->first);
+    window.erase(window.begin());
+    take_next();
+  }
+  // wait for the loads that are still running, they return early once aborted
+  for (auto &f : loading) f.wait();
+
+  const bool success = !abort_ && route_stats.failed_segments == 0 && next_load == route.segments.size();
+  route_stats.failed_routes = success ? 0 : 1;
+  for (auto &t : timings) route_stats.timings += t;
+  if (on_finished) {
+    on_finished(ctx, success);
+  }
+
+  std::lock_guard lk(stats_lock_);
+  stats.routes += route_stats.routes;
+  stats.failed_routes += route_stats.failed_routes;
+  stats.segments += route_stats.segments;
+  stats.failed_segments += route_stats.failed_segments;
+  stats.events += route_stats.events;
+  stats.timings += route_stats.timings;
+  return success;
+}
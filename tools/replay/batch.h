@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "tools/replay/framereader.h"
+#include "tools/replay/logreader.h"
+
+// Qt-free replay of many routes for offline analysis. Nothing is published: the merged event stream
+// of each route is passed to callbacks. Routes are processed concurrently on a pool of worker threads,
+// the events of one route are delivered in order on the thread that works on it.
+
+struct BatchSegment {
+  int seg_num = 0;
+  std::string log;                   // rlog or qlog, local file or url
+  std::string cameras[MAX_CAMERAS];  // indexed by CameraType, empty if not available
+};
+
+struct BatchRoute {
+  std::string name;
+  std::vector<BatchSegment> segments;  // sorted by segment number
+};
+
+// collects the segments of a route from a local data directory, the same files Route::load() would pick
+bool findLocalRoute(const std::string &route, const std::string &data_dir, BatchRoute &out);
+
+struct BatchSegmentData {
+  int seg_num = 0;
+  std::unique_ptr<LogReader> log;
+  std::unique_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+};
+
+class BatchContext {
+public:
+  // the frames of an encodeIdx event are in the FrameReader of the segment it refers to.
+  // returns nullptr if the camera wasn't requested or the segment is not loaded.
+  FrameReader *frames(CameraType cam, int seg_num) const;
+
+  const BatchRoute &route;
+  const size_t route_index;
+
+private:
+  friend class BatchReplay;
+  BatchContext(const BatchRoute &r, size_t idx, const std::map<int, std::unique_ptr<BatchSegmentData>> *segments)
+      : route(r), route_index(idx), segments_(segments) {}
+  const std::map<int, std::unique_ptr<BatchSegmentData>> *segments_;
+};
+
+struct BatchStats {
+  size_t routes = 0;
+  size_t failed_routes = 0;
+  size_t segments = 0;
+  size_t failed_segments = 0;
+  uint64_t events = 0;
+  LoadTimings timings;
+};
+
+struct BatchOptions {
+  int threads = 0;                       // routes processed at the same time, 0 uses all cores
+  std::set<cereal::Event::Which> allow;  // events to load, empty loads all
+  std::vector<CameraType> cameras;       // cameras whose FrameReaders are loaded with the log
+  bool local_cache = true;
+  int retries = 3;
+};
+
+class BatchReplay {
+public:
+  // called for every event of a route in mono_time order. events are only valid during the call.
+  typedef std::function<void(const BatchContext &ctx, const Event *e)> EventHandler;
+  // called after the last event of a route. success is false if a segment failed to load or run() was aborted.
+  typedef std::function<void(const BatchContext &ctx, bool success)> RouteFinishedHandler;
+
+  BatchReplay(const BatchOptions &opts = {}) : opts_(opts) {}
+  // blocks until all routes are processed. handlers are called from several threads at the same time.
+  BatchStats run(const std::vector<BatchRoute> &routes, const EventHandler &on_event,
+                 const RouteFinishedHandler &on_finished = nullptr);
+  // stops all workers, run() returns once the pending loads are cancelled
+  void abort() { abort_ = true; }
+
+private:
+  bool processRoute(size_t idx, const BatchRoute &route, const EventHandler &on_event,
+                    const RouteFinishedHandler &on_finished, BatchStats &stats);
+  std::unique_ptr<BatchSegmentData> loadSegment(const BatchSegment &segment, LoadTimings &timings);
+
+  const BatchOptions opts_;
+  std::atomic<bool> abort_ = false;
+  std::mutex stats_lock_;
+};
@@ -1,7 +1,27 @@
 #include "tools/replay/camera.h"
 #include "tools/replay/util.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+
+#include "common/timing.h"
+
+void LatencyHistogram::add(double ms) {
+  const int bucket = std::clamp<int>(ms / BUCKET_MS, 0, BUCKETS - 1);
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::percentile(double p) const {
+  const uint64_t target = std::ceil(count_ * p);
+  uint64_t n = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    n += counts_[i].load(std::memory_order_relaxed);
+    if (n >= target) return (i + 1) * BUCKET_MS;
+  }
+  return BUCKETS * BUCKET_MS;
+}
 
 CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) {
   for (int i = 0; i < MAX_CAMERAS; ++i) {
@@ -18,6 +38,18 @@ CameraServer::~CameraServer() {
     }
   }
   vipc_server_.reset(nullptr);
+
+  for (auto &cam : cameras_) {
+    auto decode = FrameReader::decodeStats(cam.type);
+    if (decode.frames > 0) {
+      rInfo("camera[%d] decoded %llu frames (%llu ahead of playback), %.1f ms/frame", cam.type,
+            (unsigned long long)decode.frames, (unsigned long long)decode.gop_frames, decode.seconds * 1000 / decode.frames);
+    }
+  }
+  auto stats = FrameReader::cacheStats();
+  rInfo("frame cache: %llu hits, %llu misses, %llu prefetched, %llu evicted, %zu/%zu MB",
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.prefetched,
+        (unsigned long long)stats.evicted, stats.bytes >> 20, stats.max_bytes >> 20);
 }
 
 void CameraServer::startVipcServer() {
@@ -43,7 +75,7 @@ void CameraServer::cameraThread(Camera &cam) {
   };
 
   while (true) {
-    const auto [fr, eidx] = cam.queue.pop();
+    const auto [fr, eidx, push_ms] = cam.queue.pop();
     if (!fr) break;
 
     const int id = eidx.getSegmentId();
@@ -57,6 +89,7 @@ void CameraServer::cameraThread(Camera &cam) {
       };
       yuv->set_frame_id(eidx.getFrameId());
       vipc_server_->send(yuv, &extra);
+      cam.latency.add(millis_since_boot() - push_ms);
     } else {
       rError("camera[%d] failed to get frame: %lu", cam.type, eidx.getSegmentId());
     }
@@ -64,8 +97,13 @@ void CameraServer::cameraThread(Camera &cam) {
     cam.cached_id = id + 1;
     cam.cached_seg = eidx.getSegmentNum();
     cam.cached_buf = read_frame(fr, cam.cached_id);
+    frameSent();
+  }
+}
 
-    --publishing_;
+void CameraServer::frameSent() {
+  if (--publishing_ == 0) {
+    sent_.notify();
   }
 }
 
@@ -79,11 +117,9 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::Enc
   }
 
   ++publishing_;
-  cam.queue.push({fr, eidx});
+  cam.queue.push({fr, eidx, millis_since_boot()});
 }
 
 void CameraServer::waitForSent() {
-  while (publishing_ > 0) {
-    std::this_thread::yield();
-  }
+  sent_.wait_for([this] { return publishing_ == 0; });
 }
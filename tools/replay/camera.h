@@ -1,17 +1,38 @@
 #pragma once
 
 #include <unistd.h>
+
+#include <array>
+#include <tuple>
+
 #include "cereal/visionipc/visionipc_server.h"
 #include "common/queue.h"
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
 
+// frame latency histogram in 0.5 ms buckets. written by one camera thread, read by any thread.
+class LatencyHistogram {
+public:
+  void add(double ms);
+  // ms below which fraction p of the frames were sent
+  double percentile(double p) const;
+  inline uint64_t count() const { return count_; }
+
+private:
+  static constexpr double BUCKET_MS = 0.5;
+  static constexpr int BUCKETS = 400;  // the last one collects everything above 200 ms
+  std::array<std::atomic<uint32_t>, BUCKETS> counts_ = {};
+  std::atomic<uint64_t> count_ = 0;
+};
+
 class CameraServer {
 public:
   CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr);
   ~CameraServer();
   void pushFrame(CameraType type, FrameReader* fr, const cereal::EncodeIndex::Reader& eidx);
   void waitForSent();
+  // time from pushFrame() to the frame being sent to visionipc
+  inline const LatencyHistogram &frameLatency(CameraType type) const { return cameras_[type].latency; }
 
 protected:
   struct Camera {
@@ -20,13 +41,17 @@ protected:
     int width;
     int height;
     std::thread thread;
-    SafeQueue<std::pair<FrameReader*, const cereal::EncodeIndex::Reader>> queue;
+    // frame reader, encode index, and the time it was pushed
+    SPSCQueue<std::tuple<FrameReader*, cereal::EncodeIndex::Reader, double>, 64> queue;
+    LatencyHistogram latency;
     int cached_id = -1;
     int cached_seg = -1;
     VisionBuf * cached_buf;
   };
   void startVipcServer();
   void cameraThread(Camera &cam);
+  // a pushed frame was sent, wakes up waitForSent() after the last one
+  void frameSent();
 
   Camera cameras_[MAX_CAMERAS] = {
       {.type = RoadCam, .stream_type = VISION_STREAM_ROAD},
@@ -34,5 +59,6 @@ protected:
       {.type = WideRoadCam, .stream_type = VISION_STREAM_WIDE_ROAD},
   };
   std::atomic<int> publishing_ = 0;
+  QueueSignal sent_;
   std::unique_ptr<VisionIpcServer> vipc_server_;
 };
@@ -106,7 +106,7 @@ void ConsoleUI::initWindows() {
   w[Win::Stats] = newwin(2, max_width - 2 * BORDER_SIZE, 2, BORDER_SIZE);
   w[Win::Timeline] = newwin(4, max_width - 2 * BORDER_SIZE, 5, BORDER_SIZE);
   w[Win::TimelineDesc] = newwin(1, 100, 10, BORDER_SIZE);
-  w[Win::CarState] = newwin(3, 100, 12, BORDER_SIZE);
+  w[Win::CarState] = newwin(4, 100, 12, BORDER_SIZE);
   w[Win::DownloadBar] = newwin(1, 100, 16, BORDER_SIZE);
   if (int log_height = max_height - 27; log_height > 4) {
     w[Win::LogBorder] = newwin(log_height, max_width - 2 * (BORDER_SIZE - 1), 17, BORDER_SIZE - 1);
@@ -182,6 +182,22 @@ void ConsoleUI::updateStatus() {
   auto angle_offsets = util::string_format("%.2f|%.2f", p.getAngleOffsetAverageDeg(), p.getAngleOffsetDeg());
   write_item(2, 25, "ANGLE OFFSET(AVG|INSTANT): ", angle_offsets, " deg");
 
+  if (auto camera_server = replay->cameraServer()) {
+    static const char *camera_names[] = {"road", "driver", "wide"};
+    std::string latency;
+    for (auto type : ALL_CAMERAS) {
+      auto &h = camera_server->frameLatency(type);
+      if (h.count() > 0) {
+        latency += util::string_format("%s %.1f|%.1f|%.1f  ", camera_names[type], h.percentile(0.5), h.percentile(0.9), h.percentile(0.99));
+      }
+    }
+    if (!latency.empty()) {
+      wmove(w[Win::CarState], 3, 0);
+      wclrtoeol(w[Win::CarState]);
+      write_item(3, 0, "FRAME LATENCY(P50|P90|P99): ", latency, "ms");
+    }
+  }
+
   wrefresh(w[Win::CarState]);
 }
 
@@ -0,0 +1,131 @@
+#include "tools/replay/eventindex.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "common/util.h"
+#include "tools/replay/filereader.h"
+
+namespace {
+
+const char INDEX_MAGIC[4] = {'E', 'I', 'D', 'X'};
+const uint32_t INDEX_VERSION = 2;
+
+struct IndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_size;
+  int64_t source_mtime_ns;
+  uint32_t num_columns;
+} __attribute__((packed));
+
+struct ColumnHeader {
+  uint16_t which;
+  uint32_t count;
+} __attribute__((packed));
+
+// a log rewritten within the same second with the same size still has a different mtime
+bool source_stat(const std::string &file, uint64_t &size, int64_t &mtime_ns) {
+  struct stat st = {};
+  if (stat(file.c_str(), &st) != 0) return false;
+
+#ifdef __APPLE__
+  const struct timespec &mtime = st.st_mtimespec;
+#else
+  const struct timespec &mtime = st.st_mtim;
+#endif
+  size = st.st_size;
+  mtime_ns = mtime.tv_sec * 1000000000LL + mtime.tv_nsec;
+  return true;
+}
+
+// reads the header, and leaves the stream at the first column if the index belongs to source_file
+bool read_header(std::ifstream &fs, const std::string &source_file, IndexHeader &header) {
+  uint64_t source_size = 0;
+  int64_t source_mtime_ns = 0;
+  if (!fs || !source_stat(source_file, source_size, source_mtime_ns)) return false;
+
+  if (!fs.read((char *)&header, sizeof(header))) return false;
+  return memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && header.version == INDEX_VERSION &&
+         header.source_size == source_size && header.source_mtime_ns == source_mtime_ns;
+}
+
+}  // namespace
+
+std::string indexFilePath(const std::string &url) {
+  return cacheFilePath(url) + ".idx";
+}
+
+bool EventIndex::isValid(const std::string &file, const std::string &source_file) {
+  std::ifstream fs(file, std::ios::binary);
+  IndexHeader header = {};
+  return read_header(fs, source_file, header);
+}
+
+bool EventIndex::load(const std::string &file, const std::string &source_file) {
+  std::ifstream fs(file, std::ios::binary);
+  IndexHeader header = {};
+  if (!read_header(fs, source_file, header)) return false;
+
+  const auto columns_pos = fs.tellg();
+  fs.seekg(0, std::ios::end);
+  size_t remaining = fs.tellg() - columns_pos;
+  fs.seekg(columns_pos);
+
+  columns.clear();
+  for (uint32_t i = 0; i < header.num_columns; ++i) {
+    ColumnHeader ch = {};
+    if (!fs.read((char *)&ch, sizeof(ch))) return false;
+
+    remaining -= sizeof(ch);
+    if (ch.count > remaining / sizeof(uint64_t)) return false;
+    remaining -= ch.count * sizeof(uint64_t);
+    auto &offsets = columns[(cereal::Event::Which)ch.which];
+    offsets.resize(ch.count);
+    if (!fs.read((char *)offsets.data(), ch.count * sizeof(uint64_t))) return false;
+  }
+  return true;
+}
+
+bool EventIndex::save(const std::string &file, const std::string &source_file) const {
+  uint64_t source_size = 0;
+  int64_t source_mtime_ns = 0;
+  if (!source_stat(source_file, source_size, source_mtime_ns)) return false;
+
+  IndexHeader header = {.version = INDEX_VERSION, .source_size = source_size, .source_mtime_ns = source_mtime_ns,
+                        .num_columns = (uint32_t)columns.size()};
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+
+  // write to a temporary file and rename it, readers never see a partial index
+  const std::string tmp_file = file + "." + util::random_string(8) + ".tmp";
+  std::ofstream fs(tmp_file, std::ios::binary | std::ios::out);
+  fs.write((const char *)&header, sizeof(header));
+  for (const auto &[which, offsets] : columns) {
+    ColumnHeader ch = {.which = (uint16_t)which, .count = (uint32_t)offsets.size()};
+    fs.write((const char *)&ch, sizeof(ch));
+    fs.write((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+  }
+  fs.close();
+
+  if (!fs || rename(tmp_file.c_str(), file.c_str()) != 0) {
+    unlink(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::vector<uint64_t> EventIndex::offsets(const std::set<cereal::Event::Which> &allow) const {
+  std::vector<uint64_t> result;
+  for (auto which : allow) {
+    if (auto it = columns.find(which); it != columns.end()) {
+      result.insert(result.end(), it->second.begin(), it->second.end());
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
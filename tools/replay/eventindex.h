@@ -0,0 +1,28 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// Sidecar index of a log file. For each event type it stores the offset (in the
+// decompressed log) of every message, so loaders that only need a few services
+// can skip the other messages without decoding them.
+class EventIndex {
+public:
+  inline void add(cereal::Event::Which which, uint64_t offset) { columns[which].push_back(offset); }
+  // the index is only valid for the source file it was built from
+  bool load(const std::string &file, const std::string &source_file);
+  // checks the header only, for loaders that don't filter
+  static bool isValid(const std::string &file, const std::string &source_file);
+  bool save(const std::string &file, const std::string &source_file) const;
+  // sorted offsets of all messages in the allow set
+  std::vector<uint64_t> offsets(const std::set<cereal::Event::Which> &allow) const;
+
+  // the offsets of each event type, in log order
+  std::map<cereal::Event::Which, std::vector<uint64_t>> columns;
+};
+
+std::string indexFilePath(const std::string &url);
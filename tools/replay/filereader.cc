@@ -1,6 +1,16 @@
 #include "tools/replay/filereader.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <memory>
 
 #include "common/util.h"
 #include "tools/replay/util.h"
@@ -22,16 +32,70 @@ std::string FileReader::read(const std::string &file, std::atomic<bool> *abort)
 
   if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
     result = util::read_file(local_file);
+  } else if (is_remote && cache_to_local_) {
+    bool success = readRanges(file, [&](const char *data, size_t size) {
+      if (result.empty()) result.reserve(size_);
+      result.append(data, size);
+      return true;
+    }, abort);
+    if (!success) result.clear();
   } else if (is_remote) {
     result = download(file, abort);
-    if (cache_to_local_ && !result.empty()) {
-      std::ofstream fs(local_file, std::ios::binary | std::ios::out);
-      fs.write(result.data(), result.size());
-    }
   }
+  size_ = result.size();
   return result;
 }
 
+bool FileReader::read(const std::string &file, const StreamDataHandler &handler, std::atomic<bool> *abort) {
+  const bool is_remote = file.find("https://") == 0;
+  const std::string local_file = is_remote ? cacheFilePath(file) : file;
+
+  if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
+    std::ifstream fs(local_file, std::ios::binary | std::ios::in | std::ios::ate);
+    size_ = fs.tellg();
+    fs.seekg(0);
+    std::string buf(STREAM_BLOCK_SIZE, '\0');
+    while (fs && !(abort && *abort)) {
+      fs.read(buf.data(), buf.size());
+      if (fs.gcount() > 0 && !handler(buf.data(), fs.gcount())) return false;
+    }
+    return fs.eof() && !(abort && *abort);
+  }
+  if (!is_remote) return false;
+  if (cache_to_local_) return readRanges(file, handler, abort);
+
+  size_ = 0;
+  bool success = false;
+  for (int i = 0; i <= max_retries_ && !success && !(abort && *abort); ++i) {
+    if (i > 0) rWarning("download failed, retrying %d", i);
+
+    size_t received = 0;
+    success = httpGetStream(file, [&](const char *data, size_t size) {
+      received += size;
+      return handler(data, size);
+    }, abort);
+    // the handler has already consumed part of the content, it can't be replayed from the start.
+    if (received > 0) break;
+  }
+  return success;
+}
+
+bool FileReader::readRanges(const std::string &url, const StreamDataHandler &handler, std::atomic<bool> *abort) {
+  static const int connections = std::max(util::getenv("REPLAY_DOWNLOAD_CONNECTIONS", 4), 1);
+
+  RangeCache cache(url, max_retries_, abort);
+  if (!cache.open()) return false;
+
+  size_ = cache.size();
+  cache.start(connections);
+  // ranges are passed on in order as soon as they arrive, while the ones behind are still downloading
+  std::unique_ptr<char[]> buf(new char[DOWNLOAD_RANGE_SIZE]);
+  for (size_t i = 0; i < cache.count(); ++i) {
+    if (!cache.read(i, buf.get()) || !handler(buf.get(), cache.rangeSize(i))) return false;
+  }
+  return cache.finish();
+}
+
 std::string FileReader::download(const std::string &url, std::atomic<bool> *abort) {
   for (int i = 0; i <= max_retries_ && !(abort && *abort); ++i) {
     if (i > 0) rWarning("download failed, retrying %d", i);
@@ -43,3 +107,175 @@ std::string FileReader::download(const std::string &url, std::atomic<bool> *abor
   }
   return {};
 }
+
+// class RangeCache
+
+namespace {
+
+// exclusive flock, polled so that waiting for another process can be aborted. returns -1 on failure.
+int lockFile(const std::string &file, std::atomic<bool> *abort) {
+  int fd = HANDLE_EINTR(open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+  if (fd < 0) return -1;
+
+  while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    if (errno != EWOULDBLOCK || (abort && *abort)) {
+      close(fd);
+      return -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return fd;
+}
+
+size_t fileSize(const std::string &file) {
+  struct stat st = {};
+  return stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+bool readFile(const std::string &file, size_t offset, char *buf, size_t size) {
+  std::ifstream fs(file, std::ios::binary | std::ios::in);
+  return fs.seekg(offset) && fs.read(buf, size) && (size_t)fs.gcount() == size;
+}
+
+void removeFiles(const std::string &dir, const std::string &keep = {}) {
+  if (DIR *d = opendir(dir.c_str())) {
+    while (struct dirent *de = readdir(d)) {
+      if (de->d_type != DT_DIR && de->d_name != keep) unlink((dir + de->d_name).c_str());
+    }
+    closedir(d);
+  }
+}
+
+}  // namespace
+
+RangeCache::RangeCache(const std::string &url, int retries, std::atomic<bool> *abort)
+    : url_(url), file_(cacheFilePath(url)), dir_(file_ + ".parts/"), retries_(retries), abort_(abort) {}
+
+RangeCache::~RangeCache() {
+  // the threads stop after their current range, finished ranges are kept for the next attempt
+  next_ = count();
+  for (auto &t : threads_) t.join();
+}
+
+bool RangeCache::open() {
+  util::create_directories(dir_, 0755);
+  unique_fd lock = lockFile(dir_ + "lock", abort_);
+  // another process has finished the download in the meantime
+  if (util::file_exists(file_)) {
+    size_ = fileSize(file_);
+    state_.assign((size_ + DOWNLOAD_RANGE_SIZE - 1) / DOWNLOAD_RANGE_SIZE, DONE);
+    return size_ > 0;
+  }
+  if (lock < 0) return false;
+
+  // the manifest is "<url> <size> <range size>"
+  const std::string manifest = dir_ + "manifest";
+  const std::string url = getUrlWithoutQuery(url_);
+  std::string manifest_url;
+  size_t range_size = 0;
+  std::ifstream fs(manifest);
+  if (!(fs >> manifest_url >> size_ >> range_size) || manifest_url != url || range_size != DOWNLOAD_RANGE_SIZE) {
+    // the ranges left behind don't belong to this manifest
+    removeFiles(dir_, "lock");
+    size_ = getRemoteFileSize(url_, abort_);
+    if (size_ == 0) return false;
+
+    const std::string content = util::string_format("%s %zu %zu\n", url.c_str(), size_, DOWNLOAD_RANGE_SIZE);
+    const std::string tmp = manifest + "." + util::random_string(8) + ".tmp";
+    if (util::write_file(tmp.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT) != 0 || rename(tmp.c_str(), manifest.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+  }
+  state_.assign((size_ + DOWNLOAD_RANGE_SIZE - 1) / DOWNLOAD_RANGE_SIZE, PENDING);
+  return true;
+}
+
+void RangeCache::start(int connections) {
+  std::lock_guard lk(lock_);
+  running_ = std::min<int>(connections, count());
+  for (int i = 0; i < running_; ++i) {
+    threads_.emplace_back(&RangeCache::downloadThread, this);
+  }
+}
+
+void RangeCache::downloadThread() {
+  bool failed = false;
+  for (size_t i = next_++; i < count() && !failed && !aborted(); i = next_++) {
+    failed = !fetch(i);
+    std::lock_guard lk(lock_);
+    state_[i] = failed ? FAILED : DONE;
+    cv_.notify_all();
+  }
+
+  std::lock_guard lk(lock_);
+  // the other threads stop at their current range
+  if (failed) next_ = count();
+  --running_;
+  cv_.notify_all();
+}
+
+bool RangeCache::fetch(size_t i) {
+  const std::string path = rangePath(i);
+  if (util::file_exists(path) || util::file_exists(file_)) return true;
+
+  // wait for a process that is downloading the same range
+  unique_fd lock = lockFile(path + ".lock", abort_);
+  if (lock < 0) return false;
+  if (util::file_exists(path) || util::file_exists(file_)) return true;
+
+  const std::string tmp = path + "." + util::random_string(8) + ".tmp";
+  bool success = false;
+  for (int retry = 0; retry <= retries_ && !success && !aborted(); ++retry) {
+    if (retry > 0) rWarning("download failed, retrying %d", retry);
+
+    std::ofstream fs(tmp, std::ios::binary | std::ios::out | std::ios::trunc);
+    success = httpGetRange(url_, i * DOWNLOAD_RANGE_SIZE, rangeSize(i), [&](const char *data, size_t size) {
+      return fs.write(data, size) && !aborted();
+    }, abort_);
+    fs.close();
+    success = success && fs && fileSize(tmp) == rangeSize(i) && rename(tmp.c_str(), path.c_str()) == 0;
+  }
+  if (!success) unlink(tmp.c_str());
+  return success;
+}
+
+bool RangeCache::read(size_t i, char *buf) {
+  {
+    std::unique_lock lk(lock_);
+    cv_.wait(lk, [&]() { return state_[i] != PENDING || running_ == 0; });
+    if (state_[i] != DONE) return false;
+  }
+  // the ranges are removed after they have been joined into the cache file
+  return readFile(rangePath(i), 0, buf, rangeSize(i)) || readFile(file_, i * DOWNLOAD_RANGE_SIZE, buf, rangeSize(i));
+}
+
+bool RangeCache::finish() {
+  for (auto &t : threads_) t.join();
+  threads_.clear();
+  if (std::any_of(state_.begin(), state_.end(), [](auto s) { return s != DONE; })) return false;
+
+  unique_fd lock = lockFile(dir_ + "lock", abort_);
+  if (lock < 0) return util::file_exists(file_);
+
+  bool success = util::file_exists(file_);
+  if (!success) {
+    const std::string tmp = file_ + "." + util::random_string(8) + ".tmp";
+    std::ofstream fs(tmp, std::ios::binary | std::ios::out);
+    std::unique_ptr<char[]> buf(new char[DOWNLOAD_RANGE_SIZE]);
+    success = true;
+    for (size_t i = 0; i < count() && success; ++i) {
+      success = readFile(rangePath(i), 0, buf.get(), rangeSize(i)) && fs.write(buf.get(), rangeSize(i));
+    }
+    fs.close();
+    success = success && fs && rename(tmp.c_str(), file_.c_str()) == 0;
+    if (!success) unlink(tmp.c_str());
+  }
+
+  if (success) {
+    // processes that are still waiting on a range find the cache file once they get the lock
+    removeFiles(dir_);
+    rmdir(dir_.c_str());
+  }
+  return success;
+}
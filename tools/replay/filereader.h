@@ -1,7 +1,17 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "tools/replay/util.h"
+
+constexpr size_t STREAM_BLOCK_SIZE = 1024 * 1024;
+constexpr size_t DOWNLOAD_RANGE_SIZE = 4 * 1024 * 1024;
 
 class FileReader {
 public:
@@ -9,12 +19,58 @@ public:
       : cache_to_local_(cache_to_local), chunk_size_(chunk_size), max_retries_(retries) {}
   virtual ~FileReader() {}
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
+  // pass the content to handler block by block as it is read from disk or network.
+  bool read(const std::string &file, const StreamDataHandler &handler, std::atomic<bool> *abort = nullptr);
+  // size of the file being read, known before the first block is passed to the handler. 0 if unknown.
+  inline size_t size() const { return size_; }
 
 private:
   std::string download(const std::string &url, std::atomic<bool> *abort);
+  bool readRanges(const std::string &url, const StreamDataHandler &handler, std::atomic<bool> *abort);
   size_t chunk_size_;
   int max_retries_;
   bool cache_to_local_;
+  std::atomic<size_t> size_ = 0;
+};
+
+// Cache entry of a remote file that is downloaded in ranges of DOWNLOAD_RANGE_SIZE. Finished ranges are
+// kept as files in <cache file>.parts/ next to a manifest with the size of the file, so an aborted
+// download resumes with the missing ranges. Each range is downloaded under an flock, processes that
+// fetch the same url wait for each other's ranges instead of downloading them twice. Once all ranges
+// are there, finish() joins them into the cache file.
+class RangeCache {
+public:
+  RangeCache(const std::string &url, int retries, std::atomic<bool> *abort);
+  ~RangeCache();
+  // reads the manifest, or creates it with the size from a HEAD request
+  bool open();
+  // downloads the missing ranges front to back on up to `connections` threads
+  void start(int connections);
+  // waits until range i is cached and copies it to buf, which has to hold rangeSize(i) bytes
+  bool read(size_t i, char *buf);
+  bool finish();
+
+  inline size_t size() const { return size_; }
+  inline size_t count() const { return state_.size(); }
+  inline size_t rangeSize(size_t i) const { return std::min(DOWNLOAD_RANGE_SIZE, size_ - i * DOWNLOAD_RANGE_SIZE); }
+
+private:
+  enum State : uint8_t { PENDING, DONE, FAILED };
+  void downloadThread();
+  bool fetch(size_t i);
+  std::string rangePath(size_t i) const { return dir_ + std::to_string(i); }
+  inline bool aborted() const { return abort_ && *abort_; }
+
+  const std::string url_, file_, dir_;
+  const int retries_;
+  std::atomic<bool> *abort_;
+  size_t size_ = 0;
+  std::atomic<size_t> next_ = 0;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::vector<State> state_;
+  int running_ = 0;
+  std::vector<std::thread> threads_;
 };
 
 std::string cacheFilePath(const std::string &url);
@@ -1,10 +1,25 @@
 #include "tools/replay/framereader.h"
 #include "tools/replay/util.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <list>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include "libyuv.h"
 
 #include "cereal/visionipc/visionbuf.h"
+#include "common/timing.h"
+#include "common/util.h"
 
 #ifdef __APPLE__
 #define HW_DEVICE_TYPE AV_HWDEVICE_TYPE_VIDEOTOOLBOX
@@ -20,12 +35,18 @@ struct buffer_data {
   const uint8_t *data;
   int64_t offset;
   size_t size;
+  // blocks until data up to the given end has arrived, returns the end of the available data
+  std::function<size_t(size_t)> wait_for_data;
 };
 
 int readPacket(void *opaque, uint8_t *buf, int buf_size) {
   struct buffer_data *bd = (struct buffer_data *)opaque;
   assert(bd->offset <= bd->size);
-  buf_size = std::min((size_t)buf_size, (size_t)(bd->size - bd->offset));
+  size_t end = std::min(bd->offset + (size_t)buf_size, bd->size);
+  if (bd->wait_for_data) {
+    end = std::min(end, bd->wait_for_data(end));
+  }
+  buf_size = end > bd->offset ? end - bd->offset : 0;
   if (!buf_size) return AVERROR_EOF;
 
   memcpy(buf, bd->data + bd->offset, buf_size);
@@ -44,16 +65,224 @@ enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *
   return AV_PIX_FMT_YUV420P;
 }
 
+// LRU cache of decoded NV12 frames, shared by all readers and keyed by (reader, frame index)
+class FrameCache {
+public:
+  using Buffer = std::unique_ptr<uint8_t[]>;
+
+  FrameCache() : max_bytes_(util::getenv("REPLAY_FRAME_CACHE_MB", 512) * 1024ul * 1024ul) {}
+
+  bool enabled() const { return max_bytes_ > 0; }
+  size_t maxBytes() const { return max_bytes_; }
+
+  bool get(uint64_t reader, int idx, uint8_t *yuv, size_t size) {
+    std::lock_guard lk(lock_);
+    auto it = map_.find(key(reader, idx));
+    if (it == map_.end()) return false;
+
+    lru_.splice(lru_.begin(), lru_, it->second);
+    memcpy(yuv, it->second->data.get(), size);
+    ++stats_.hits;
+    return true;
+  }
+
+  bool contains(uint64_t reader, int idx) {
+    std::lock_guard lk(lock_);
+    return map_.count(key(reader, idx)) > 0;
+  }
+
+  // reuses the buffer of an evicted frame if one of the same size is around
+  Buffer acquire(size_t size) {
+    std::lock_guard lk(lock_);
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+      if (it->second == size) {
+        Buffer buf = std::move(it->first);
+        free_.erase(it);
+        return buf;
+      }
+    }
+    return std::make_unique<uint8_t[]>(size);
+  }
+
+  void put(uint64_t reader, int idx, Buffer data, size_t size, bool prefetched) {
+    std::lock_guard lk(lock_);
+    if (map_.count(key(reader, idx))) return;
+
+    lru_.push_front({reader, idx, std::move(data), size});
+    map_[key(reader, idx)] = lru_.begin();
+    stats_.bytes += size;
+    stats_.prefetched += prefetched;
+    evict(max_bytes_);
+  }
+
+  void remove(uint64_t reader) {
+    std::lock_guard lk(lock_);
+    for (auto it = lru_.begin(); it != lru_.end();) {
+      if (it->reader == reader) {
+        map_.erase(key(it->reader, it->idx));
+        stats_.bytes -= it->size;
+        it = lru_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void miss() {
+    std::lock_guard lk(lock_);
+    ++stats_.misses;
+  }
+
+  void setMaxBytes(size_t max_bytes) {
+    std::lock_guard lk(lock_);
+    max_bytes_ = max_bytes;
+    evict(max_bytes_);
+  }
+
+  FrameCacheStats stats() {
+    std::lock_guard lk(lock_);
+    FrameCacheStats stats = stats_;
+    stats.max_bytes = max_bytes_;
+    return stats;
+  }
+
+private:
+  struct Entry {
+    uint64_t reader;
+    int idx;
+    Buffer data;
+    size_t size;
+  };
+
+  static uint64_t key(uint64_t reader, int idx) { return (reader << 32) | (uint32_t)idx; }
+
+  void evict(size_t max_bytes) {
+    while (stats_.bytes > max_bytes && !lru_.empty()) {
+      Entry &e = lru_.back();
+      map_.erase(key(e.reader, e.idx));
+      stats_.bytes -= e.size;
+      ++stats_.evicted;
+      if (free_.size() < 4) {
+        free_.emplace_back(std::move(e.data), e.size);
+      }
+      lru_.pop_back();
+    }
+  }
+
+  std::mutex lock_;
+  std::atomic<size_t> max_bytes_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> map_;
+  std::list<std::pair<Buffer, size_t>> free_;
+  FrameCacheStats stats_;
+};
+
+FrameCache frame_cache;
+std::atomic<uint64_t> next_reader_id = 0;
+
+// worker threads that decode whole GOPs ahead of playback, shared by all readers
+class DecodePool {
+public:
+  DecodePool(int n) {
+    for (int i = 0; i < n; ++i) {
+      threads_.emplace_back(&DecodePool::run, this);
+    }
+  }
+
+  ~DecodePool() {
+    {
+      std::lock_guard lk(lock_);
+      exit_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_) t.join();
+  }
+
+  bool enabled() const { return !threads_.empty(); }
+
+  void push(uint64_t owner, std::function<void()> job) {
+    {
+      std::lock_guard lk(lock_);
+      jobs_.push_back({owner, std::move(job)});
+    }
+    cv_.notify_one();
+  }
+
+  // drops the queued jobs of owner and waits for the ones that are running
+  void cancel(uint64_t owner) {
+    std::unique_lock lk(lock_);
+    jobs_.erase(std::remove_if(jobs_.begin(), jobs_.end(), [=](auto &j) { return j.first == owner; }), jobs_.end());
+    done_cv_.wait(lk, [&] { return !running_.count(owner); });
+  }
+
+private:
+  void run() {
+    util::set_thread_name("frame_decode");
+    std::unique_lock lk(lock_);
+    while (true) {
+      cv_.wait(lk, [this] { return exit_ || !jobs_.empty(); });
+      if (exit_) break;
+
+      auto [owner, job] = std::move(jobs_.front());
+      jobs_.pop_front();
+      auto running = running_.insert(owner);
+      lk.unlock();
+      job();
+      lk.lock();
+      running_.erase(running);
+      done_cv_.notify_all();
+    }
+  }
+
+  std::mutex lock_;
+  std::condition_variable cv_, done_cv_;
+  std::deque<std::pair<uint64_t, std::function<void()>>> jobs_;
+  std::multiset<uint64_t> running_;
+  std::vector<std::thread> threads_;
+  bool exit_ = false;
+};
+
+DecodePool &decode_pool() {
+  // every GOP decoder runs GOP_DECODER_THREADS frame threads, so half of the cores keeps them all busy
+  static DecodePool pool(util::getenv("REPLAY_DECODE_THREADS", (int)std::clamp(std::thread::hardware_concurrency() / 2, 1u, 8u)));
+  return pool;
+}
+
+const int GOP_DECODER_THREADS = 2;
+const int PREFETCH_GOPS = 2;
+
+std::mutex decode_stats_lock;
+std::map<int, FrameDecodeStats> decode_stats;
+
+void record_decode(int camera, int frames, double seconds, bool gop) {
+  std::lock_guard lk(decode_stats_lock);
+  auto &stats = decode_stats[camera];
+  stats.frames += frames;
+  stats.gop_frames += gop ? frames : 0;
+  stats.seconds += seconds;
+}
+
 }  // namespace
 
-FrameReader::FrameReader() {
+FrameReader::FrameReader(int camera) : id_(next_reader_id++), camera_(camera) {
   av_log_set_level(AV_LOG_QUIET);
 }
 
 FrameReader::~FrameReader() {
+  // GOPs that are being decoded stop at the next packet, the queued ones are dropped
+  exit_ = true;
+  if (decode_pool_used_) {
+    decode_pool().cancel(id_);
+  }
+  for (AVCodecContext *ctx : gop_decoders_) {
+    avcodec_free_context(&ctx);
+  }
+  frame_cache.remove(id_);
+
   for (AVPacket *pkt : packets) {
     av_packet_free(&pkt);
   }
+  releaseData();
 
   if (decoder_ctx) avcodec_free_context(&decoder_ctx);
   if (input_ctx) avformat_close_input(&input_ctx);
@@ -66,17 +295,130 @@ FrameReader::~FrameReader() {
 }
 
 bool FrameReader::load(const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  FileReader f(local_cache, chunk_size, retries);
-  std::string data = f.read(url, abort);
-  if (data.empty()) {
+  const bool is_remote = url.find("https://") == 0;
+  const std::string local_file = is_remote ? cacheFilePath(url) : url;
+  const double start_ms = millis_since_boot();
+  if (!((!is_remote || local_cache) && util::file_exists(local_file) && mapFile(local_file))) {
+    if (is_remote && local_cache) {
+      return loadStream(url, no_hw_decoder, abort, retries);
+    }
+    raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
+    if (raw_.empty()) {
+      rWarning("URL %s returned no data", url.c_str());
+      return false;
+    }
+    // read() has just written the cache file, the page cache is cheaper than keeping the download around
+    if (is_remote && local_cache && mapFile(local_file)) {
+      std::string().swap(raw_);
+    } else {
+      data_ = (const uint8_t *)raw_.data();
+      data_size_ = raw_.size();
+    }
+  }
+  timings.download += millis_since_boot() - start_ms;
+  return open(true, no_hw_decoder, abort);
+}
+
+bool FrameReader::loadStream(const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, int retries) {
+  // the packets are indexed while the ranges behind them are still downloading
+  double start_ms = millis_since_boot();
+  FileReader reader(true, 0, retries);
+  std::atomic<bool> stop = false;
+  received_ = 0;
+  streaming_ = true;
+  std::thread download_thread([&]() {
+    bool success = reader.read(url, [&](const char *data, size_t size) {
+      if (stop) return false;
+      if (raw_.empty()) {
+        raw_.resize(reader.size());
+        data_ = (const uint8_t *)raw_.data();
+        data_size_ = raw_.size();
+      }
+      if (received_ + size > raw_.size()) return false;
+
+      memcpy(raw_.data() + received_, data, size);
+      received_ += size;
+      received_signal_.notify();
+      return true;
+    }, abort);
+    if (!success) received_ = 0;
+    streaming_ = false;
+    received_signal_.notify();
+  });
+
+  received_signal_.wait_for([this]() { return received_ > 0 || !streaming_; });
+  timings.download += millis_since_boot() - start_ms;
+  bool success = received_ > 0 && open(true, no_hw_decoder, abort);
+  // the ranges that have arrived stay in the cache for the next attempt
+  stop = !success;
+
+  start_ms = millis_since_boot();
+  download_thread.join();
+  timings.download += millis_since_boot() - start_ms;
+  if (received_ != raw_.size() || raw_.empty()) {
     rWarning("URL %s returned no data", url.c_str());
     return false;
   }
+  if (!by_offset_) {
+    releaseData();
+    return success;
+  }
 
-  return load((std::byte *)data.data(), data.size(), no_hw_decoder, abort);
+  // the download is complete and in the cache, map it like a local file
+  if (success) {
+    std::string cached;
+    cached.swap(raw_);
+    if (!mapFile(cacheFilePath(url))) {
+      cached.swap(raw_);
+      data_ = (const uint8_t *)raw_.data();
+      data_size_ = raw_.size();
+    }
+  }
+  return success;
 }
 
 bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, std::atomic<bool> *abort) {
+  // the caller owns data, so the packets have to be copied
+  data_ = (const uint8_t *)data;
+  data_size_ = size;
+  bool ret = open(false, no_hw_decoder, abort);
+  data_ = nullptr;
+  data_size_ = 0;
+  return ret;
+}
+
+bool FrameReader::mapFile(const std::string &file) {
+  unique_fd fd = HANDLE_EINTR(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat st = {};
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    return false;
+  }
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    rWarning("failed to mmap %s", file.c_str());
+    return false;
+  }
+  mapped_data_ = addr;
+  mapped_size_ = st.st_size;
+  data_ = (const uint8_t *)addr;
+  data_size_ = st.st_size;
+  return true;
+}
+
+void FrameReader::releaseData() {
+  if (mapped_data_) {
+    munmap(mapped_data_, mapped_size_);
+    mapped_data_ = nullptr;
+    mapped_size_ = 0;
+  }
+  std::string().swap(raw_);
+  data_ = nullptr;
+  data_size_ = 0;
+}
+
+bool FrameReader::open(bool by_offset, bool no_hw_decoder, std::atomic<bool> *abort) {
+  const double start_ms = millis_since_boot();
   input_ctx = avformat_alloc_context();
   if (!input_ctx) {
     rError("Error calling avformat_alloc_context");
@@ -84,10 +426,18 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, s
   }
 
   struct buffer_data bd = {
-    .data = (const uint8_t*)data,
+    .data = data_,
     .offset = 0,
-    .size = size,
+    .size = data_size_,
   };
+  // the download thread writes to data_ until it is done
+  const bool streaming = streaming_;
+  if (streaming) {
+    bd.wait_for_data = [this](size_t end) {
+      received_signal_.wait_for([&]() { return received_ >= end || !streaming_; });
+      return received_.load();
+    };
+  }
   const int avio_ctx_buffer_size = 64 * 1024;
   unsigned char *avio_ctx_buffer = (unsigned char *)av_malloc(avio_ctx_buffer_size);
   avio_ctx_ = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &bd, readPacket, nullptr, nullptr);
@@ -125,6 +475,12 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, s
       rWarning("No device with hardware decoder found. fallback to CPU decoding.");
     }
   }
+  if (hw_pix_fmt == AV_PIX_FMT_NONE) {
+    // frames are decoded one at a time for random access, so only slice threading helps here.
+    // frame threading is used by the GOP decoders, which decode whole GOPs ahead of playback.
+    decoder_ctx->thread_count = 0;
+    decoder_ctx->thread_type = FF_THREAD_SLICE;
+  }
 
   ret = avcodec_open2(decoder_ctx, decoder, nullptr);
   if (ret < 0) {
@@ -132,23 +488,81 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, s
     return false;
   }
 
-  packets.reserve(60 * 20);  // 20fps, one minute
+  // packets of raw streams are plain byte ranges of the file. only their offsets are kept, and the
+  // data is read from the mapped file when a frame is decoded.
+  by_offset_ = by_offset;
+  if (by_offset_) adviseData(MADV_SEQUENTIAL);
+  int64_t next_pos = 0;
+  AVPacket *pkt = av_packet_alloc();
   while (!(abort && *abort)) {
-    AVPacket *pkt = av_packet_alloc();
     ret = av_read_frame(input_ctx, pkt);
     if (ret < 0) {
-      av_packet_free(&pkt);
       valid_ = (ret == AVERROR_EOF);
       break;
     }
-    packets.push_back(pkt);
+    int64_t pos = -1;
+    if (by_offset_) {
+      // raw packets follow each other in the file, pkt->pos is only the position of the chunk the parser started in
+      auto in_data = [&](int64_t offset) {
+        return offset >= 0 && offset + pkt->size <= data_size_ && memcmp(data_ + offset, pkt->data, pkt->size) == 0;
+      };
+      pos = in_data(next_pos) ? next_pos : pkt->pos;
+      if (!in_data(pos)) {
+        // e.g. mpeg-ts (qcamera), where packets are split across the container's own packets
+        for (int i = 0; i < index_.size(); ++i) {
+          packets.push_back(av_packet_alloc());
+          getPacket(i, packets.back());
+        }
+        index_.clear();
+        by_offset_ = false;
+      }
+    }
+
     // some stream seems to contain no keyframes
-    key_frames_count_ += pkt->flags & AV_PKT_FLAG_KEY;
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+      key_frames_.push_back(getFrameCount());
+    }
+    if (by_offset_) {
+      index_.push_back({.pos = pos, .size = pkt->size, .flags = pkt->flags});
+      next_pos = pos + pkt->size;
+      av_packet_unref(pkt);
+    } else {
+      packets.push_back(pkt);
+      pkt = av_packet_alloc();
+    }
+  }
+  av_packet_free(&pkt);
+
+  if (by_offset_) {
+    index_.shrink_to_fit();
+    adviseData(MADV_NORMAL);
+  } else if (!streaming) {
+    releaseData();
   }
-  valid_ = valid_ && !packets.empty();
+  valid_ = valid_ && getFrameCount() > 0;
+  timings.index += millis_since_boot() - start_ms;
   return valid_;
 }
 
+void FrameReader::adviseData(int advice) {
+  if (mapped_data_) {
+    madvise(mapped_data_, mapped_size_, advice);
+  }
+}
+
+// fills an empty packet with frame idx
+bool FrameReader::getPacket(int idx, AVPacket *pkt) const {
+  if (!by_offset_) {
+    return av_packet_ref(pkt, packets[idx]) == 0;
+  }
+  const PacketIndex &p = index_[idx];
+  // a copy, the decoder needs zeroed padding after the data
+  if (av_new_packet(pkt, p.size) != 0) return false;
+  memcpy(pkt->data, data_ + p.pos, p.size);
+  pkt->flags = p.flags;
+  return true;
+}
+
 bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
   for (int i = 0;; i++) {
     const AVCodecHWConfig *config = avcodec_get_hw_config(decoder_ctx->codec, i);
@@ -177,36 +591,215 @@ bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
   return true;
 }
 
+void FrameReader::setCacheSize(size_t max_bytes) {
+  frame_cache.setMaxBytes(max_bytes);
+}
+
+FrameCacheStats FrameReader::cacheStats() {
+  return frame_cache.stats();
+}
+
+FrameDecodeStats FrameReader::decodeStats(int camera) {
+  std::lock_guard lk(decode_stats_lock);
+  return decode_stats[camera];
+}
+
 bool FrameReader::get(int idx, uint8_t *yuv) {
   assert(yuv != nullptr);
-  if (!valid_ || idx < 0 || idx >= packets.size()) {
+  if (!valid_ || idx < 0 || idx >= getFrameCount()) {
     return false;
   }
-  return decode(idx, yuv);
+
+  bool ret = frame_cache.get(id_, idx, yuv, getYUVSize());
+  if (!ret) {
+    std::unique_lock lk(prefetch_lock_);
+    auto it = pending_gops_.find(gopOf(idx));
+    if (it != pending_gops_.end() && it->second == GopState::Queued) {
+      // not started yet, decoder_ctx decodes this GOP now and the job only drops it
+      it->second = GopState::TakenOver;
+    } else if (it != pending_gops_.end() && it->second == GopState::Decoding) {
+      // the GOP is being decoded ahead, wait for the frame instead of decoding it a second time
+      const int gop = it->first;
+      prefetch_cv_.wait(lk, [&] { return !pending_gops_.count(gop) || frame_cache.contains(id_, idx); });
+      lk.unlock();
+      ret = frame_cache.get(id_, idx, yuv, getYUVSize());
+    }
+  }
+  if (!ret) {
+    std::lock_guard lk(decode_lock_);
+    ret = frame_cache.get(id_, idx, yuv, getYUVSize());
+    if (!ret) {
+      frame_cache.miss();
+      ret = decode(idx, yuv);
+    }
+  }
+  prefetch(idx);
+  return ret;
 }
 
+// decode_lock_ must be held. yuv may be null to only fill the cache.
 bool FrameReader::decode(int idx, uint8_t *yuv) {
   int from_idx = idx;
-  if (idx != prev_idx + 1 && key_frames_count_ > 1) {
+  if (idx != prev_idx + 1 && key_frames_.size() > 1) {
     // seeking to the nearest key frame
-    for (int i = idx; i >= 0; --i) {
-      if (packets[i]->flags & AV_PKT_FLAG_KEY) {
-        from_idx = i;
-        break;
-      }
-    }
+    const int gop = gopOf(idx);
+    if (gop >= 0) from_idx = key_frames_[gop];
   }
   prev_idx = idx;
 
+  const size_t size = getYUVSize();
+  const double start_ms = millis_since_boot();
+  std::unique_ptr<AVPacket, AVPacketDeleter> pkt(av_packet_alloc());
   for (int i = from_idx; i <= idx; ++i) {
-    AVFrame *f = decodeFrame(packets[i]);
-    if (f && i == idx) {
-      return copyBuffers(f, yuv);
+    AVFrame *f = getPacket(i, pkt.get()) ? decodeFrame(pkt.get()) : nullptr;
+    av_packet_unref(pkt.get());
+    if (!f) continue;
+
+    if (i == idx) {
+      record_decode(camera_, idx - from_idx + 1, (millis_since_boot() - start_ms) / 1000.0, false);
+    }
+    if (i == idx && yuv) {
+      if (!copyBuffers(f, yuv)) return false;
+      if (frame_cache.enabled()) {
+        auto buf = frame_cache.acquire(size);
+        memcpy(buf.get(), yuv, size);
+        frame_cache.put(id_, i, std::move(buf), size, false);
+      }
+      return true;
     }
+    // keep the other frames of the GOP that had to be decoded anyway
+    if (frame_cache.enabled() && !frame_cache.contains(id_, i)) {
+      auto buf = frame_cache.acquire(size);
+      if (copyBuffers(f, buf.get())) {
+        frame_cache.put(id_, i, std::move(buf), size, false);
+      }
+    }
+    if (i == idx) return true;
   }
   return false;
 }
 
+std::pair<int, int> FrameReader::gopRange(int gop) const {
+  const int to = gop + 1 < key_frames_.size() ? key_frames_[gop + 1] : getFrameCount();
+  return {key_frames_[gop], to};
+}
+
+int FrameReader::gopOf(int idx) const {
+  return std::upper_bound(key_frames_.begin(), key_frames_.end(), idx) - key_frames_.begin() - 1;
+}
+
+void FrameReader::prefetch(int idx) {
+  if (!frame_cache.enabled() || key_frames_.size() < 2 || !decode_pool().enabled()) return;
+
+  const int direction = idx >= last_get_idx_ ? 1 : -1;
+  last_get_idx_ = idx;
+  const int gop = gopOf(idx);
+
+  std::lock_guard lk(prefetch_lock_);
+  play_gop_ = gop;
+  for (int n = 1; n <= PREFETCH_GOPS; ++n) {
+    const int next_gop = gop + n * direction;
+    if (next_gop < 0 || next_gop >= key_frames_.size()) break;
+    if (pending_gops_.count(next_gop)) continue;
+
+    const auto [from, to] = gopRange(next_gop);
+    // a GOP that takes a large part of the cache would evict the frames that are about to be played
+    if ((size_t)(to - from) * getYUVSize() > frame_cache.maxBytes() / 4) break;
+    if (frame_cache.contains(id_, from) && frame_cache.contains(id_, to - 1)) continue;
+
+    pending_gops_[next_gop] = GopState::Queued;
+    decode_pool_used_ = true;
+    decode_pool().push(id_, [this, next_gop] { decodeGop(next_gop); });
+  }
+}
+
+AVCodecContext *FrameReader::openGopDecoder() {
+  const AVCodecParameters *par = input_ctx->streams[0]->codecpar;
+  const AVCodec *decoder = avcodec_find_decoder(par->codec_id);
+  AVCodecContext *ctx = avcodec_alloc_context3(decoder);
+  if (ctx && avcodec_parameters_to_context(ctx, par) == 0) {
+    ctx->thread_count = GOP_DECODER_THREADS;
+    ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (avcodec_open2(ctx, decoder, nullptr) == 0) {
+      return ctx;
+    }
+  }
+  rError("failed to open a GOP decoder");
+  avcodec_free_context(&ctx);
+  return nullptr;
+}
+
+// runs on the decode pool. GOPs are independent, so each one is decoded from its key frame by its own
+// software decoder, without touching decoder_ctx or decode_lock_.
+void FrameReader::decodeGop(int gop) {
+  AVCodecContext *ctx = nullptr;
+  bool wanted = false;
+  {
+    std::lock_guard lk(prefetch_lock_);
+    // skip GOPs that a seek has left behind or that get() is decoding itself
+    auto &state = pending_gops_[gop];
+    wanted = !exit_ && state == GopState::Queued && std::abs(gop - play_gop_) <= PREFETCH_GOPS;
+    if (wanted) {
+      state = GopState::Decoding;
+      if (!gop_decoders_.empty()) {
+        ctx = gop_decoders_.back();
+        gop_decoders_.pop_back();
+      }
+    }
+  }
+  if (wanted && !ctx) {
+    ctx = openGopDecoder();
+  }
+
+  if (wanted && ctx) {
+    const auto [from, to] = gopRange(gop);
+    const size_t size = getYUVSize();
+    const double start_ms = millis_since_boot();
+    std::unique_ptr<AVFrame, AVFrameDeleter> frame(av_frame_alloc());
+    AVPacket *pkt = av_packet_alloc();
+    int decoded = 0;
+
+    // frame threading delays the output by a few packets. frames are matched to packets by pts.
+    auto receive_frames = [&]() {
+      while (avcodec_receive_frame(ctx, frame.get()) == 0) {
+        const int64_t idx = frame->pts;
+        if (idx >= from && idx < to && !frame_cache.contains(id_, idx)) {
+          auto buf = frame_cache.acquire(size);
+          if (copyBuffers(frame.get(), buf.get())) {
+            frame_cache.put(id_, idx, std::move(buf), size, true);
+          }
+          // wake up get() waiting for this frame
+          { std::lock_guard lk(prefetch_lock_); }
+          prefetch_cv_.notify_all();
+        }
+        ++decoded;
+        av_frame_unref(frame.get());
+      }
+    };
+
+    for (int i = from; i < to && !exit_; ++i) {
+      if (!getPacket(i, pkt)) continue;
+      pkt->pts = i;
+      if (avcodec_send_packet(ctx, pkt) == 0) {
+        receive_frames();
+      }
+      av_packet_unref(pkt);
+    }
+    avcodec_send_packet(ctx, nullptr);
+    receive_frames();
+    avcodec_flush_buffers(ctx);
+    av_packet_free(&pkt);
+    record_decode(camera_, decoded, (millis_since_boot() - start_ms) / 1000.0, true);
+  }
+
+  std::lock_guard lk(prefetch_lock_);
+  if (ctx) {
+    gop_decoders_.push_back(ctx);
+  }
+  pending_gops_.erase(gop);
+  prefetch_cv_.notify_all();
+}
+
 AVFrame *FrameReader::decodeFrame(AVPacket *pkt) {
   int ret = avcodec_send_packet(decoder_ctx, pkt);
   if (ret < 0) {
@@ -237,7 +830,8 @@ bool FrameReader::copyBuffers(AVFrame *f, uint8_t *yuv) {
   assert(f != nullptr && yuv != nullptr);
   uint8_t *y = yuv;
   uint8_t *uv = y + width * height;
-  if (hw_pix_fmt == HW_PIX_FMT) {
+  // frames transferred from the hw decoder are NV12, software decoded ones I420
+  if (f->format == AV_PIX_FMT_NV12) {
     for (int i = 0; i < height/2; i++) {
       memcpy(y + (i*2 + 0)*width, f->data[0] + (i*2 + 0)*f->linesize[0], width);
       memcpy(y + (i*2 + 1)*width, f->data[0] + (i*2 + 1)*f->linesize[0], width);
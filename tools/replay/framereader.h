@@ -1,9 +1,14 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "common/queue.h"
 #include "tools/replay/filereader.h"
 
 extern "C" {
@@ -15,32 +20,86 @@ struct AVFrameDeleter {
   void operator()(AVFrame* frame) const { av_frame_free(&frame); }
 };
 
+struct AVPacketDeleter {
+  void operator()(AVPacket* pkt) const { av_packet_free(&pkt); }
+};
+
+struct FrameCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t prefetched = 0;
+  uint64_t evicted = 0;
+  size_t bytes = 0;
+  size_t max_bytes = 0;
+};
+
+struct FrameDecodeStats {
+  uint64_t frames = 0;      // decoded frames, including the ones decoded ahead
+  uint64_t gop_frames = 0;  // decoded ahead by the GOP decode pool
+  double seconds = 0;       // time spent decoding, summed over all threads
+};
+
 class FrameReader {
 public:
-  FrameReader();
+  FrameReader(int camera = 0);
   ~FrameReader();
   bool load(const std::string &url, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr, bool local_cache = false,
             int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr);
   bool get(int idx, uint8_t *yuv);
   int getYUVSize() const { return width * height * 3 / 2; }
-  size_t getFrameCount() const { return packets.size(); }
+  size_t getFrameCount() const { return by_offset_ ? index_.size() : packets.size(); }
   bool valid() const { return valid_; }
 
+  // Decoded frames of all readers are kept in one LRU cache, bounded by max_bytes (0 disables it).
+  // After each get() the next GOPs in play direction are decoded ahead, each by a software decoder
+  // with frame threading on the shared decode pool (REPLAY_DECODE_THREADS workers, 0 disables it).
+  static void setCacheSize(size_t max_bytes);
+  static FrameCacheStats cacheStats();
+  static FrameDecodeStats decodeStats(int camera);
+
+  LoadTimings timings;
   int width = 0, height = 0;
   int aligned_width = 0, aligned_height = 0;
 
 private:
+  bool open(bool by_offset, bool no_hw_decoder, std::atomic<bool> *abort);
+  bool loadStream(const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, int retries);
+  bool mapFile(const std::string &file);
+  void releaseData();
+  void adviseData(int advice);
+  bool getPacket(int idx, AVPacket *pkt) const;
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
   bool decode(int idx, uint8_t *yuv);
+  void prefetch(int idx);
+  void decodeGop(int gop);
+  AVCodecContext *openGopDecoder();
+  std::pair<int, int> gopRange(int gop) const;
+  int gopOf(int idx) const;
   AVFrame * decodeFrame(AVPacket *pkt);
   bool copyBuffers(AVFrame *f, uint8_t *yuv);
 
+  struct PacketIndex {
+    int64_t pos;
+    int size;
+    int flags;
+  };
+  // packets of raw streams are indexed by their offset in data_, other containers keep them in memory
+  bool by_offset_ = false;
+  std::vector<PacketIndex> index_;
   std::vector<AVPacket*> packets;
+  const uint8_t *data_ = nullptr;
+  size_t data_size_ = 0;
+  std::string raw_;
+  void *mapped_data_ = nullptr;
+  size_t mapped_size_ = 0;
+  // bytes of data_ that have arrived while loadStream() indexes a file that is still downloading
+  std::atomic<size_t> received_ = 0;
+  std::atomic<bool> streaming_ = false;
+  QueueSignal received_signal_;
   std::unique_ptr<AVFrame, AVFrameDeleter>av_frame_, hw_frame;
   AVFormatContext *input_ctx = nullptr;
   AVCodecContext *decoder_ctx = nullptr;
-  int key_frames_count_ = 0;
   bool valid_ = false;
   AVIOContext *avio_ctx_ = nullptr;
 
@@ -48,4 +107,19 @@ private:
   AVBufferRef *hw_device_ctx = nullptr;
   int prev_idx = -1;
   inline static std::atomic<bool> has_hw_decoder = true;
+
+  const uint64_t id_;
+  const int camera_;
+  std::vector<int> key_frames_;
+  std::mutex decode_lock_;
+  int last_get_idx_ = -1;
+
+  std::mutex prefetch_lock_;
+  std::condition_variable prefetch_cv_;
+  enum class GopState { Queued, Decoding, TakenOver };
+  std::map<int, GopState> pending_gops_;  // GOPs queued on the decode pool
+  std::vector<AVCodecContext *> gop_decoders_;  // idle
+  int play_gop_ = -1;
+  bool decode_pool_used_ = false;
+  std::atomic<bool> exit_ = false;
 };
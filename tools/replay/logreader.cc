@@ -1,6 +1,17 @@
 #include "tools/replay/logreader.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include <capnp/serialize.h>
+#include "common/timing.h"
+#include "common/util.h"
 #include "tools/replay/util.h"
 
 Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
@@ -44,67 +55,273 @@ LogReader::~LogReader() {
   delete mbr_;
   ::operator delete(pool_buffer_);
 #endif
+
+  releaseMapping();
+}
+
+void LogReader::releaseMapping() {
+  if (mapped_data_) {
+    munmap(mapped_data_, mapped_size_);
+    mapped_data_ = nullptr;
+    mapped_size_ = 0;
+  }
 }
 
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort,
                      const std::set<cereal::Event::Which> &allow,
                      bool local_cache, int chunk_size, int retries) {
+  // the index is kept next to the cache entry, and only for logs that are on disk or will be cached.
+  const bool is_remote = url.find("https://") == 0;
+  const bool use_index = !is_remote || local_cache;
+  const std::string local_file = is_remote ? cacheFilePath(url) : url;
+  const std::string index_file = indexFilePath(url);
+
+  double start_ms = millis_since_boot();
+  // a valid sidecar is neither rebuilt nor rewritten, it's only used to filter if there's an allow set
+  if (use_index) {
+    EventIndex index;
+    const bool valid = allow.empty() ? EventIndex::isValid(index_file, local_file) : index.load(index_file, local_file);
+    if (!valid) {
+      new_index_ = std::make_unique<EventIndex>();
+    } else if (!allow.empty()) {
+      index_offsets_ = index.offsets(allow);
+      filter_by_index_ = true;
+    }
+  }
+  timings.index += millis_since_boot() - start_ms;
+
+  bool success = loadLog(url, abort, allow, local_cache, chunk_size, retries);
+  if (success && new_index_ && !corrupt_ && !(abort && *abort)) {
+    start_ms = millis_since_boot();
+    new_index_->save(index_file, local_file);
+    timings.index += millis_since_boot() - start_ms;
+  }
+
+  new_index_.reset();
+  index_offsets_.clear();
+  index_pos_ = 0;
+  filter_by_index_ = false;
+  return success;
+}
+
+bool LogReader::loadLog(const std::string &url, std::atomic<bool> *abort, const std::set<cereal::Event::Which> &allow,
+                        bool local_cache, int chunk_size, int retries) {
+  const bool is_bz2 = url.find(".bz2") != std::string::npos;
+  const bool is_zst = url.find(".zst") != std::string::npos;
+  const bool is_remote = url.find("https://") == 0;
+  const std::string local_file = is_remote ? cacheFilePath(url) : url;
+  const bool is_local = (!is_remote || local_cache) && util::file_exists(local_file);
+
+  if (!is_bz2 && !is_zst && is_local) {
+    return loadFromMappedFile(local_file, allow, abort);
+  }
+
+  // remote bz2 logs are decompressed while downloading. files that are already on disk
+  // are decompressed on all cores instead.
+  static const int threads = util::getenv("REPLAY_DECOMPRESS_THREADS", (int)std::clamp(std::thread::hardware_concurrency(), 1u, 8u));
+  if (is_bz2 && (!is_local || threads == 1)) {
+    return loadBZ2Stream(url, allow, abort, local_cache, chunk_size, retries);
+  }
+
+  double start_ms = millis_since_boot();
   raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
+  timings.download += millis_since_boot() - start_ms;
   if (raw_.empty()) return false;
 
-  if (url.find(".bz2") != std::string::npos) {
-    raw_ = decompressBZ2(raw_, abort);
-    if (raw_.empty()) return false;
+  start_ms = millis_since_boot();
+  if (is_bz2) {
+    raw_ = decompressBZ2(raw_, abort, threads);
+  } else if (is_zst) {
+    raw_ = decompressZST(raw_, abort, threads);
   }
-  return parse(allow, abort);
+  timings.decompress += millis_since_boot() - start_ms;
+  if (raw_.empty()) return false;
+
+  return parse(raw_.data(), raw_.size(), allow, abort);
 }
 
 bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
   raw_.assign((const char *)data, size);
-  return parse({}, abort);
+  return parse(raw_.data(), raw_.size(), {}, abort);
 }
 
-bool LogReader::parse(const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
-  try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
-    while (words.size() > 0 && !(abort && *abort)) {
-#ifdef HAS_MEMORY_RESOURCE
-      Event *evt = new (mbr_) Event(words);
-#else
-      Event *evt = new Event(words);
-#endif
-      if (!allow.empty() && allow.find(evt->which) == allow.end()) {
-        delete evt;
-        words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-        continue;
-      }
+bool LogReader::loadFromMappedFile(const std::string &file, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
+  unique_fd fd = HANDLE_EINTR(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    rWarning("failed to open %s", file.c_str());
+    return false;
+  }
 
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
-          evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
-          evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    return false;
+  }
 
-#ifdef HAS_MEMORY_RESOURCE
-        Event *frame_evt = new (mbr_) Event(words, true);
-#else
-        Event *frame_evt = new Event(words, true);
-#endif
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    rWarning("failed to mmap %s", file.c_str());
+    return false;
+  }
+  releaseMapping();
+  mapped_data_ = addr;
+  mapped_size_ = st.st_size;
+
+  // parse front to back, then let the kernel drop the read-ahead hint since the
+  // stream thread visits events in mono_time order.
+  madvise(mapped_data_, mapped_size_, MADV_SEQUENTIAL);
+  madvise(mapped_data_, mapped_size_, MADV_WILLNEED);
+  bool ret = parse((const char *)mapped_data_, mapped_size_, allow, abort);
+  madvise(mapped_data_, mapped_size_, MADV_NORMAL);
+  return ret;
+}
 
-        events.push_back(frame_evt);
+bool LogReader::loadBZ2Stream(const std::string &url, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort,
+                              bool local_cache, int chunk_size, int retries) {
+  // decompress block by block as data arrives and parse every complete message right away.
+  // a message cut off at the end of a chunk is moved to the start of the next one.
+  BZ2Stream bz2;
+  bool parse_error = false;
+  char *buf = nullptr;
+  size_t buf_size = 0, used = 0, parsed = 0;
+  uint64_t stream_offset = 0;
+
+  auto handler = [&](const char *data, size_t size) {
+    // keep going after the input is consumed to drain output still buffered inside the decoder
+    while (!(abort && *abort)) {
+      if (used == buf_size) {
+        const size_t remaining = used - parsed;
+        size_t required = remaining;
+        if (remaining >= sizeof(capnp::word)) {
+          kj::ArrayPtr<const capnp::word> words((const capnp::word *)(buf + parsed), remaining / sizeof(capnp::word));
+          required = capnp::expectedSizeInWordsFromPrefix(words) * sizeof(capnp::word);
+        }
+        const size_t new_size = std::max(DECOMPRESS_CHUNK_SIZE, required * 2);
+        auto &chunk = chunks_.emplace_back(new char[new_size]);
+        if (remaining > 0) {
+          memcpy(chunk.get(), buf + parsed, remaining);
+        }
+        buf = chunk.get();
+        buf_size = new_size;
+        used = remaining;
+        parsed = 0;
       }
 
-      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-      events.push_back(evt);
+      double start_ms = millis_since_boot();
+      ssize_t written = bz2.decompress(data, size, buf + used, buf_size - used);
+      timings.decompress += millis_since_boot() - start_ms;
+      if (written < 0) {
+        corrupt_ = true;
+        return false;
+      } else if (written == 0 && size == 0) {
+        break;
+      }
+      used += written;
+
+      try {
+        start_ms = millis_since_boot();
+        size_t n = parseMessages(buf + parsed, used - parsed, stream_offset, allow, abort);
+        timings.parse += millis_since_boot() - start_ms;
+        parsed += n;
+        stream_offset += n;
+      } catch (const kj::Exception &e) {
+        rWarning("failed to parse log : %s", e.getDescription().cStr());
+        corrupt_ = parse_error = true;
+        return false;
+      }
     }
+    return !(abort && *abort);
+  };
+
+  const double start_ms = millis_since_boot();
+  const LoadTimings before = timings;
+  bool success = FileReader(local_cache, chunk_size, retries).read(url, handler, abort);
+  timings.download += (millis_since_boot() - start_ms) - (timings.decompress - before.decompress) - (timings.parse - before.parse);
+  // like a log that is decompressed in one go, the load fails if the download or the bz2 stream
+  // didn't complete. only a log that decompresses but doesn't parse keeps the events read so far.
+  if (!parse_error && (!success || !bz2.finished())) {
+    if (success) rWarning("decompressBZ2 error : content is corrupt");
+    corrupt_ = true;
+    return false;
+  }
+
+  if (corrupt_ && !events.empty()) {
+    rWarning("read %zu events from corrupt log", events.size());
+  }
+  return finishParse(abort);
+}
+
+bool LogReader::parse(const char *data, size_t size, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
+  const double start_ms = millis_since_boot();
+  try {
+    parseMessages(data, size, 0, allow, abort);
   } catch (const kj::Exception &e) {
     rWarning("failed to parse log : %s", e.getDescription().cStr());
+    corrupt_ = true;
     if (!events.empty()) {
       rWarning("read %zu events from corrupt log", events.size());
     }
   }
+  timings.parse += millis_since_boot() - start_ms;
+  return finishParse(abort);
+}
+
+size_t LogReader::parseMessages(const char *data, size_t size, uint64_t offset,
+                                const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+  while (words.size() > 0 && !(abort && *abort)) {
+    // stop at an incomplete message, the rest of it has not been decompressed yet
+    const size_t msg_words = capnp::expectedSizeInWordsFromPrefix(words);
+    if (msg_words > words.size()) break;
+
+    const uint64_t msg_offset = offset + ((const char *)words.begin() - data);
+    if (filter_by_index_) {
+      // skip messages that are not in the allow set without decoding them
+      while (index_pos_ < index_offsets_.size() && index_offsets_[index_pos_] < msg_offset) ++index_pos_;
+      if (index_pos_ == index_offsets_.size() || index_offsets_[index_pos_] != msg_offset) {
+        words = kj::arrayPtr(words.begin() + msg_words, words.end());
+        continue;
+      }
+    }
+
+#ifdef HAS_MEMORY_RESOURCE
+    Event *evt = new (mbr_) Event(words);
+#else
+    Event *evt = new Event(words);
+#endif
+    if (new_index_) {
+      new_index_->add(evt->which, msg_offset);
+    }
+    if (!allow.empty() && allow.find(evt->which) == allow.end()) {
+      delete evt;
+      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
+      continue;
+    }
+
+    // Add encodeIdx packet again as a frame packet for the video stream
+    if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
+        evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
+        evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+
+#ifdef HAS_MEMORY_RESOURCE
+      Event *frame_evt = new (mbr_) Event(words, true);
+#else
+      Event *frame_evt = new Event(words, true);
+#endif
+
+      events.push_back(frame_evt);
+    }
+
+    words = kj::arrayPtr(evt->reader.getEnd(), words.end());
+    events.push_back(evt);
+  }
+  return (const char *)words.begin() - data;
+}
 
+bool LogReader::finishParse(std::atomic<bool> *abort) {
   if (!events.empty() && !(abort && *abort)) {
+    const double start_ms = millis_since_boot();
     std::sort(events.begin(), events.end(), Event::lessThan());
+    timings.parse += millis_since_boot() - start_ms;
     return true;
   }
   return false;
@@ -9,11 +9,13 @@
 
 #include "cereal/gen/cpp/log.capnp.h"
 #include "system/camerad/cameras/camera_common.h"
+#include "tools/replay/eventindex.h"
 #include "tools/replay/filereader.h"
 
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
 const int MAX_CAMERAS = std::size(ALL_CAMERAS);
 const int DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE = 65000;
+const size_t DECOMPRESS_CHUNK_SIZE = 8 * 1024 * 1024;
 
 class Event {
 public:
@@ -56,10 +58,32 @@ public:
             bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
   std::vector<Event*> events;
+  LoadTimings timings;
 
 private:
-  bool parse(const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
+  bool loadLog(const std::string &url, std::atomic<bool> *abort, const std::set<cereal::Event::Which> &allow,
+               bool local_cache, int chunk_size, int retries);
+  bool loadFromMappedFile(const std::string &file, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
+  void releaseMapping();
+  bool loadBZ2Stream(const std::string &url, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort,
+                     bool local_cache, int chunk_size, int retries);
+  bool parse(const char *data, size_t size, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
+  size_t parseMessages(const char *data, size_t size, uint64_t offset,
+                       const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
+  bool finishParse(std::atomic<bool> *abort);
   std::string raw_;
+  // decompressed data of a streamed log. events point into these chunks
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  bool corrupt_ = false;
+
+  // built while parsing a complete log, or used to skip messages outside the allow set
+  std::unique_ptr<EventIndex> new_index_;
+  std::vector<uint64_t> index_offsets_;
+  size_t index_pos_ = 0;
+  bool filter_by_index_ = false;
+  // uncompressed local logs are parsed in place from a read-only mapping instead of being copied into raw_
+  void *mapped_data_ = nullptr;
+  size_t mapped_size_ = 0;
 #ifdef HAS_MEMORY_RESOURCE
   std::pmr::monotonic_buffer_resource *mbr_ = nullptr;
   void *pool_buffer_ = nullptr;
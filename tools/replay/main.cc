@@ -28,7 +28,10 @@ int main(int argc, char *argv[]) {
   parser.addOption({{"a", "allow"}, "whitelist of services to send", "allow"});
   parser.addOption({{"b", "block"}, "blacklist of services to send", "block"});
   parser.addOption({{"c", "cache"}, "cache <n> segments in memory. default is 5", "n"});
+  parser.addOption({"loads", "load up to <n> segments at the same time. default is 3", "n"});
+  parser.addOption({"lockstep", "wait for consumers after each trigger, e.g. can=sendcan,vipc:road=modelV2+cameraOdometry", "rules"});
   parser.addOption({{"s", "start"}, "start from <seconds>", "seconds"});
+  parser.addOption({"frame-cache", "keep up to <MB> of decoded camera frames in memory. default is 512", "MB"});
   parser.addOption({"demo", "use a demo route instead of providing your own"});
   parser.addOption({"data_dir", "local directory with routes", "data_dir"});
   parser.addOption({"prefix", "set OPENPILOT_PREFIX", "prefix"});
@@ -59,10 +62,33 @@ int main(int argc, char *argv[]) {
     op_prefix.reset(new OpenpilotPrefix(prefix.toStdString()));
   }
 
+  if (!parser.value("frame-cache").isEmpty()) {
+    FrameReader::setCacheSize(parser.value("frame-cache").toULongLong() * 1024 * 1024);
+  }
+
   Replay *replay = new Replay(route, allow, block, base_blacklist, nullptr, replay_flags, parser.value("data_dir"), &app);
   if (!parser.value("c").isEmpty()) {
     replay->setSegmentCacheLimit(parser.value("c").toInt());
   }
+  if (!parser.value("loads").isEmpty()) {
+    replay->setSegmentLoadLimit(parser.value("loads").toInt());
+  }
+  if (!parser.value("lockstep").isEmpty()) {
+    std::map<std::string, std::vector<std::string>> rules;
+    for (const QString &rule : parser.value("lockstep").split(",")) {
+      const QStringList kv = rule.split("=");
+      if (kv.size() != 2) {
+        qCritical() << "invalid lockstep rule" << rule;
+        return 0;
+      }
+      for (const QString &ack : kv[1].split("+")) {
+        rules[kv[0].toStdString()].push_back(ack.toStdString());
+      }
+    }
+    if (!replay->setLockstep(rules)) {
+      return 0;
+    }
+  }
   if (!replay->load()) {
     return 0;
   }
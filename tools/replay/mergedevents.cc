@@ -0,0 +1,104 @@
+#include "tools/replay/mergedevents.h"
+
+#include <algorithm>
+
+MergedEvents::iterator::iterator(const std::vector<Span> *spans, std::vector<size_t> &&pos)
+    : spans_(spans), pos_(std::move(pos)) {
+  next();
+}
+
+void MergedEvents::iterator::next() {
+  // a linear scan, there are only as many spans as cached segments, and they rarely overlap
+  const Event *min = nullptr;
+  cur_ = 0;
+  for (size_t i = 0; i < spans_->size(); ++i) {
+    const auto &events = *(*spans_)[i].events;
+    if (pos_[i] < events.size() && (!min || Event::lessThan()(events[pos_[i]], min))) {
+      min = events[pos_[i]];
+      cur_ = i;
+    }
+  }
+}
+
+void MergedEvents::add(int seg_num, const std::vector<Event *> *events) {
+  auto it = std::lower_bound(spans_.begin(), spans_.end(), seg_num, [](auto &s, int n) { return s.seg_num < n; });
+  if (it != spans_.end() && it->seg_num == seg_num) {
+    it->events = events;
+  } else {
+    spans_.insert(it, {seg_num, events, 0});
+  }
+
+  skipInitData();
+}
+
+void MergedEvents::remove(int seg_num) {
+  auto it = std::find_if(spans_.begin(), spans_.end(), [=](auto &s) { return s.seg_num == seg_num; });
+  if (it != spans_.end()) {
+    spans_.erase(it);
+    skipInitData();
+  }
+}
+
+void MergedEvents::skipInitData() {
+  bool first = true;
+  for (auto &s : spans_) {
+    s.first = !first && !s.events->empty() && s.events->front()->which == cereal::Event::Which::INIT_DATA ? 1 : 0;
+    first = first && s.events->empty();
+  }
+}
+
+MergedEvents::iterator MergedEvents::begin() const {
+  std::vector<size_t> pos(spans_.size());
+  for (size_t i = 0; i < spans_.size(); ++i) {
+    pos[i] = spans_[i].first;
+  }
+  return iterator(&spans_, std::move(pos));
+}
+
+MergedEvents::iterator MergedEvents::end() const {
+  std::vector<size_t> pos(spans_.size());
+  for (size_t i = 0; i < spans_.size(); ++i) {
+    pos[i] = spans_[i].events->size();
+  }
+  return iterator(&spans_, std::move(pos));
+}
+
+MergedEvents::iterator MergedEvents::lower_bound(const Event *e) const {
+  std::vector<size_t> pos(spans_.size());
+  for (size_t i = 0; i < spans_.size(); ++i) {
+    const auto &events = *spans_[i].events;
+    pos[i] = std::lower_bound(events.begin() + spans_[i].first, events.end(), e, Event::lessThan()) - events.begin();
+  }
+  return iterator(&spans_, std::move(pos));
+}
+
+MergedEvents::iterator MergedEvents::upper_bound(const Event *e) const {
+  std::vector<size_t> pos(spans_.size());
+  for (size_t i = 0; i < spans_.size(); ++i) {
+    const auto &events = *spans_[i].events;
+    pos[i] = std::upper_bound(events.begin() + spans_[i].first, events.end(), e, Event::lessThan()) - events.begin();
+  }
+  return iterator(&spans_, std::move(pos));
+}
+
+bool MergedEvents::empty() const {
+  return size() == 0;
+}
+
+size_t MergedEvents::size() const {
+  size_t n = 0;
+  for (auto &s : spans_) {
+    n += s.events->size() - s.first;
+  }
+  return n;
+}
+
+const Event *MergedEvents::back() const {
+  const Event *last = nullptr;
+  for (auto &s : spans_) {
+    if (s.events->size() > s.first && (!last || Event::lessThan()(last, s.events->back()))) {
+      last = s.events->back();
+    }
+  }
+  return last;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <iterator>
+#include <vector>
+
+#include "tools/replay/logreader.h"
+
+// Sorted view of the events of several segments. The events of each segment are already sorted, so
+// instead of being copied into one array they are kept as one span per segment and iterated with a
+// k-way merge. Adding or dropping a segment only touches the span of that segment.
+class MergedEvents {
+public:
+  struct Span {
+    int seg_num;
+    const std::vector<Event *> *events;
+    size_t first;  // the initData of all but the first segment is skipped
+  };
+
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Event *;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Event *const *;
+    using reference = Event *const &;
+
+    iterator() = default;
+    inline reference operator*() const { return (*(*spans_)[cur_].events)[pos_[cur_]]; }
+    inline iterator &operator++() {
+      ++pos_[cur_];
+      next();
+      return *this;
+    }
+    inline iterator operator++(int) {
+      iterator it = *this;
+      ++(*this);
+      return it;
+    }
+    inline bool operator==(const iterator &other) const { return pos_ == other.pos_; }
+    inline bool operator!=(const iterator &other) const { return pos_ != other.pos_; }
+
+  private:
+    friend class MergedEvents;
+    iterator(const std::vector<Span> *spans, std::vector<size_t> &&pos);
+    // select the span with the smallest current event
+    void next();
+
+    const std::vector<Span> *spans_ = nullptr;
+    std::vector<size_t> pos_;
+    size_t cur_ = 0;
+  };
+
+  // events must stay valid until the segment is removed
+  void add(int seg_num, const std::vector<Event *> *events);
+  void remove(int seg_num);
+  void clear() { spans_.clear(); }
+
+  // iterators are invalidated by add() and remove()
+  iterator begin() const;
+  iterator end() const;
+  iterator lower_bound(const Event *e) const;
+  iterator upper_bound(const Event *e) const;
+  bool empty() const;
+  size_t size() const;
+  const Event *back() const;
+
+private:
+  void skipInitData();
+  std::vector<Span> spans_;  // sorted by segment number
+};
@@ -48,8 +48,7 @@ Replay::Replay(QString route, QStringList allow, QStringList block, QStringList
     pm = std::make_unique<PubMaster>(s);
   }
   route_ = std::make_unique<Route>(route, data_dir);
-  events_ = std::make_unique<std::vector<Event *>>();
-  new_events_ = std::make_unique<std::vector<Event *>>();
+  events_ = std::make_unique<MergedEvents>();
 }
 
 Replay::~Replay() {
@@ -67,12 +66,95 @@ void Replay::stop() {
     stream_thread_->wait();
     stream_thread_ = nullptr;
   }
-  camera_server_.reset(nullptr);
+  {
+    std::lock_guard lk(camera_server_lock_);
+    camera_server_.reset();
+  }
   timeline_future.waitForFinished();
   segments_.clear();
+  if (lockstep_) {
+    rInfo("lockstep: %llu timeouts", (unsigned long long)lockstep_timeouts_.load());
+  }
   rInfo("shutdown: done");
 }
 
+bool Replay::setLockstep(const std::map<std::string, std::vector<std::string>> &rules, int timeout_ms) {
+  const std::map<std::string, cereal::Event::Which> frame_triggers = {
+      {"vipc:road", cereal::Event::ROAD_ENCODE_IDX},
+      {"vipc:driver", cereal::Event::DRIVER_ENCODE_IDX},
+      {"vipc:wideRoad", cereal::Event::WIDE_ROAD_ENCODE_IDX},
+  };
+  std::map<std::string, uint16_t> service_which;
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  for (const auto &it : services) {
+    service_which[it.name] = event_struct.getFieldByName(it.name).getProto().getDiscriminantValue();
+  }
+
+  lockstep_ctx_.reset(Context::create());
+  lockstep_poller_.reset(Poller::create());
+  lockstep_acks_.assign(sockets_.size(), {});
+  lockstep_frame_acks_.assign(sockets_.size(), {});
+  for (const auto &[trigger, acks] : rules) {
+    std::vector<SubSocket *> *trigger_acks = nullptr;
+    if (auto it = frame_triggers.find(trigger); it != frame_triggers.end()) {
+      trigger_acks = &lockstep_frame_acks_[it->second];
+    } else if (auto it = service_which.find(trigger); it != service_which.end()) {
+      trigger_acks = &lockstep_acks_[it->second];
+    } else {
+      rWarning("lockstep: unknown trigger %s", trigger.c_str());
+      return false;
+    }
+
+    for (const auto &ack : acks) {
+      auto &sock = lockstep_socks_[ack];
+      if (!sock) {
+        if (!service_which.count(ack)) {
+          rWarning("lockstep: unknown ack service %s", ack.c_str());
+          return false;
+        }
+        sock.reset(SubSocket::create(lockstep_ctx_.get(), ack));
+        lockstep_poller_->registerSocket(sock.get());
+      }
+      trigger_acks->push_back(sock.get());
+    }
+  }
+  lockstep_timeout_ms_ = timeout_ms;
+  lockstep_ = true;
+  return true;
+}
+
+void Replay::drainAcks(const std::vector<SubSocket *> &acks) {
+  for (SubSocket *sock : acks) {
+    while (Message *msg = sock->receive(true)) {
+      delete msg;
+    }
+  }
+}
+
+void Replay::waitForAcks(const std::vector<SubSocket *> &acks) {
+  if (acks.empty()) return;
+
+  std::vector<SubSocket *> pending = acks;
+  const double deadline = millis_since_boot() + lockstep_timeout_ms_;
+  while (!pending.empty() && !updating_events_) {
+    const int remaining_ms = deadline - millis_since_boot();
+    if (remaining_ms <= 0) {
+      std::string names;
+      for (auto &[name, sock] : lockstep_socks_) {
+        if (std::find(pending.begin(), pending.end(), sock.get()) != pending.end()) names += " " + name;
+      }
+      rWarning("lockstep: timed out waiting for%s at %.2f s", names.c_str(), currentSeconds());
+      ++lockstep_timeouts_;
+      break;
+    }
+    for (SubSocket *sock : lockstep_poller_->poll(remaining_ms)) {
+      // only the arrival matters, consumers may have published more than one message
+      drainAcks({sock});
+      pending.erase(std::remove(pending.begin(), pending.end(), sock), pending.end());
+    }
+  }
+}
+
 bool Replay::load() {
   if (!route_->load()) {
     qCritical() << "failed to load route" << route_->name()
@@ -136,55 +218,13 @@ void Replay::seekToFlag(FindFlag flag) {
 }
 
 void Replay::buildTimeline() {
-  uint64_t engaged_begin = 0;
-  bool engaged = false;
-
-  auto alert_status = cereal::ControlsState::AlertStatus::NORMAL;
-  auto alert_size = cereal::ControlsState::AlertSize::NONE;
-  uint64_t alert_begin = 0;
-  std::string alert_type;
-
-  const TimelineType timeline_types[] = {
-    [(int)cereal::ControlsState::AlertStatus::NORMAL] = TimelineType::AlertInfo,
-    [(int)cereal::ControlsState::AlertStatus::USER_PROMPT] = TimelineType::AlertWarning,
-    [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
-  };
-
-  for (auto it = segments_.cbegin(); it != segments_.cend() && !exit_; ++it) {
-    LogReader log;
-    if (!log.load(route_->at(it->first).qlog.toStdString(), &exit_,
-                  {cereal::Event::Which::CONTROLS_STATE, cereal::Event::Which::USER_FLAG},
-                  !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), 0, 3)) continue;
-
-    for (const Event *e : log.events) {
-      if (e->which == cereal::Event::Which::CONTROLS_STATE) {
-        auto cs = e->event.getControlsState();
-
-        if (engaged != cs.getEnabled()) {
-          if (engaged) {
-            std::lock_guard lk(timeline_lock);
-            timeline.push_back({toSeconds(engaged_begin), toSeconds(e->mono_time), TimelineType::Engaged});
-          }
-          engaged_begin = e->mono_time;
-          engaged = cs.getEnabled();
-        }
-
-        if (alert_type != cs.getAlertType().cStr() || alert_status != cs.getAlertStatus()) {
-          if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
-            std::lock_guard lk(timeline_lock);
-            timeline.push_back({toSeconds(alert_begin), toSeconds(e->mono_time), timeline_types[(int)alert_status]});
-          }
-          alert_begin = e->mono_time;
-          alert_type = cs.getAlertType().cStr();
-          alert_size = cs.getAlertSize();
-          alert_status = cs.getAlertStatus();
-        }
-      } else if (e->which == cereal::Event::Which::USER_FLAG) {
-        std::lock_guard lk(timeline_lock);
-        timeline.push_back({toSeconds(e->mono_time), toSeconds(e->mono_time), TimelineType::UserFlag});
-      }
-    }
+  std::map<int, std::string> qlogs;
+  for (const auto &[n, _] : segments_) {
+    qlogs[n] = route_->at(n).qlog.toStdString();
   }
+  const double start_ms = millis_since_boot();
+  timeline_.build(route_->name().toStdString(), qlogs, route_start_ts_, !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), &exit_);
+  rDebug("timeline of %zu segments built in %.0f ms", qlogs.size(), millis_since_boot() - start_ms);
 }
 
 std::optional<uint64_t> Replay::find(FindFlag flag) {
@@ -223,10 +263,14 @@ void Replay::setCurrentSegment(int n) {
 }
 
 void Replay::segmentLoadFinished(bool success) {
+  Segment *seg = qobject_cast<Segment *>(sender());
   if (!success) {
-    Segment *seg = qobject_cast<Segment *>(sender());
     rWarning("failed to load segment %d, removing it from current replay list", seg->seg_num);
     segments_.erase(seg->seg_num);
+  } else {
+    const LoadTimings t = seg->timings();
+    rInfo("segment %d loaded in %.0f ms (download %.0f ms, decompress %.0f ms, parse %.0f ms, index %.0f ms)",
+          seg->seg_num, seg->loadMilliseconds(), t.download, t.decompress, t.parse, t.index);
   }
   queueSegment();
 }
@@ -245,18 +289,28 @@ void Replay::queueSegment() {
     ++end;
   }
 
-  // load one segment at a time
-  for (auto it = cur; it != end; ++it) {
-    auto &[n, seg] = *it;
-    if ((seg && !seg->isLoaded()) || !seg) {
-      if (!seg) {
-        rDebug("loading segment %d...", n);
-        seg = std::make_unique<Segment>(n, route_->at(n), flags_, allow_list);
-        QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
-      }
-      break;
+  // load up to segment_load_limit segments at a time, the nearest to the current segment first,
+  // and the one ahead of it when two are equally far. segments that fall out of the window are freed
+  // below, which aborts their loading.
+  std::vector<SegmentMap::iterator> to_load;
+  int loading = 0;
+  for (auto it = begin; it != end; ++it) {
+    if (!it->second) {
+      to_load.push_back(it);
+    } else if (it->second->isLoading()) {
+      ++loading;
     }
   }
+  auto priority = [n = cur->first](const SegmentMap::iterator &it) {
+    return std::make_pair(std::abs(it->first - n), it->first < n);
+  };
+  std::sort(to_load.begin(), to_load.end(), [&](auto &l, auto &r) { return priority(l) < priority(r); });
+  for (int i = 0; i < to_load.size() && loading < segment_load_limit; ++i, ++loading) {
+    auto &[n, seg] = *to_load[i];
+    rDebug("loading segment %d...", n);
+    seg = std::make_unique<Segment>(n, route_->at(n), flags_, allow_list);
+    QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+  }
 
   mergeSegments(begin, end);
 
@@ -274,11 +328,9 @@ void Replay::queueSegment() {
 
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::vector<int> segments_need_merge;
-  size_t new_events_size = 0;
   for (auto it = begin; it != end; ++it) {
     if (it->second && it->second->isLoaded()) {
       segments_need_merge.push_back(it->first);
-      new_events_size += it->second->log->events.size();
     }
   }
 
@@ -289,20 +341,19 @@ void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::
       if (i != segments_need_merge.size() - 1) s += ", ";
     }
     rDebug("merge segments %s", s.c_str());
-    new_events_->clear();
-    new_events_->reserve(new_events_size);
-    for (int n : segments_need_merge) {
-      const auto &e = segments_[n]->log->events;
-      if (e.size() > 0) {
-        auto insert_from = e.begin();
-        if (new_events_->size() > 0 && (*insert_from)->which == cereal::Event::Which::INIT_DATA) ++insert_from;
-        auto middle = new_events_->insert(new_events_->end(), insert_from, e.end());
-        std::inplace_merge(new_events_->begin(), middle, new_events_->end(), Event::lessThan());
-      }
-    }
 
     updateEvents([&]() {
-      events_.swap(new_events_);
+      // only the spans of the segments that were added or dropped change
+      for (int n : segments_merged_) {
+        if (std::find(segments_need_merge.begin(), segments_need_merge.end(), n) == segments_need_merge.end()) {
+          events_->remove(n);
+        }
+      }
+      for (int n : segments_need_merge) {
+        if (!isSegmentMerged(n)) {
+          events_->add(n, &segments_[n]->log->events);
+        }
+      }
       segments_merged_ = segments_need_merge;
       return true;
     });
@@ -328,8 +379,8 @@ void Replay::startStream(const Segment *cur_segment) {
     builder.setRoot((*it)->event.getCarParams());
     auto words = capnp::messageToFlatArray(builder);
     auto bytes = words.asBytes();
-    Params().put("CarParams", (const char *)bytes.begin(), bytes.size());
-    Params().put("CarParamsPersistent", (const char *)bytes.begin(), bytes.size());
+    std::string car_params((const char *)bytes.begin(), bytes.size());
+    Params().putMany({{"CarParams", car_params}, {"CarParamsPersistent", car_params}});
   } else {
     rWarning("failed to read CarParams from current segment");
   }
@@ -342,7 +393,8 @@ void Replay::startStream(const Segment *cur_segment) {
         camera_size[type] = {fr->width, fr->height};
       }
     }
-    camera_server_ = std::make_unique<CameraServer>(camera_size);
+    std::lock_guard lk(camera_server_lock_);
+    camera_server_ = std::make_shared<CameraServer>(camera_size);
   }
 
   emit segmentsMerged();
@@ -398,7 +450,7 @@ void Replay::stream() {
     if (exit_) break;
 
     Event cur_event(cur_which, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
+    auto eit = events_->upper_bound(&cur_event);
     if (eit == events_->end()) {
       rInfo("waiting for events...");
       continue;
@@ -434,17 +486,28 @@ void Replay::stream() {
           evt_start_ts = cur_mono_time_;
           loop_start_ts = nanos_since_boot();
           prev_replay_speed = speed_;
-        } else if (behind_ns > 0 && !hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+        } else if (behind_ns > 0 && !hasFlag(REPLAY_FLAG_FULL_SPEED) && !lockstep_) {
           precise_nano_sleep(behind_ns);
         }
 
+        static const std::vector<SubSocket *> no_acks;
         if (!evt->frame) {
+          const auto &acks = lockstep_ ? lockstep_acks_[cur_which] : no_acks;
+          drainAcks(acks);
           publishMessage(evt);
+          waitForAcks(acks);
         } else if (camera_server_) {
-          if (hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+          if (hasFlag(REPLAY_FLAG_FULL_SPEED) || lockstep_) {
             camera_server_->waitForSent();
           }
+          const auto &acks = lockstep_ ? lockstep_frame_acks_[cur_which] : no_acks;
+          drainAcks(acks);
           publishFrame(evt);
+          if (!acks.empty()) {
+            // the frame has to be in visionipc before its consumers can ack it
+            camera_server_->waitForSent();
+            waitForAcks(acks);
+          }
         }
       }
     }
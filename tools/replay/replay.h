@@ -5,12 +5,16 @@
 #include <QThread>
 
 #include "tools/replay/camera.h"
+#include "tools/replay/mergedevents.h"
 #include "tools/replay/route.h"
+#include "tools/replay/timeline.h"
 
 const QString DEMO_ROUTE = "4cf7a6ad03080c90|2021-09-29--13-46-36";
 
 // one segment uses about 100M of memory
 constexpr int MIN_SEGMENTS_CACHE = 5;
+constexpr int DEFAULT_SEGMENT_LOADS = 3;
+constexpr int LOCKSTEP_TIMEOUT_MS = 1000;
 
 enum REPLAY_FLAGS {
   REPLAY_FLAG_NONE = 0x0000,
@@ -34,7 +38,6 @@ enum class FindFlag {
   nextCritical
 };
 
-enum class TimelineType { None, Engaged, AlertInfo, AlertWarning, AlertCritical, UserFlag };
 typedef bool (*replayEventFilter)(const Event *, void *);
 
 class Replay : public QObject {
@@ -58,12 +61,25 @@ public:
     filter_opaque = opaque;
     event_filter = filter;
   }
+  // Lockstep mode: after publishing a trigger, wait until every one of its ack services has published a
+  // new message, then continue without sleeping. This runs as fast as the slowest consumer. Triggers
+  // are service names, or vipc:road, vipc:driver and vipc:wideRoad for camera frames. Call before start().
+  bool setLockstep(const std::map<std::string, std::vector<std::string>> &rules, int timeout_ms = LOCKSTEP_TIMEOUT_MS);
+  inline uint64_t lockstepTimeouts() const { return lockstep_timeouts_; }
   inline int segmentCacheLimit() const { return segment_cache_limit; }
   inline void setSegmentCacheLimit(int n) { segment_cache_limit = std::max(MIN_SEGMENTS_CACHE, n); }
+  // number of segments in the cache window that are loaded at the same time
+  inline int segmentLoadLimit() const { return segment_load_limit; }
+  inline void setSegmentLoadLimit(int n) { segment_load_limit = std::max(1, n); }
   inline bool hasFlag(REPLAY_FLAGS flag) const { return flags_ & flag; }
   inline void addFlag(REPLAY_FLAGS flag) { flags_ |= flag; }
   inline void removeFlag(REPLAY_FLAGS flag) { flags_ &= ~flag; }
   inline const Route* route() const { return route_.get(); }
+  // safe to call from any thread while the replay starts or stops. the server stays valid while the pointer is held
+  inline std::shared_ptr<const CameraServer> cameraServer() const {
+    std::lock_guard lk(camera_server_lock_);
+    return camera_server_;
+  }
   inline double currentSeconds() const { return double(cur_mono_time_ - route_start_ts_) / 1e9; }
   inline QDateTime currentDateTime() const { return route_->datetime().addSecs(currentSeconds()); }
   inline uint64_t routeStartTime() const { return route_start_ts_; }
@@ -71,13 +87,10 @@ public:
   inline int totalSeconds() const { return (!segments_.empty()) ? (segments_.rbegin()->first + 1) * 60 : 0; }
   inline void setSpeed(float speed) { speed_ = speed; }
   inline float getSpeed() const { return speed_; }
-  inline const std::vector<Event *> *events() const { return events_.get(); }
+  inline const MergedEvents *events() const { return events_.get(); }
   inline const std::map<int, std::unique_ptr<Segment>> &segments() const { return segments_; };
   inline const std::string &carFingerprint() const { return car_fingerprint_; }
-  inline const std::vector<std::tuple<int, int, TimelineType>> getTimeline() {
-    std::lock_guard lk(timeline_lock);
-    return timeline;
-  }
+  inline const std::vector<std::tuple<int, int, TimelineType>> getTimeline() { return timeline_.get(); }
 
 signals:
   void streamStarted();
@@ -99,6 +112,8 @@ protected:
   void publishMessage(const Event *e);
   void publishFrame(const Event *e);
   void buildTimeline();
+  void drainAcks(const std::vector<SubSocket *> &acks);
+  void waitForAcks(const std::vector<SubSocket *> &acks);
   inline bool isSegmentMerged(int n) {
     return std::find(segments_merged_.begin(), segments_merged_.end(), n) != segments_merged_.end();
   }
@@ -117,8 +132,7 @@ protected:
   bool events_updated_ = false;
   uint64_t route_start_ts_ = 0;
   std::atomic<uint64_t> cur_mono_time_ = 0;
-  std::unique_ptr<std::vector<Event *>> events_;
-  std::unique_ptr<std::vector<Event *>> new_events_;
+  std::unique_ptr<MergedEvents> events_;
   std::vector<int> segments_merged_;
 
   // messaging
@@ -126,16 +140,28 @@ protected:
   std::unique_ptr<PubMaster> pm;
   std::vector<const char*> sockets_;
   std::unique_ptr<Route> route_;
-  std::unique_ptr<CameraServer> camera_server_;
+  mutable std::mutex camera_server_lock_;
+  std::shared_ptr<CameraServer> camera_server_;
+
+  // lockstep
+  bool lockstep_ = false;
+  int lockstep_timeout_ms_ = LOCKSTEP_TIMEOUT_MS;
+  std::atomic<uint64_t> lockstep_timeouts_ = 0;
+  std::unique_ptr<Context> lockstep_ctx_;
+  std::unique_ptr<Poller> lockstep_poller_;
+  std::map<std::string, std::unique_ptr<SubSocket>> lockstep_socks_;
+  // ack sockets by event type, of messages and of camera frames
+  std::vector<std::vector<SubSocket *>> lockstep_acks_;
+  std::vector<std::vector<SubSocket *>> lockstep_frame_acks_;
   std::atomic<uint32_t> flags_ = REPLAY_FLAG_NONE;
 
-  std::mutex timeline_lock;
   QFuture<void> timeline_future;
-  std::vector<std::tuple<int, int, TimelineType>> timeline;
+  Timeline timeline_;
   std::set<cereal::Event::Which> allow_list;
   std::string car_fingerprint_;
   float speed_ = 1.0;
   replayEventFilter event_filter = nullptr;
   void *filter_opaque = nullptr;
   int segment_cache_limit = MIN_SEGMENTS_CACHE;
+  int segment_load_limit = DEFAULT_SEGMENT_LOADS;
 };
@@ -9,6 +9,7 @@
 
 #include <array>
 
+#include "common/timing.h"
 #include "system/hardware/hw.h"
 #include "selfdrive/ui/qt/api.h"
 #include "tools/replay/replay.h"
@@ -83,9 +84,9 @@ void Route::addFileToSegment(int n, const QString &file) {
   const int pos = name.lastIndexOf("--");
   name = pos != -1 ? name.mid(pos + 2) : name;
 
-  if (name == "rlog.bz2" || name == "rlog") {
+  if (name == "rlog.bz2" || name == "rlog.zst" || name == "rlog") {
     segments_[n].rlog = file;
-  } else if (name == "qlog.bz2" || name == "qlog") {
+  } else if (name == "qlog.bz2" || name == "qlog.zst" || name == "qlog") {
     segments_[n].qlog = file;
   } else if (name == "fcamera.hevc") {
     segments_[n].road_cam = file;
@@ -102,7 +103,7 @@ void Route::addFileToSegment(int n, const QString &file) {
 
 Segment::Segment(int n, const SegmentFile &files, uint32_t flags,
                  const std::set<cereal::Event::Which> &allow)
-    : seg_num(n), flags(flags), allow(allow) {
+    : seg_num(n), start_ms_(millis_since_boot()), flags(flags), allow(allow) {
   // [RoadCam, DriverCam, WideRoadCam, log]. fallback to qcamera/qlog
   const std::array file_list = {
       (flags & REPLAY_FLAG_QCAMERA) || files.road_cam.isEmpty() ? files.qcamera : files.road_cam,
@@ -125,11 +126,16 @@ Segment::~Segment() {
   synchronizer_.waitForFinished();
 }
 
+LoadTimings Segment::timings() const {
+  std::lock_guard lk(timings_lock_);
+  return timings_;
+}
+
 void Segment::loadFile(int id, const std::string file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
   bool success = false;
   if (id < MAX_CAMERAS) {
-    frames[id] = std::make_unique<FrameReader>();
+    frames[id] = std::make_unique<FrameReader>(id);
     success = frames[id]->load(file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache, 20 * 1024 * 1024, 3);
   } else {
     log = std::make_unique<LogReader>();
@@ -140,8 +146,13 @@ void Segment::loadFile(int id, const std::string file) {
     // abort all loading jobs.
     abort_ = true;
   }
+  {
+    std::lock_guard lk(timings_lock_);
+    timings_ += id < MAX_CAMERAS ? frames[id]->timings : log->timings;
+  }
 
   if (--loading_ == 0) {
+    load_ms_ = millis_since_boot() - start_ms_;
     emit loadFinished(!abort_);
   }
 }
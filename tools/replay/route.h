@@ -53,6 +53,10 @@ public:
   Segment(int n, const SegmentFile &files, uint32_t flags, const std::set<cereal::Event::Which> &allow = {});
   ~Segment();
   inline bool isLoaded() const { return !loading_ && !abort_; }
+  inline bool isLoading() const { return loading_ > 0; }
+  // stage timings summed over the segment's files, which are loaded in parallel
+  LoadTimings timings() const;
+  inline double loadMilliseconds() const { return load_ms_; }
 
   const int seg_num = 0;
   std::unique_ptr<LogReader> log;
@@ -67,6 +71,10 @@ protected:
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
   QFutureSynchronizer<void> synchronizer_;
+  mutable std::mutex timings_lock_;
+  LoadTimings timings_;
+  const double start_ms_;
+  std::atomic<double> load_ms_ = 0;
   uint32_t flags;
   std::set<cereal::Event::Which> allow;
 };
@@ -0,0 +1,62 @@
+#include <zstd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "common/timing.h"
+#include "tools/replay/filereader.h"
+#include "tools/replay/util.h"
+
+// compares decompression throughput of rlogs for different worker counts.
+// usage: decompress_benchmark [rlog.bz2]
+
+const std::string DEFAULT_RLOG_URL = "https://commadataci.blob.core.windows.net/openpilotci/0c94aa1e1296d7c6/2021-05-05--19-48-37/0/rlog.bz2";
+const size_t ZST_FRAME_SIZE = 4 * 1024 * 1024;
+const int RUNS = 3;
+
+// compress in independent frames, the same layout pzstd produces
+std::string compressZST(const std::string &in) {
+  std::string out;
+  for (size_t pos = 0; pos < in.size(); pos += ZST_FRAME_SIZE) {
+    const size_t size = std::min(ZST_FRAME_SIZE, in.size() - pos);
+    std::string frame(ZSTD_compressBound(size), '\0');
+    frame.resize(ZSTD_compress(frame.data(), frame.size(), in.data() + pos, size, 10));
+    out += frame;
+  }
+  return out;
+}
+
+template <class F>
+void benchmark(const char *name, const std::string &compressed, size_t expected_size, F decompress) {
+  for (int threads : {1, 2, 4, 8}) {
+    double total_ms = 0;
+    for (int i = 0; i < RUNS; ++i) {
+      double start = millis_since_boot();
+      std::string out = decompress(compressed, threads);
+      total_ms += millis_since_boot() - start;
+      if (out.size() != expected_size) {
+        printf("%s: unexpected output size %zu with %d threads\n", name, out.size(), threads);
+        return;
+      }
+    }
+    double ms = total_ms / RUNS;
+    printf("%s %d threads: %8.2f ms %8.2f MB/s\n", name, threads, ms, (expected_size / (1024.0 * 1024.0)) / (ms / 1000.0));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const std::string file = argc > 1 ? argv[1] : DEFAULT_RLOG_URL;
+  std::string bz2 = FileReader(true).read(file);
+  if (bz2.empty()) {
+    printf("failed to read %s\n", file.c_str());
+    return 1;
+  }
+
+  const std::string raw = decompressBZ2(bz2);
+  const std::string zst = compressZST(raw);
+  printf("%s: %s compressed, %s decompressed\n", file.c_str(), formattedDataSize(bz2.size()).c_str(), formattedDataSize(raw.size()).c_str());
+
+  benchmark("bz2", bz2, raw.size(), [](auto &in, int threads) { return decompressBZ2(in, nullptr, threads); });
+  benchmark("zst", zst, raw.size(), [](auto &in, int threads) { return decompressZST(in, nullptr, threads); });
+  return 0;
+}
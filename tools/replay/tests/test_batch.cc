@@ -0,0 +1,68 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "common/util.h"
+#include "tools/replay/batch.h"
+#include "tools/replay/util.h"
+
+const std::string TEST_RLOG_URL = "https://commadataci.blob.core.windows.net/openpilotci/0c94aa1e1296d7c6/2021-05-05--19-48-37/0/rlog.bz2";
+const std::string TEST_ROUTE = "0c94aa1e1296d7c6|2021-05-05--19-48-37";
+
+TEST_CASE("BatchReplay") {
+  const std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+  LogReader log;
+  REQUIRE(log.load((std::byte *)content.data(), content.size()));
+  const size_t log_events = log.events.size();
+
+  // the same log as two segments, so that all events of the second segment tie with the first one
+  char tmp[] = "/tmp/batch_XXXXXX";
+  const std::string data_dir = mkdtemp(tmp);
+  std::vector<std::string> files;
+  for (int n : {0, 1}) {
+    const std::string dir = data_dir + "/2021-05-05--19-48-37--" + std::to_string(n);
+    REQUIRE(util::create_directories(dir, 0755));
+    files.push_back(dir + "/rlog");
+    REQUIRE(util::write_file(files.back().c_str(), content.data(), content.size(), O_WRONLY | O_CREAT) == 0);
+  }
+
+  BatchRoute route;
+  REQUIRE(findLocalRoute(TEST_ROUTE, data_dir, route));
+  REQUIRE(route.name == TEST_ROUTE);
+  REQUIRE(route.segments.size() == 2);
+
+  const std::vector<BatchRoute> routes(8, route);
+  std::vector<std::vector<std::pair<uint64_t, cereal::Event::Which>>> events(routes.size());
+  std::vector<int> finished(routes.size(), 0);
+
+  BatchOptions opts;
+  opts.threads = 4;
+  opts.local_cache = false;
+  BatchReplay batch(opts);
+  BatchStats stats = batch.run(routes, [&](const BatchContext &ctx, const Event *e) {
+    events[ctx.route_index].push_back({e->mono_time, e->which});
+  }, [&](const BatchContext &ctx, bool success) {
+    finished[ctx.route_index] += success ? 1 : 100;
+  });
+
+  // the initData of the second segment is skipped
+  const size_t expected = log_events * 2 - 1;
+  REQUIRE(stats.routes == routes.size());
+  REQUIRE(stats.failed_routes == 0);
+  REQUIRE(stats.segments == routes.size() * 2);
+  REQUIRE(stats.events == routes.size() * expected);
+  for (size_t i = 0; i < routes.size(); ++i) {
+    REQUIRE(finished[i] == 1);
+    REQUIRE(events[i].size() == expected);
+    REQUIRE(std::is_sorted(events[i].begin(), events[i].end()));
+  }
+
+  for (auto &f : files) unlink(f.c_str());
+  for (int n : {0, 1}) rmdir((data_dir + "/2021-05-05--19-48-37--" + std::to_string(n)).c_str());
+  rmdir(data_dir.c_str());
+}
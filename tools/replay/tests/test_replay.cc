@@ -1,10 +1,14 @@
+#include <sys/stat.h>
+
 #include <chrono>
+#include <deque>
 #include <thread>
 
 #include <QDebug>
 #include <QEventLoop>
 
 #include "catch2/catch.hpp"
+#include "common/timing.h"
 #include "common/util.h"
 #include "tools/replay/replay.h"
 #include "tools/replay/util.h"
@@ -65,6 +69,124 @@ TEST_CASE("FileReader") {
   }
 }
 
+TEST_CASE("RangeCache") {
+  std::string cache_file = cacheFilePath(TEST_RLOG_URL);
+  system(("rm -rf " + cache_file + " " + cache_file + ".parts").c_str());
+
+  // an aborted download keeps the ranges that have arrived
+  std::atomic<bool> abort = false;
+  size_t received = 0;
+  FileReader reader(true);
+  REQUIRE_FALSE(reader.read(TEST_RLOG_URL, [&](const char *data, size_t size) {
+    received += size;
+    abort = received >= DOWNLOAD_RANGE_SIZE;
+    return true;
+  }, &abort));
+  REQUIRE(reader.size() > DOWNLOAD_RANGE_SIZE);
+  REQUIRE(util::file_exists(cache_file + ".parts/0"));
+  REQUIRE_FALSE(util::file_exists(cache_file));
+
+  // concurrent readers resume from them and share the missing ranges
+  std::vector<std::thread> threads;
+  std::vector<std::string> contents(3);
+  for (auto &content : contents) {
+    threads.emplace_back([&content]() { content = FileReader(true).read(TEST_RLOG_URL); });
+  }
+  for (auto &t : threads) t.join();
+  for (auto &content : contents) {
+    REQUIRE(sha256(content) == TEST_RLOG_CHECKSUM);
+  }
+  REQUIRE(sha256(util::read_file(cache_file)) == TEST_RLOG_CHECKSUM);
+  REQUIRE_FALSE(util::file_exists(cache_file + ".parts"));
+}
+
+TEST_CASE("decompressBZ2") {
+  std::string content = FileReader(true).read(TEST_RLOG_URL);
+  std::string expected = decompressBZ2(content);
+  REQUIRE(!expected.empty());
+  REQUIRE(decompressBZ2(content, nullptr, GENERATE(2, 4, 8)) == expected);
+
+  // concatenated streams
+  REQUIRE(decompressBZ2(content + content, nullptr, GENERATE(1, 4)) == expected + expected);
+
+  SECTION("streamed") {
+    // concatenated streams in the pieces of a download, the second stream can start in the middle of a piece
+    const std::string input = content + content;
+    const size_t piece_size = GENERATE(1000, 64 * 1024);
+    BZ2Stream bz2;
+    std::string out;
+    std::vector<char> buf(256 * 1024);
+    for (size_t pos = 0; pos < input.size(); pos += piece_size) {
+      const char *in = input.data() + pos;
+      size_t in_size = std::min(piece_size, input.size() - pos);
+      while (true) {
+        ssize_t written = bz2.decompress(in, in_size, buf.data(), buf.size());
+        REQUIRE(written >= 0);
+        if (written == 0 && in_size == 0) break;
+        out.append(buf.data(), written);
+      }
+      // the first stream is complete, but the input doesn't end there
+      if (pos + piece_size > content.size() && pos + piece_size < input.size()) {
+        REQUIRE_FALSE(bz2.finished());
+      }
+    }
+    REQUIRE(bz2.finished());
+    REQUIRE(out == expected + expected);
+  }
+}
+
+class TestCameraServer : public CameraServer {
+public:
+  TestCameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) : CameraServer(camera_size) {}
+  void push(int frames) { publishing_ += frames; }
+  using CameraServer::frameSent;
+};
+
+TEST_CASE("CameraServer") {
+  SECTION("frame latency percentile") {
+    LatencyHistogram latency;
+    REQUIRE(latency.count() == 0);
+    // 0 ms ... 99 ms, reported at the top of their 0.5 ms bucket
+    for (int i = 0; i < 100; ++i) {
+      latency.add(i);
+    }
+    REQUIRE(latency.count() == 100);
+    REQUIRE(latency.percentile(0.5) == 49.5);
+    REQUIRE(latency.percentile(0.9) == 89.5);
+    REQUIRE(latency.percentile(0.99) == 98.5);
+    REQUIRE(latency.percentile(1.0) == 99.5);
+
+    // out of range latencies go to the first and the last bucket
+    LatencyHistogram outliers;
+    outliers.add(-1);
+    outliers.add(1000);
+    REQUIRE(outliers.percentile(0.5) == 0.5);
+    REQUIRE(outliers.percentile(1.0) == 200);
+  }
+
+  SECTION("waitForSent") {
+    std::pair<int, int> camera_size[MAX_CAMERAS] = {};
+    TestCameraServer server(camera_size);
+    // nothing in flight
+    server.waitForSent();
+
+    // the waiter sleeps until the camera threads sent the last frame
+    server.push(2);
+    std::thread camera_thread([&]() {
+      for (int i = 0; i < 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        server.frameSent();
+      }
+    });
+    double start_ms = millis_since_boot();
+    server.waitForSent();
+    double waited_ms = millis_since_boot() - start_ms;
+    camera_thread.join();
+    REQUIRE(waited_ms >= 90);
+    REQUIRE(waited_ms < 1000);
+  }
+}
+
 TEST_CASE("LogReader") {
   SECTION("corrupt log") {
     FileReader reader(true);
@@ -75,6 +197,142 @@ TEST_CASE("LogReader") {
     REQUIRE(log.load((std::byte *)corrupt_content.data(), corrupt_content.size()));
     REQUIRE(log.events.size() > 0);
   }
+  SECTION("mmap local log") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    char filename[] = "/tmp/rlog_XXXXXX";
+    close(mkstemp(filename));
+    REQUIRE(util::write_file(filename, content.data(), content.size()) == 0);
+
+    LogReader buffer_log, mapped_log;
+    REQUIRE(buffer_log.load((std::byte *)content.data(), content.size()));
+    REQUIRE(mapped_log.load(filename));
+    REQUIRE(mapped_log.events.size() == buffer_log.events.size());
+    for (int i = 0; i < mapped_log.events.size(); ++i) {
+      REQUIRE(mapped_log.events[i]->mono_time == buffer_log.events[i]->mono_time);
+      REQUIRE(mapped_log.events[i]->which == buffer_log.events[i]->which);
+    }
+    unlink(filename);
+  }
+  SECTION("event index") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    char filename[] = "/tmp/rlog_XXXXXX";
+    close(mkstemp(filename));
+    REQUIRE(util::write_file(filename, content.data(), content.size()) == 0);
+    unlink(indexFilePath(filename).c_str());
+
+    LogReader full_log;
+    REQUIRE(full_log.load(filename));
+    EventIndex index;
+    REQUIRE(index.load(indexFilePath(filename), filename));
+
+    // a valid index is not rewritten
+    struct stat st = {}, st_reload = {};
+    REQUIRE(stat(indexFilePath(filename).c_str(), &st) == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    LogReader reloaded_log;
+    REQUIRE(reloaded_log.load(filename));
+    REQUIRE(reloaded_log.events.size() == full_log.events.size());
+    REQUIRE(stat(indexFilePath(filename).c_str(), &st_reload) == 0);
+    REQUIRE(st_reload.st_mtim.tv_sec == st.st_mtim.tv_sec);
+    REQUIRE(st_reload.st_mtim.tv_nsec == st.st_mtim.tv_nsec);
+    REQUIRE(EventIndex::isValid(indexFilePath(filename), filename));
+
+    const std::set<cereal::Event::Which> allow = {cereal::Event::Which::CAN, cereal::Event::Which::CONTROLS_STATE};
+    LogReader indexed_log;
+    REQUIRE(indexed_log.load(filename, nullptr, allow));
+    auto expected = std::count_if(full_log.events.begin(), full_log.events.end(), [&](auto e) { return allow.count(e->which); });
+    REQUIRE(indexed_log.events.size() == expected);
+    REQUIRE(index.offsets(allow).size() == expected);
+
+    // a log rewritten with the same size within the same second is not covered by the index anymore
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(util::write_file(filename, content.data(), content.size()) == 0);
+    REQUIRE_FALSE(EventIndex::isValid(indexFilePath(filename), filename));
+    REQUIRE_FALSE(EventIndex().load(indexFilePath(filename), filename));
+    unlink(indexFilePath(filename).c_str());
+    unlink(filename);
+  }
+  SECTION("stream bz2 log") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    LogReader buffer_log, stream_log;
+    REQUIRE(buffer_log.load((std::byte *)content.data(), content.size()));
+    REQUIRE(stream_log.load(TEST_RLOG_URL, nullptr, {}, GENERATE(true, false), 0, 3));
+    REQUIRE(stream_log.events.size() == buffer_log.events.size());
+    REQUIRE(std::equal(stream_log.events.begin(), stream_log.events.end(), buffer_log.events.begin(), [](auto l, auto r) {
+      return l->bytes() == r->bytes();
+    }));
+  }
+}
+
+// the timeline as Replay::buildTimeline() used to build it, straight from the controlsState and userFlag events
+std::vector<Timeline::Entry> inline_timeline(const std::vector<Event *> &events, uint64_t route_start_ts) {
+  const TimelineType timeline_types[] = {
+    [(int)cereal::ControlsState::AlertStatus::NORMAL] = TimelineType::AlertInfo,
+    [(int)cereal::ControlsState::AlertStatus::USER_PROMPT] = TimelineType::AlertWarning,
+    [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
+  };
+  auto to_seconds = [=](uint64_t mono_time) -> int { return (mono_time - route_start_ts) / 1e9; };
+
+  std::vector<Timeline::Entry> timeline;
+  uint64_t engaged_begin = 0;
+  bool engaged = false;
+  auto alert_status = cereal::ControlsState::AlertStatus::NORMAL;
+  auto alert_size = cereal::ControlsState::AlertSize::NONE;
+  uint64_t alert_begin = 0;
+  std::string alert_type;
+  for (const Event *e : events) {
+    if (e->which == cereal::Event::Which::CONTROLS_STATE) {
+      auto cs = e->event.getControlsState();
+      if (engaged != cs.getEnabled()) {
+        if (engaged) {
+          timeline.push_back({to_seconds(engaged_begin), to_seconds(e->mono_time), TimelineType::Engaged});
+        }
+        engaged_begin = e->mono_time;
+        engaged = cs.getEnabled();
+      }
+      if (alert_type != cs.getAlertType().cStr() || alert_status != cs.getAlertStatus()) {
+        if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
+          timeline.push_back({to_seconds(alert_begin), to_seconds(e->mono_time), timeline_types[(int)alert_status]});
+        }
+        alert_begin = e->mono_time;
+        alert_type = cs.getAlertType().cStr();
+        alert_size = cs.getAlertSize();
+        alert_status = cs.getAlertStatus();
+      }
+    } else if (e->which == cereal::Event::Which::USER_FLAG) {
+      timeline.push_back({to_seconds(e->mono_time), to_seconds(e->mono_time), TimelineType::UserFlag});
+    }
+  }
+  return timeline;
+}
+
+TEST_CASE("Timeline") {
+  LogReader log;
+  REQUIRE(log.load(TEST_RLOG_URL, nullptr, {}, true, 0, 3));
+  const uint64_t route_start_ts = log.events.front()->mono_time;
+  const auto expected = inline_timeline(log.events, route_start_ts);
+  const std::string route = "0000000000000000|timeline_" + util::random_string(8);
+  const std::string file = timelineFilePath(route);
+
+  Timeline timeline;
+  timeline.build(route, {{0, TEST_RLOG_URL}}, route_start_ts, true, nullptr);
+  REQUIRE(timeline.get() == expected);
+  REQUIRE(util::file_exists(file));
+
+  // reopening the route reads the changes from the file, an aborted scan would leave the timeline empty
+  std::atomic<bool> abort = true;
+  Timeline cached;
+  cached.build(route, {{0, TEST_RLOG_URL}}, route_start_ts, true, &abort);
+  REQUIRE(cached.get() == expected);
+
+  // a segment whose qlog has changed is dropped from the file and scanned again
+  Timeline changed;
+  changed.build(route, {{0, "/tmp/timeline_missing_qlog.bz2"}}, route_start_ts, true, nullptr);
+  REQUIRE(changed.get().empty());
+  Timeline dropped;
+  dropped.build(route, {{0, TEST_RLOG_URL}}, route_start_ts, true, &abort);
+  REQUIRE(dropped.get().empty());
+  unlink(file.c_str());
 }
 
 void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
@@ -102,11 +360,22 @@ void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
       if (cam == RoadCam || cam == WideRoadCam) {
         REQUIRE(fr->getFrameCount() == 1200);
       }
-      std::unique_ptr<uint8_t[]> yuv_buf = std::make_unique<uint8_t[]>(fr->getYUVSize());
+      const size_t size = fr->getYUVSize();
+      std::vector<std::unique_ptr<uint8_t[]>> frames;
       // sequence get 100 frames
       for (int i = 0; i < 100; ++i) {
+        frames.push_back(std::make_unique<uint8_t[]>(size));
+        REQUIRE(fr->get(i, frames.back().get()));
+      }
+      // backward gets are served from the frame cache and match the decoded frames
+      auto yuv_buf = std::make_unique<uint8_t[]>(size);
+      const uint64_t hits = FrameReader::cacheStats().hits;
+      for (int i = 99; i >= 0; --i) {
         REQUIRE(fr->get(i, yuv_buf.get()));
+        REQUIRE(memcmp(yuv_buf.get(), frames[i].get(), size) == 0);
       }
+      REQUIRE(FrameReader::cacheStats().hits > hits);
+      REQUIRE(FrameReader::decodeStats(cam).frames >= 100);
     }
 
     loop.quit();
@@ -114,6 +383,61 @@ void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
   loop.exec();
 }
 
+TEST_CASE("MergedEvents") {
+  // segments overlap by a few events at the boundaries, like logs rotated while messages were in flight
+  std::deque<Event> storage;
+  std::vector<Event *> segments[3];
+  for (int n = 0; n < 3; ++n) {
+    segments[n].push_back(&storage.emplace_back(cereal::Event::Which::INIT_DATA, n * 1000));
+    for (int i = 0; i < 100; ++i) {
+      auto which = i % 2 ? cereal::Event::Which::CAN : cereal::Event::Which::CAR_STATE;
+      segments[n].push_back(&storage.emplace_back(which, n * 1000 + 1 + i * 11));
+    }
+    std::sort(segments[n].begin(), segments[n].end(), Event::lessThan());
+  }
+
+  auto expected = [&](const std::vector<int> &merged) {
+    std::vector<Event *> events;
+    for (int n : merged) {
+      auto &e = segments[n];
+      auto middle = events.insert(events.end(), e.begin() + (events.empty() ? 0 : 1), e.end());
+      std::inplace_merge(events.begin(), middle, events.end(), Event::lessThan());
+    }
+    return events;
+  };
+  auto require_equal = [](const MergedEvents &view, const std::vector<Event *> &events) {
+    REQUIRE(view.size() == events.size());
+    REQUIRE(std::equal(view.begin(), view.end(), events.begin(), events.end(), [](auto l, auto r) {
+      return l->mono_time == r->mono_time && l->which == r->which;
+    }));
+    REQUIRE(view.back()->mono_time == events.back()->mono_time);
+  };
+
+  MergedEvents view;
+  REQUIRE(view.empty());
+  REQUIRE(view.begin() == view.end());
+  view.add(1, &segments[1]);
+  require_equal(view, expected({1}));
+  view.add(0, &segments[0]);
+  view.add(2, &segments[2]);
+  const auto all = expected({0, 1, 2});
+  require_equal(view, all);
+  REQUIRE(std::is_sorted(view.begin(), view.end(), Event::lessThan()));
+
+  for (uint64_t t : {0, 500, 1000, 1050, 2088, 5000}) {
+    Event e(cereal::Event::Which::INIT_DATA, t);
+    auto it = view.upper_bound(&e);
+    auto expected_it = std::upper_bound(all.begin(), all.end(), &e, Event::lessThan());
+    REQUIRE(std::distance(it, view.end()) == std::distance(expected_it, all.end()));
+  }
+
+  // segment 1 now provides the initData
+  view.remove(0);
+  require_equal(view, expected({1, 2}));
+  view.remove(2);
+  require_equal(view, expected({1}));
+}
+
 TEST_CASE("Route") {
   // Create a local route from remote for testing
   Route remote_route(DEMO_ROUTE);
@@ -154,9 +478,11 @@ TEST_CASE("Route") {
 // helper class for unit tests
 class TestReplay : public Replay {
  public:
-  TestReplay(const QString &route, uint8_t flags = REPLAY_FLAG_NO_FILE_CACHE) : Replay(route, {}, {}, {}, nullptr, flags) {}
+  TestReplay(const QString &route, uint8_t flags = REPLAY_FLAG_NO_FILE_CACHE, const QStringList &allow = {})
+      : Replay(route, allow, {}, {}, nullptr, flags) {}
   void test_seek();
   void testSeekTo(int seek_to);
+  void test_lockstep();
 };
 
 void TestReplay::testSeekTo(int seek_to) {
@@ -172,7 +498,7 @@ void TestReplay::testSeekTo(int seek_to) {
     }
 
     Event cur_event(cereal::Event::Which::INIT_DATA, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
+    auto eit = events_->upper_bound(&cur_event);
     if (eit == events_->end()) {
       qDebug() << "waiting for events...";
       continue;
@@ -211,3 +537,66 @@ TEST_CASE("Replay") {
   REQUIRE(replay.load());
   replay.test_seek();
 }
+
+void TestReplay::test_lockstep() {
+  // carState events 1ms apart, each one acked by a consumer that takes 50ms
+  const int event_cnt = 10, consumer_ms = 50;
+  std::vector<kj::Array<capnp::word>> msgs;
+  std::deque<Event> storage;
+  std::vector<Event *> events;
+  for (int i = 0; i < event_cnt; ++i) {
+    MessageBuilder msg;
+    auto evt = msg.initEvent();
+    evt.setLogMonoTime(1e9 + i * 1e6);
+    evt.initCarState().setVEgo(i);
+    msgs.push_back(capnp::messageToFlatArray(msg));
+    events.push_back(&storage.emplace_back(msgs.back().asPtr()));
+  }
+  REQUIRE(setLockstep({{"carState", {"controlsState"}}}));
+
+  std::unique_ptr<Context> ctx(Context::create());
+  std::unique_ptr<SubSocket> sock(SubSocket::create(ctx.get(), "carState"));
+  sock->setTimeout(LOCKSTEP_TIMEOUT_MS * 2);
+  PubMaster ack_pm({"controlsState"});
+  std::vector<double> arrivals;
+  std::thread consumer([&]() {
+    while (arrivals.size() < event_cnt) {
+      std::unique_ptr<Message> msg(sock->receive());
+      if (!msg) break;
+      arrivals.push_back(millis_since_boot());
+      std::this_thread::sleep_for(std::chrono::milliseconds(consumer_ms));
+      MessageBuilder ack;
+      ack.initEvent().initControlsState();
+      ack_pm.send("controlsState", ack);
+    }
+  });
+
+  std::thread stream_thread(&TestReplay::stream, this);
+  {
+    std::lock_guard lk(stream_lock_);
+    events_->add(0, &events);
+    cur_mono_time_ = events[0]->mono_time - 1;
+    events_updated_ = true;
+  }
+  stream_cv_.notify_one();
+  consumer.join();
+  {
+    std::lock_guard lk(stream_lock_);
+    exit_ = true;
+  }
+  stream_cv_.notify_one();
+  stream_thread.join();
+
+  // the next event is only published once the previous one has been acked
+  REQUIRE(arrivals.size() == event_cnt);
+  for (int i = 1; i < arrivals.size(); ++i) {
+    INFO("event " << i);
+    REQUIRE(arrivals[i] - arrivals[i - 1] >= consumer_ms);
+  }
+  REQUIRE(lockstepTimeouts() == 0);
+}
+
+TEST_CASE("Lockstep") {
+  TestReplay replay(DEMO_ROUTE, REPLAY_FLAG_NO_FILE_CACHE | REPLAY_FLAG_NO_LOOP, {"carState"});
+  replay.test_lockstep();
+}
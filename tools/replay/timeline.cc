@@ -0,0 +1,231 @@
+#include "tools/replay/timeline.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <thread>
+
+#include "common/util.h"
+#include "tools/replay/filereader.h"
+#include "tools/replay/logreader.h"
+#include "tools/replay/util.h"
+
+namespace {
+
+const char TIMELINE_MAGIC[4] = {'T', 'M', 'L', 'N'};
+const uint32_t TIMELINE_VERSION = 1;
+
+struct TimelineHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_segments;
+} __attribute__((packed));
+
+struct SegmentHeader {
+  int32_t seg_num;
+  uint64_t source;
+  uint32_t count;
+} __attribute__((packed));
+
+// FNV-1a, stable across runs unlike std::hash
+uint64_t hash(const std::string &str) {
+  if (str.empty()) return 0;
+
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : str) {
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+}  // namespace
+
+std::string timelineFilePath(const std::string &route) {
+  return cacheFilePath(route) + ".timeline";
+}
+
+void Timeline::build(const std::string &route, const std::map<int, std::string> &qlogs, uint64_t route_start_ts,
+                     bool local_cache, std::atomic<bool> *abort) {
+  const std::string file = timelineFilePath(route);
+  std::vector<std::pair<int, uint64_t>> missing;
+  {
+    std::lock_guard lk(lock_);
+    if (local_cache) load(file);
+    // drop the segments of other files, e.g. the route was opened from a local directory before
+    for (auto it = segments_.begin(); it != segments_.end();) {
+      auto q = qlogs.find(it->first);
+      it = q == qlogs.end() || it->second.source != hash(getUrlWithoutQuery(q->second)) ? segments_.erase(it) : std::next(it);
+    }
+    for (const auto &[n, qlog] : qlogs) {
+      if (!qlog.empty() && segments_.find(n) == segments_.end()) {
+        missing.push_back({n, hash(getUrlWithoutQuery(qlog))});
+      }
+    }
+  }
+  update(route_start_ts);
+  if (missing.empty()) return;
+
+  static const int threads = std::clamp<int>(std::thread::hardware_concurrency(), 1, 8);
+  std::atomic<size_t> next = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < missing.size() && !(abort && *abort); i = next++) {
+      Segment segment = {.source = missing[i].second};
+      if (scan(qlogs.at(missing[i].first), local_cache, abort, segment)) {
+        {
+          std::lock_guard lk(lock_);
+          segments_[missing[i].first] = std::move(segment);
+        }
+        update(route_start_ts);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < std::min<int>(threads, missing.size()); ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : workers) t.join();
+
+  if (local_cache) {
+    std::lock_guard lk(lock_);
+    save(file);
+  }
+}
+
+std::vector<Timeline::Entry> Timeline::get() const {
+  std::lock_guard lk(lock_);
+  return entries_;
+}
+
+bool Timeline::scan(const std::string &qlog, bool local_cache, std::atomic<bool> *abort, Segment &segment) const {
+  LogReader log;
+  if (!log.load(qlog, abort, {cereal::Event::Which::CONTROLS_STATE, cereal::Event::Which::USER_FLAG}, local_cache, 0, 3) ||
+      (abort && *abort)) {
+    return false;
+  }
+
+  // only the first controlsState and the ones that change what the timeline shows are kept
+  std::optional<TimelineChange> prev;
+  for (const Event *e : log.events) {
+    if (e->which == cereal::Event::Which::CONTROLS_STATE) {
+      auto cs = e->event.getControlsState();
+      TimelineChange c = {
+        .mono_time = e->mono_time,
+        .alert_type = hash(cs.getAlertType().cStr()),
+        .user_flag = 0,
+        .enabled = cs.getEnabled(),
+        .alert_status = (uint8_t)cs.getAlertStatus(),
+        .alert_size = (uint8_t)cs.getAlertSize(),
+      };
+      if (!prev || prev->enabled != c.enabled || prev->alert_type != c.alert_type || prev->alert_status != c.alert_status) {
+        segment.changes.push_back(c);
+        prev = c;
+      }
+    } else if (e->which == cereal::Event::Which::USER_FLAG) {
+      segment.changes.push_back({.mono_time = e->mono_time, .alert_type = 0, .user_flag = 1});
+    }
+  }
+  return true;
+}
+
+void Timeline::update(uint64_t route_start_ts) {
+  const TimelineType timeline_types[] = {
+    [(int)cereal::ControlsState::AlertStatus::NORMAL] = TimelineType::AlertInfo,
+    [(int)cereal::ControlsState::AlertStatus::USER_PROMPT] = TimelineType::AlertWarning,
+    [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
+  };
+  auto to_seconds = [=](uint64_t mono_time) -> int { return (mono_time - route_start_ts) / 1e9; };
+
+  std::lock_guard lk(lock_);
+  std::vector<Entry> entries;
+  bool engaged = false;
+  uint64_t engaged_begin = 0;
+  uint64_t alert_type = 0, alert_begin = 0;
+  uint8_t alert_status = (uint8_t)cereal::ControlsState::AlertStatus::NORMAL;
+  uint8_t alert_size = (uint8_t)cereal::ControlsState::AlertSize::NONE;
+  for (const auto &[n, segment] : segments_) {
+    for (const auto &c : segment.changes) {
+      if (c.user_flag) {
+        entries.push_back({to_seconds(c.mono_time), to_seconds(c.mono_time), TimelineType::UserFlag});
+        continue;
+      }
+
+      if (engaged != (bool)c.enabled) {
+        if (engaged) {
+          entries.push_back({to_seconds(engaged_begin), to_seconds(c.mono_time), TimelineType::Engaged});
+        }
+        engaged_begin = c.mono_time;
+        engaged = c.enabled;
+      }
+
+      if (alert_type != c.alert_type || alert_status != c.alert_status) {
+        if (alert_type != 0 && alert_size != (uint8_t)cereal::ControlsState::AlertSize::NONE) {
+          entries.push_back({to_seconds(alert_begin), to_seconds(c.mono_time), timeline_types[alert_status]});
+        }
+        alert_begin = c.mono_time;
+        alert_type = c.alert_type;
+        alert_size = c.alert_size;
+        alert_status = c.alert_status;
+      }
+    }
+  }
+  entries_ = std::move(entries);
+}
+
+bool Timeline::load(const std::string &file) {
+  if (!util::file_exists(file)) return false;
+
+  const std::string data = util::read_file(file);
+  const char *p = data.data(), *end = data.data() + data.size();
+  TimelineHeader header = {};
+  if (data.size() < sizeof(header)) return false;
+
+  memcpy(&header, p, sizeof(header));
+  p += sizeof(header);
+  if (memcmp(header.magic, TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC)) != 0 || header.version != TIMELINE_VERSION) {
+    return false;
+  }
+
+  std::map<int, Segment> segments;
+  for (uint32_t i = 0; i < header.num_segments; ++i) {
+    SegmentHeader sh = {};
+    if ((size_t)(end - p) < sizeof(sh)) return false;
+    memcpy(&sh, p, sizeof(sh));
+    p += sizeof(sh);
+
+    const size_t bytes = sh.count * sizeof(TimelineChange);
+    if ((size_t)(end - p) < bytes) return false;
+    auto &s = segments[sh.seg_num];
+    s.source = sh.source;
+    s.changes.resize(sh.count);
+    memcpy(s.changes.data(), p, bytes);
+    p += bytes;
+  }
+  segments_ = std::move(segments);
+  return true;
+}
+
+bool Timeline::save(const std::string &file) const {
+  TimelineHeader header = {.version = TIMELINE_VERSION, .num_segments = (uint32_t)segments_.size()};
+  memcpy(header.magic, TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC));
+
+  // write to a temporary file and rename it, readers never see a partial timeline
+  const std::string tmp_file = file + "." + util::random_string(8) + ".tmp";
+  std::ofstream fs(tmp_file, std::ios::binary | std::ios::out);
+  fs.write((const char *)&header, sizeof(header));
+  for (const auto &[n, s] : segments_) {
+    SegmentHeader sh = {.seg_num = n, .source = s.source, .count = (uint32_t)s.changes.size()};
+    fs.write((const char *)&sh, sizeof(sh));
+    fs.write((const char *)s.changes.data(), s.changes.size() * sizeof(TimelineChange));
+  }
+  fs.close();
+
+  if (!fs || rename(tmp_file.c_str(), file.c_str()) != 0) {
+    unlink(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
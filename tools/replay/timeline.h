@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+enum class TimelineType { None, Engaged, AlertInfo, AlertWarning, AlertCritical, UserFlag };
+
+// A change of the engaged or alert state, or a user flag, in the qlog of a segment.
+struct TimelineChange {
+  uint64_t mono_time;
+  uint64_t alert_type;  // hash of the alert type, 0 if there is no alert
+  uint8_t user_flag;
+  uint8_t enabled;
+  uint8_t alert_status;
+  uint8_t alert_size;
+} __attribute__((packed));
+
+// Engaged ranges, alert ranges and user flags of a route. The qlog of each segment is reduced to its
+// state changes, so segments are scanned in parallel and the ranges are rebuilt from the changes of all
+// segments in order. The changes are kept per route in the download cache, reopening a route only scans
+// the segments that aren't in the cache yet.
+class Timeline {
+public:
+  // begin and end in seconds since route start
+  typedef std::tuple<int, int, TimelineType> Entry;
+
+  // qlogs by segment number. the entries are updated each time a segment is scanned.
+  void build(const std::string &route, const std::map<int, std::string> &qlogs, uint64_t route_start_ts,
+             bool local_cache, std::atomic<bool> *abort);
+  std::vector<Entry> get() const;
+
+private:
+  struct Segment {
+    uint64_t source;  // hash of the qlog url the changes were read from
+    std::vector<TimelineChange> changes;
+  };
+  bool scan(const std::string &qlog, bool local_cache, std::atomic<bool> *abort, Segment &segment) const;
+  bool load(const std::string &file);
+  bool save(const std::string &file) const;
+  void update(uint64_t route_start_ts);
+
+  mutable std::mutex lock_;
+  std::map<int, Segment> segments_;
+  std::vector<Entry> entries_;
+};
+
+std::string timelineFilePath(const std::string &route);
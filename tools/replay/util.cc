@@ -3,7 +3,9 @@
 #include <bzlib.h>
 #include <curl/curl.h>
 #include <openssl/sha.h>
+#include <zstd.h>
 
+#include <cstdint>
 #include <cstring>
 #include <cassert>
 #include <cmath>
@@ -11,6 +13,7 @@
 #include <iostream>
 #include <mutex>
 #include <numeric>
+#include <thread>
 
 #include "common/timing.h"
 #include "common/util.h"
@@ -120,6 +123,8 @@ struct DownloadStats {
   double prev_tm = 0;
 };
 
+DownloadStats download_stats;
+
 } // namespace
 
 std::string formattedDataSize(size_t size) {
@@ -164,7 +169,6 @@ std::string getUrlWithoutQuery(const std::string &url) {
 
 template <class T>
 bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
-  static DownloadStats download_stats;
   download_stats.add(url, content_length);
 
   int parts = 1;
@@ -243,6 +247,82 @@ std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool>
   return httpDownload(url, result, chunk_size, size, abort) ? result : "";
 }
 
+// size == 0 requests the whole file
+static bool httpGetStream(const std::string &url, size_t offset, size_t size, const StreamDataHandler &handler, std::atomic<bool> *abort) {
+  struct StreamWriter {
+    const StreamDataHandler *handler;
+    size_t written;
+    std::string progress_key;
+    static size_t write(char *data, size_t size, size_t count, void *userp) {
+      auto w = (StreamWriter *)userp;
+      size_t bytes = size * count;
+      if (!(*w->handler)(data, bytes)) return 0;
+
+      w->written += bytes;
+      if (!w->progress_key.empty()) download_stats.update(w->progress_key, w->written);
+      return bytes;
+    }
+  } writer = {.handler = &handler, .written = 0};
+
+  CURL *eh = curl_easy_init();
+  if (!eh) return false;
+
+  curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, StreamWriter::write);
+  curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)&writer);
+  curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
+  curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
+  curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
+  if (size > 0) {
+    const std::string range = util::string_format("%zu-%zu", offset, offset + size - 1);
+    curl_easy_setopt(eh, CURLOPT_RANGE, range.c_str());
+    // ranges of the same file are downloaded in parallel, each one is a separate progress item
+    writer.progress_key = url + "#" + range;
+    download_stats.add(writer.progress_key, size);
+  }
+
+  CURLM *cm = curl_multi_init();
+  curl_multi_add_handle(cm, eh);
+  int still_running = 1;
+  while (still_running > 0 && !(abort && *abort)) {
+    curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
+    curl_multi_perform(cm, &still_running);
+  }
+
+  bool success = false;
+  CURLMsg *msg;
+  int msgs_left = -1;
+  while ((msg = curl_multi_info_read(cm, &msgs_left)) && !(abort && *abort)) {
+    if (msg->msg == CURLMSG_DONE) {
+      if (msg->data.result == CURLE_OK) {
+        long res_status = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
+        success = res_status == (size > 0 ? 206 : 200);
+        if (!success) rWarning("Download failed: http error code: %d", res_status);
+      } else if (msg->data.result != CURLE_WRITE_ERROR) {
+        rWarning("Download failed: connection failure: %d", msg->data.result);
+      }
+    }
+  }
+  if (!writer.progress_key.empty()) {
+    download_stats.update(writer.progress_key, writer.written, success);
+    download_stats.remove(writer.progress_key);
+  }
+
+  curl_multi_remove_handle(cm, eh);
+  curl_easy_cleanup(eh);
+  curl_multi_cleanup(cm);
+  return success && writer.written > 0;
+}
+
+bool httpGetStream(const std::string &url, const StreamDataHandler &handler, std::atomic<bool> *abort) {
+  return httpGetStream(url, 0, 0, handler, abort);
+}
+
+bool httpGetRange(const std::string &url, size_t offset, size_t size, const StreamDataHandler &handler, std::atomic<bool> *abort) {
+  return size > 0 && httpGetStream(url, offset, size, handler, abort);
+}
+
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
   size_t size = getRemoteFileSize(url, abort);
   if (size == 0) return false;
@@ -252,13 +332,175 @@ bool httpDownload(const std::string &url, const std::string &file, size_t chunk_
   return httpDownload(url, of, chunk_size, size, abort);
 }
 
-std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
-  return decompressBZ2((std::byte *)in.data(), in.size(), abort);
+namespace {
+
+// run f(0..n-1) on up to `threads` workers. stops handing out work once f returns false.
+template <class F>
+bool parallel_for(size_t n, int threads, std::atomic<bool> *abort, F f) {
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> failed = false;
+  auto worker = [&]() {
+    for (size_t i = next++; i < n && !failed && !(abort && *abort); i = next++) {
+      if (!f(i)) failed = true;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < std::min<int>(threads, n); ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : workers) t.join();
+  return !failed && !(abort && *abort);
 }
 
-std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
+const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359;
+const uint64_t BZ2_EOS_MAGIC = 0x177245385090;
+// largest content size per compressed byte that is trusted for the output allocation
+const size_t ZSTD_MAX_RATIO = 64;
+
+class BitWriter {
+public:
+  BitWriter(size_t reserve) { out.reserve(reserve); }
+  void put(uint64_t bits, int n) {
+    while (n-- > 0) {
+      acc = (acc << 1) | ((bits >> n) & 1);
+      if (++nacc == 8) {
+        out.push_back((char)acc);
+        acc = nacc = 0;
+      }
+    }
+  }
+  std::string finish() {
+    if (nacc > 0) out.push_back((char)(acc << (8 - nacc)));
+    return std::move(out);
+  }
+
+private:
+  std::string out;
+  uint8_t acc = 0;
+  int nacc = 0;
+};
+
+inline uint8_t byte_at_bit(const uint8_t *in, size_t bit) {
+  const size_t i = bit >> 3, sh = bit & 7;
+  return sh == 0 ? in[i] : (uint8_t)((in[i] << sh) | (in[i + 1] >> (8 - sh)));
+}
+
+// rewrap the block at [begin, end) bits as a standalone single-block bz2 stream.
+// the combined crc of a single-block stream is the block crc itself.
+std::string bz2_block_stream(const uint8_t *in, size_t begin, size_t end, uint8_t level) {
+  BitWriter w((end - begin) / 8 + 16);
+  w.put('B', 8), w.put('Z', 8), w.put('h', 8), w.put(level, 8);
+  size_t bit = begin;
+  for (; bit + 8 <= end; bit += 8) {
+    w.put(byte_at_bit(in, bit), 8);
+  }
+  if (bit < end) {
+    w.put(byte_at_bit(in, bit) >> (8 - (end - bit)), end - bit);
+  }
+  uint32_t crc = 0;
+  for (int i = 0; i < 4; ++i) {
+    crc = (crc << 8) | byte_at_bit(in, begin + 48 + i * 8);
+  }
+  w.put(BZ2_EOS_MAGIC, 48);
+  w.put(crc, 32);
+  return w.finish();
+}
+
+struct BZ2Block {
+  size_t begin, end;  // bit offsets
+  uint8_t level;
+};
+
+// bz2 blocks are not byte aligned, find them by their 48 bit magic. concatenated streams each start
+// on a byte boundary after the crc of the previous one. returns nothing if a stream is incomplete.
+std::vector<BZ2Block> find_bz2_blocks(const uint8_t *in, size_t in_size) {
+  std::vector<BZ2Block> blocks;
+  size_t stream = 0;
+  while (stream < in_size) {
+    if (in_size - stream < 4 || memcmp(in + stream, "BZh", 3) != 0) return {};
+
+    const uint8_t level = in[stream + 3];
+    uint64_t window = 0;
+    size_t begin = SIZE_MAX, next = 0;
+    for (size_t i = stream + 4; i < in_size && next == 0; ++i) {
+      for (int b = 7; b >= 0; --b) {
+        window = ((window << 1) | ((in[i] >> b) & 1)) & 0xFFFFFFFFFFFF;
+        if (window == BZ2_BLOCK_MAGIC || window == BZ2_EOS_MAGIC) {
+          const size_t pos = i * 8 + (8 - b) - 48;
+          if (begin != SIZE_MAX) blocks.push_back({begin, pos, level});
+          begin = pos;
+          if (window == BZ2_EOS_MAGIC) {
+            // needs the 32 bit crc after the end-of-stream marker
+            if (pos + 80 > in_size * 8) return {};
+            next = (pos + 80 + 7) / 8;
+            break;
+          }
+        }
+      }
+    }
+    if (next == 0) return {};
+    stream = next;
+  }
+  return blocks;
+}
+
+std::string decompressBZ2Parallel(const std::byte *in, size_t in_size, std::atomic<bool> *abort, int threads) {
+  const uint8_t *data = (const uint8_t *)in;
+  std::vector<BZ2Block> blocks = find_bz2_blocks(data, in_size);
+  if (blocks.size() < 2) return {};
+
+  std::vector<std::string> outputs(blocks.size());
+  bool ret = parallel_for(outputs.size(), threads, abort, [&](size_t i) {
+    // a magic number that happens to appear inside compressed data breaks the block, and fails the crc check here.
+    std::string block = bz2_block_stream(data, blocks[i].begin, blocks[i].end, blocks[i].level);
+    bz_stream strm = {};
+    BZ2_bzDecompressInit(&strm, 0, 0);
+    std::string &out = outputs[i];
+    out.resize(block.size() * 5);
+    strm.next_in = block.data();
+    strm.avail_in = block.size();
+    int bzerror = BZ_OK;
+    while (bzerror == BZ_OK) {
+      if (strm.total_out_lo32 == out.size()) out.resize(out.size() * 2);
+      strm.next_out = &out[strm.total_out_lo32];
+      strm.avail_out = out.size() - strm.total_out_lo32;
+      bzerror = BZ2_bzDecompress(&strm);
+      if (bzerror == BZ_OK && strm.avail_in == 0 && strm.avail_out > 0) break;
+    }
+    out.resize(strm.total_out_lo32);
+    BZ2_bzDecompressEnd(&strm);
+    return bzerror == BZ_STREAM_END;
+  });
+  if (!ret) return {};
+
+  size_t total = 0;
+  for (const auto &o : outputs) total += o.size();
+  std::string out;
+  out.reserve(total);
+  for (auto &o : outputs) {
+    out += o;
+    std::string().swap(o);
+  }
+  return out;
+}
+
+}  // namespace
+
+std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort, int threads) {
+  return decompressBZ2((std::byte *)in.data(), in.size(), abort, threads);
+}
+
+std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort, int threads) {
   if (in_size == 0) return {};
 
+  if (threads > 1) {
+    std::string out = decompressBZ2Parallel(in, in_size, abort, threads);
+    if (!out.empty() || (abort && *abort)) return out;
+    // fall back to sequential decoding, e.g. for corrupt files or files with a single block
+  }
+
   bz_stream strm = {};
   int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
   assert(bzerror == BZ_OK);
@@ -266,12 +508,26 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
   strm.next_in = (char *)in;
   strm.avail_in = in_size;
   std::string out(in_size * 5, '\0');
+  size_t stream_offset = 0;  // output of the previous streams
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
+    if (stream_offset + strm.total_out_lo32 == out.size()) out.resize(out.size() * 2);
+    strm.next_out = (char *)(&out[stream_offset + strm.total_out_lo32]);
+    strm.avail_out = out.size() - stream_offset - strm.total_out_lo32;
 
     const char *prev_write_pos = strm.next_out;
     bzerror = BZ2_bzDecompress(&strm);
+    if (bzerror == BZ_STREAM_END && strm.avail_in >= 4 && memcmp(strm.next_in, "BZh", 3) == 0) {
+      // concatenated streams, continue with the next one
+      stream_offset += strm.total_out_lo32;
+      char *next_in = strm.next_in;
+      const unsigned int avail_in = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      strm = {};
+      bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
+      continue;
+    }
     if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
       // content is corrupt
       bzerror = BZ_STREAM_END;
@@ -286,12 +542,141 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
 
   BZ2_bzDecompressEnd(&strm);
   if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
+    out.resize(stream_offset + strm.total_out_lo32);
     return out;
   }
   return {};
 }
 
+std::string decompressZST(const std::string &in, std::atomic<bool> *abort, int threads) {
+  return decompressZST((std::byte *)in.data(), in.size(), abort, threads);
+}
+
+std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort, int threads) {
+  if (in_size == 0) return {};
+
+  // frames that record their content size are decoded in parallel, straight into their place in the output.
+  struct Frame { size_t in_offset, in_size, out_offset, out_size; };
+  std::vector<Frame> frames;
+  size_t out_size = 0;
+  for (size_t pos = 0; pos < in_size;) {
+    size_t frame_size = ZSTD_findFrameCompressedSize(in + pos, in_size - pos);
+    unsigned long long content_size = ZSTD_isError(frame_size) ? ZSTD_CONTENTSIZE_ERROR : ZSTD_getFrameContentSize(in + pos, in_size - pos);
+    // the content size comes from the file. a size that logs can't compress to is not trusted
+    // for the allocation, the streaming decode below grows the output as data is produced instead.
+    if (content_size == ZSTD_CONTENTSIZE_ERROR || content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+        content_size > in_size * ZSTD_MAX_RATIO || out_size + content_size > in_size * ZSTD_MAX_RATIO) {
+      frames.clear();
+      break;
+    }
+    frames.push_back({pos, frame_size, out_size, (size_t)content_size});
+    out_size += content_size;
+    pos += frame_size;
+  }
+
+  if (!frames.empty()) {
+    std::string out(out_size, '\0');
+    bool ret = parallel_for(frames.size(), threads, abort, [&](size_t i) {
+      const Frame &f = frames[i];
+      size_t n = ZSTD_decompress(&out[f.out_offset], f.out_size, in + f.in_offset, f.in_size);
+      return !ZSTD_isError(n) && n == f.out_size;
+    });
+    if (ret) return out;
+    if (abort && *abort) return {};
+  }
+
+  // streaming decode for frames without a content size, or corrupt/truncated content
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  ZSTD_inBuffer input = {in, in_size, 0};
+  std::string out(in_size * 5, '\0');
+  size_t written = 0, ret = 0;
+  while (input.pos < input.size && !(abort && *abort)) {
+    if (written == out.size()) out.resize(out.size() * 2);
+    ZSTD_outBuffer output = {&out[written], out.size() - written, 0};
+    ret = ZSTD_decompressStream(dctx, &output, &input);
+    written += output.pos;
+    if (ZSTD_isError(ret)) {
+      rWarning("decompressZST error : %s", ZSTD_getErrorName(ret));
+      break;
+    }
+  }
+  // drain data buffered in the decoder
+  while (ret > 0 && !ZSTD_isError(ret) && !(abort && *abort)) {
+    if (written == out.size()) out.resize(out.size() * 2);
+    ZSTD_outBuffer output = {&out[written], out.size() - written, 0};
+    ret = ZSTD_decompressStream(dctx, &output, &input);
+    if (output.pos == 0) break;
+    written += output.pos;
+  }
+  ZSTD_freeDCtx(dctx);
+
+  if (abort && *abort) return {};
+  if (ret != 0) rWarning("decompressZST error : content is corrupt");
+  out.resize(written);
+  return out;
+}
+
+// class BZ2Stream
+
+struct BZ2Stream::Impl {
+  bz_stream strm = {};
+};
+
+BZ2Stream::BZ2Stream() : impl_(std::make_unique<Impl>()) {
+  int bzerror = BZ2_bzDecompressInit(&impl_->strm, 0, 0);
+  assert(bzerror == BZ_OK);
+}
+
+BZ2Stream::~BZ2Stream() {
+  BZ2_bzDecompressEnd(&impl_->strm);
+}
+
+ssize_t BZ2Stream::decompress(const char *&in, size_t &in_size, char *out, size_t out_size) {
+  if (out_size == 0 || (finished_ && in_size == 0)) return 0;
+
+  bz_stream &strm = impl_->strm;
+  if (finished_) {
+    if (trailing_) {
+      // not another stream, ignored like decompressBZ2 does
+      in += in_size;
+      in_size = 0;
+      return 0;
+    }
+    // concatenated streams, continue with the next one
+    BZ2_bzDecompressEnd(&strm);
+    strm = {};
+    int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+    assert(bzerror == BZ_OK);
+    finished_ = false;
+    next_stream_ = true;
+  }
+
+  strm.next_in = (char *)in;
+  strm.avail_in = in_size;
+  strm.next_out = out;
+  strm.avail_out = out_size;
+  int bzerror = BZ2_bzDecompress(&strm);
+
+  const size_t written = out_size - strm.avail_out;
+  const bool no_progress = in_size > 0 && written == 0 && strm.avail_in == in_size;
+  in = strm.next_in;
+  in_size = strm.avail_in;
+  if (bzerror == BZ_DATA_ERROR_MAGIC && next_stream_) {
+    // data after the last stream
+    finished_ = trailing_ = true;
+    in += in_size;
+    in_size = 0;
+    return 0;
+  }
+  if (bzerror == BZ_STREAM_END) {
+    finished_ = true;
+  } else if (bzerror != BZ_OK || no_progress) {
+    rWarning("BZ2Stream error : content is corrupt");
+    return -1;
+  }
+  return written;
+}
+
 void precise_nano_sleep(long sleep_ns) {
   const long estimate_ns = 1 * 1e6;  // 1ms
   struct timespec req = {.tv_nsec = estimate_ns};
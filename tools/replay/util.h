@@ -1,7 +1,10 @@
 #pragma once
 
+#include <sys/types.h>
+
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
 
 enum class ReplyMsgType {
@@ -22,12 +25,57 @@ void logMessage(ReplyMsgType type, const char* fmt, ...);
 
 std::string sha256(const std::string &str);
 void precise_nano_sleep(long sleep_ns);
-std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort = nullptr);
-std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort = nullptr, int threads = 1);
+std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr, int threads = 1);
+std::string decompressZST(const std::string &in, std::atomic<bool> *abort = nullptr, int threads = 1);
+std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr, int threads = 1);
 std::string getUrlWithoutQuery(const std::string &url);
 size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
 
+// called with each block of data as it arrives. return false to stop the transfer.
+typedef std::function<bool(const char *data, size_t size)> StreamDataHandler;
+bool httpGetStream(const std::string &url, const StreamDataHandler &handler, std::atomic<bool> *abort = nullptr);
+// download size bytes from offset, the server has to support range requests
+bool httpGetRange(const std::string &url, size_t offset, size_t size, const StreamDataHandler &handler, std::atomic<bool> *abort = nullptr);
+
+// incremental bz2 decoder for data that arrives in pieces.
+class BZ2Stream {
+public:
+  BZ2Stream();
+  ~BZ2Stream();
+  // decompress from in into out, advancing in/in_size past the consumed input.
+  // returns the number of bytes written to out (0 once it needs more input), or -1 if the content is corrupt.
+  // concatenated streams are decoded one after the other.
+  ssize_t decompress(const char *&in, size_t &in_size, char *out, size_t out_size);
+  // true if the input so far ends with a complete stream
+  inline bool finished() const { return finished_; }
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+  bool finished_ = false;
+  bool next_stream_ = false;  // decoding a stream after the first one
+  bool trailing_ = false;     // the input after the last stream is ignored
+};
+
+// wall time in ms spent in each stage of loading a file. the stages of a streamed file overlap
+// with the download, which is then only the time spent waiting for data.
+struct LoadTimings {
+  double download = 0;
+  double decompress = 0;
+  double parse = 0;
+  double index = 0;
+
+  LoadTimings &operator+=(const LoadTimings &t) {
+    download += t.download;
+    decompress += t.decompress;
+    parse += t.parse;
+    index += t.index;
+    return *this;
+  }
+};
+
 typedef std::function<void(uint64_t cur, uint64_t total, bool success)> DownloadProgressHandler;
 void installDownloadProgressHandler(DownloadProgressHandler);
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
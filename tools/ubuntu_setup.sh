@@ -63,6 +63,7 @@ function install_ubuntu_common_requirements() {
     libsqlite3-dev \
     libusb-1.0-0-dev \
     libzmq3-dev \
+    libzstd-dev \
     libsystemd-dev \
     locales \
     opencl-headers \